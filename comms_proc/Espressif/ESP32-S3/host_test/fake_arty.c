@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "arty_driver.h"
+#include "ftdi.h"
+#include "fake_arty.h"
+
+// Stands in for arty_driver.c: one FT2232H in slot 0 whose bulk OUT
+// transfers complete as soon as they are submitted. What is written to
+// the MPSSE endpoint is kept for the tests to inspect and run through a
+// model of the MPSSE driving the TAP described in fake_arty.h; the TDO
+// bits it reads come back from arty_receive_data().
+
+static usb_transfer_t transfers[ARTY_OUT_TRANSFER_COUNT];
+static uint8_t transfer_buffers[ARTY_OUT_TRANSFER_COUNT][ARTY_TRANSFER_SIZE];
+static QueueHandle_t out_free_queue;
+static SemaphoreHandle_t device_lock;
+
+struct fake_arty fake_arty;
+
+// Next state for TMS low and high, independent of the tables in ftdi.c
+static const tap_state_t tap_next[16][2] = {
+  [TAP_RESET]     = { TAP_IDLE,      TAP_RESET },
+  [TAP_IDLE]      = { TAP_IDLE,      TAP_DRSELECT },
+  [TAP_DRSELECT]  = { TAP_DRCAPTURE, TAP_IRSELECT },
+  [TAP_DRCAPTURE] = { TAP_DRSHIFT,   TAP_DREXIT1 },
+  [TAP_DRSHIFT]   = { TAP_DRSHIFT,   TAP_DREXIT1 },
+  [TAP_DREXIT1]   = { TAP_DRPAUSE,   TAP_DRUPDATE },
+  [TAP_DRPAUSE]   = { TAP_DRPAUSE,   TAP_DREXIT2 },
+  [TAP_DREXIT2]   = { TAP_DRSHIFT,   TAP_DRUPDATE },
+  [TAP_DRUPDATE]  = { TAP_IDLE,      TAP_DRSELECT },
+  [TAP_IRSELECT]  = { TAP_IRCAPTURE, TAP_RESET },
+  [TAP_IRCAPTURE] = { TAP_IRSHIFT,   TAP_IREXIT1 },
+  [TAP_IRSHIFT]   = { TAP_IRSHIFT,   TAP_IREXIT1 },
+  [TAP_IREXIT1]   = { TAP_IRPAUSE,   TAP_IRUPDATE },
+  [TAP_IRPAUSE]   = { TAP_IRPAUSE,   TAP_IREXIT2 },
+  [TAP_IREXIT2]   = { TAP_IRSHIFT,   TAP_IRUPDATE },
+  [TAP_IRUPDATE]  = { TAP_IDLE,      TAP_DRSELECT },
+};
+
+static struct {
+  tap_state_t state;
+  uint8_t ir_shift;
+  uint64_t dr_shift;
+  int dr_length;
+  // TMS keeps the level the last TMS command left it at
+  uint8_t tms;
+  // MPSSE command being parsed; commands may span transfers
+  uint8_t cmd[3];
+  int cmd_count;
+  uint32_t data_left;
+  // TDO bytes waiting to be read from the MPSSE endpoint
+  uint8_t read_fifo[65536];
+  uint32_t read_head;
+  uint32_t read_tail;
+} sim;
+
+static void sim_read_push(uint8_t byte)
+{
+  if (sim.read_tail - sim.read_head == sizeof(sim.read_fifo))
+  {
+    fprintf(stderr, "fake_arty: MPSSE read data never collected\n");
+    abort();
+  }
+  sim.read_fifo[sim.read_tail++ % sizeof(sim.read_fifo)] = byte;
+}
+
+static void tap_capture_dr(void)
+{
+  switch (fake_arty.ir)
+  {
+  case FAKE_ARTY_IR_IDCODE:
+    sim.dr_shift = FAKE_ARTY_IDCODE;
+    sim.dr_length = 32;
+    break;
+  case FAKE_ARTY_IR_USERCODE:
+    sim.dr_shift = FAKE_ARTY_USERCODE;
+    sim.dr_length = 32;
+    break;
+  case FAKE_ARTY_IR_CFG_IN:
+    sim.dr_shift = 0;
+    sim.dr_length = 0;
+    break;
+  default:
+    sim.dr_shift = 0;
+    sim.dr_length = 1;
+    break;
+  }
+}
+
+// One TCK cycle: returns TDO as sampled on the rising edge
+static uint8_t tap_clock(uint8_t tms, uint8_t tdi)
+{
+  uint8_t tdo = 0;
+  fake_arty.tck_cycles++;
+  switch (sim.state)
+  {
+  case TAP_IRCAPTURE:
+    sim.ir_shift = FAKE_ARTY_IR_CAPTURE;
+    break;
+  case TAP_IRSHIFT:
+    tdo = sim.ir_shift & 1;
+    sim.ir_shift = (sim.ir_shift >> 1) | (tdi << (FAKE_ARTY_IR_LENGTH - 1));
+    break;
+  case TAP_DRCAPTURE:
+    tap_capture_dr();
+    break;
+  case TAP_DRSHIFT:
+    if (sim.dr_length == 0)
+    {
+      fake_arty.cfg_in_bits++;
+      break;
+    }
+    tdo = sim.dr_shift & 1;
+    sim.dr_shift = (sim.dr_shift >> 1) | ((uint64_t)tdi << (sim.dr_length - 1));
+    break;
+  default:
+    break;
+  }
+  sim.state = tap_next[sim.state][tms & 1];
+  if (sim.state == TAP_RESET)
+    fake_arty.ir = FAKE_ARTY_IR_IDCODE;
+  else if (sim.state == TAP_IRUPDATE)
+    fake_arty.ir = sim.ir_shift;
+  return tdo;
+}
+
+// Clocks bit_count bits of tdi_bits LSB first and returns the TDO bits,
+// first bit lowest
+static uint8_t sim_clock_bits(int bit_count, uint8_t tdi_bits)
+{
+  uint8_t tdo = 0;
+  for (int i = 0; i < bit_count; i++)
+    tdo |= tap_clock(sim.tms, (tdi_bits >> i) & 1) << i;
+  return tdo;
+}
+
+static void sim_unknown(uint8_t op)
+{
+  fprintf(stderr, "fake_arty: MPSSE command 0x%02x is not modelled\n", op);
+  abort();
+}
+
+// Length in bytes of the command starting with op, data of byte-mode
+// shifts not included
+static int sim_command_length(uint8_t op)
+{
+  if ((op & 0x80) == 0)
+  {
+    if (op & 0x40)
+      return 3;
+    if (op & 0x02)
+      return (op & 0x10) ? 3 : 2;
+    return 3;
+  }
+  switch (op)
+  {
+  case 0x80:
+  case 0x82:
+  case 0x86:
+    return 3;
+  case 0x85:
+  case 0x87:
+  case 0x8A:
+  case 0x8B:
+  case 0x97:
+    return 1;
+  default:
+    sim_unknown(op);
+    return 1;
+  }
+}
+
+static void sim_command(void)
+{
+  uint8_t op = sim.cmd[0];
+  if (op & 0x80)
+  {
+    if (op == 0x86)
+      fake_arty.tck_divisor = sim.cmd[1] | (sim.cmd[2] << 8);
+    else if ((op == 0x8A) || (op == 0x8B))
+      fake_arty.tck_div5 = (op == 0x8B);
+    return;
+  }
+  // Only the JTAG shifts the firmware uses: LSB first, TDI out on the
+  // falling edge, TDO in on the rising edge
+  if ((op & 0x0F & ~0x02) != 0x09)
+    sim_unknown(op);
+  int bits = sim.cmd[1] + 1;
+  uint8_t tdo;
+  if (op & 0x40)
+  {
+    uint8_t data = sim.cmd[2];
+    tdo = 0;
+    for (int i = 0; i < bits; i++)
+    {
+      sim.tms = (data >> i) & 1;
+      tdo |= tap_clock(sim.tms, data >> 7) << i;
+    }
+  }
+  else if (op & 0x02)
+    tdo = sim_clock_bits(bits, (op & 0x10) ? sim.cmd[2] : 0);
+  else
+  {
+    uint32_t bytes = (sim.cmd[1] | (sim.cmd[2] << 8)) + 1;
+    if (op & 0x10)
+    {
+      sim.data_left = bytes;
+      return;
+    }
+    for (uint32_t i = 0; i < bytes; i++)
+    {
+      tdo = sim_clock_bits(8, 0);
+      if (op & 0x20)
+        sim_read_push(tdo);
+    }
+    return;
+  }
+  // Bit-mode reads shift in from the top of the byte
+  if (op & 0x20)
+    sim_read_push(tdo << (8 - bits));
+}
+
+static void sim_mpsse(const uint8_t *data, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    if (sim.data_left)
+    {
+      uint8_t tdo = sim_clock_bits(8, data[i]);
+      if (sim.cmd[0] & 0x20)
+        sim_read_push(tdo);
+      sim.data_left--;
+      continue;
+    }
+    sim.cmd[sim.cmd_count++] = data[i];
+    if (sim.cmd_count < sim_command_length(sim.cmd[0]))
+      continue;
+    sim_command();
+    sim.cmd_count = 0;
+  }
+}
+
+void fake_arty_init(void)
+{
+  memset(&fake_arty, 0, sizeof(fake_arty));
+  memset(&sim, 0, sizeof(sim));
+  sim.state = TAP_RESET;
+  sim.tms = 1;
+  fake_arty.ir = FAKE_ARTY_IR_IDCODE;
+  out_free_queue = xQueueCreate(ARTY_OUT_TRANSFER_COUNT, sizeof(usb_transfer_t *));
+  for (int i = 0; i < ARTY_OUT_TRANSFER_COUNT; i++)
+  {
+    usb_transfer_t *xfer = &transfers[i];
+    xfer->data_buffer = transfer_buffers[i];
+    xfer->data_buffer_size = ARTY_TRANSFER_SIZE;
+    xQueueSend(out_free_queue, &xfer, 0);
+  }
+  if (device_lock == NULL)
+    arty_driver_init();
+  ftdi_init();
+}
+
+void arty_driver_init(void)
+{
+  device_lock = xSemaphoreCreateMutex();
+}
+
+static void fake_arty_out(const uint8_t *data, int size, uint8_t EP)
+{
+  if (EP != FT2232H_MPSSE_WRITE_EP)
+    return;
+  if (fake_arty.mpsse_out_count + size <= sizeof(fake_arty.mpsse_out))
+    memcpy(fake_arty.mpsse_out + fake_arty.mpsse_out_count, data, size);
+  fake_arty.mpsse_out_count += size;
+  sim_mpsse(data, size);
+}
+
+int fake_arty_transfers_held(void)
+{
+  return ARTY_OUT_TRANSFER_COUNT - uxQueueMessagesWaiting(out_free_queue);
+}
+
+usb_transfer_t *arty_transfer_get(void)
+{
+  usb_transfer_t *xfer = NULL;
+  xQueueReceive(out_free_queue, &xfer, portMAX_DELAY);
+  return xfer;
+}
+
+void arty_transfer_submit(usb_transfer_t *xfer, int size, uint8_t EP)
+{
+  fake_arty_out(xfer->data_buffer, size, EP);
+  xQueueSend(out_free_queue, &xfer, 0);
+}
+
+// The real driver blocks until every transfer is back in the pool, so one
+// that was taken and never submitted would hang it; here that fails fast
+void arty_transfer_wait_idle(void)
+{
+  if (uxQueueMessagesWaiting(out_free_queue) != ARTY_OUT_TRANSFER_COUNT)
+  {
+    fprintf(stderr, "arty_transfer_wait_idle() with a transfer held back: the firmware would hang here\n");
+    abort();
+  }
+}
+
+void arty_transfer_data(uint8_t *data, int size, uint8_t EP)
+{
+  fake_arty_out(data, size, EP);
+}
+
+void arty_transfer_control(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi, uint16_t wInd, uint16_t total)
+{
+  ftdi_write_transfer();
+  arty_transfer_wait_idle();
+  fake_arty.control_count++;
+  // SIO_SET_LATENCY_TIMER_REQUEST
+  if ((bRequest == 0x09) && (wInd >= 1) && (wInd <= 2))
+    fake_arty.latency_timer[wInd - 1] = wValLo;
+}
+
+// Replies are already complete when the request is submitted, so an empty
+// FIFO here is what the firmware would see as a timeout
+uint16_t arty_receive_data(uint8_t *data, uint16_t size, uint8_t EP)
+{
+  uint16_t n = 0;
+  if (EP != FT2232H_MPSSE_READ_EP)
+    return 0;
+  while ((n < size) && (sim.read_head != sim.read_tail))
+    data[n++] = sim.read_fifo[sim.read_head++ % sizeof(sim.read_fifo)];
+  return n;
+}
+
+uint32_t arty_receive_peek(const uint8_t **data, uint32_t timeout_ms, uint8_t EP)
+{
+  return 0;
+}
+
+void arty_receive_consume(uint32_t len, uint8_t EP)
+{
+}
+
+void arty_receive_get_stats(uint8_t EP, struct arty_receive_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+}
+
+void arty_receive_reset_stats(uint8_t EP)
+{
+}
+
+void arty_receive_flush(uint8_t EP)
+{
+  if (EP == FT2232H_MPSSE_READ_EP)
+    sim.read_head = sim.read_tail;
+}
+
+int arty_find_device(const char *serial)
+{
+  return strcmp(serial, FAKE_ARTY_SERIAL) == 0 ? 0 : -1;
+}
+
+bool arty_device_present(int device)
+{
+  return device == 0;
+}
+
+const char *arty_device_serial(int device)
+{
+  return FAKE_ARTY_SERIAL;
+}
+
+void arty_select_device(int device)
+{
+  vTaskSetThreadLocalStoragePointer(NULL, ARTY_TLS_INDEX, (void *)(intptr_t)(device + 1));
+}
+
+int arty_current_device(void)
+{
+  intptr_t selected = (intptr_t)pvTaskGetThreadLocalStoragePointer(NULL, ARTY_TLS_INDEX);
+  return selected > 0 ? selected - 1 : 0;
+}
+
+bool arty_lock_device(int device, uint32_t timeout_ms)
+{
+  TickType_t wait = (timeout_ms == ARTY_LOCK_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+  return xSemaphoreTake(device_lock, wait) == pdTRUE;
+}
+
+void arty_unlock_device(int device)
+{
+  xSemaphoreGive(device_lock);
+}
+
+const char *arty_get_serial(void)
+{
+  return FAKE_ARTY_SERIAL;
+}
+
+usb_device_handle_t arty_get_device(void)
+{
+  return (usb_device_handle_t)&fake_arty;
+}
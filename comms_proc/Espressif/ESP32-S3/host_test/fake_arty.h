@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FAKE_ARTY_SERIAL "HOSTTEST0"
+
+// The simulated TAP: a 7-series FPGA alone on the chain. Instructions other
+// than these select BYPASS.
+#define FAKE_ARTY_IR_LENGTH 6
+#define FAKE_ARTY_IR_CAPTURE 0x11
+#define FAKE_ARTY_IR_CFG_IN 0x05
+#define FAKE_ARTY_IR_USERCODE 0x08
+#define FAKE_ARTY_IR_IDCODE 0x09
+#define FAKE_ARTY_IR_BYPASS 0x3F
+#define FAKE_ARTY_IDCODE 0x0362D093
+#define FAKE_ARTY_USERCODE 0xC0DE2024
+
+struct fake_arty {
+  // Bytes written to the MPSSE endpoint since fake_arty_init()
+  uint8_t mpsse_out[65536];
+  uint32_t mpsse_out_count;
+  uint32_t control_count;
+  // Latency timer last set on channel A and B
+  uint8_t latency_timer[2];
+  // What the MPSSE commands did to the TAP
+  uint64_t tck_cycles;
+  uint16_t tck_divisor;
+  bool tck_div5;
+  uint8_t ir;
+  // CFG_IN has no length; it counts the bits shifted into it
+  uint64_t cfg_in_bits;
+};
+
+extern struct fake_arty fake_arty;
+
+void fake_arty_init(void);
+// OUT transfers taken from the pool and not yet submitted
+int fake_arty_transfers_held(void);
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+// FreeRTOS on pthreads for the host tests. Queues are a ring under a mutex;
+// semaphores are queues of zero-sized items, as in FreeRTOS itself. Tasks
+// are detached threads and priorities are ignored.
+
+#define HOST_TLS_POINTERS 4
+
+int host_log_verbose;
+
+__attribute__((constructor)) static void host_log_init(void)
+{
+  host_log_verbose = getenv("HOST_TEST_VERBOSE") != NULL;
+}
+
+struct host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t count;
+  UBaseType_t head;
+  uint8_t *items;
+};
+
+struct host_task {
+  TaskFunction_t fn;
+  void *arg;
+};
+
+static __thread void *tls_pointers[HOST_TLS_POINTERS];
+
+int64_t esp_timer_get_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void deadline_after(struct timespec *ts, TickType_t ms)
+{
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000)
+  {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+// Waits on the queue's condition until ready() holds; the lock is held
+static bool queue_wait(struct host_queue *q, bool (*ready)(struct host_queue *), TickType_t wait)
+{
+  struct timespec deadline;
+  if (wait != portMAX_DELAY)
+    deadline_after(&deadline, wait);
+  while (!ready(q))
+  {
+    if (wait == 0)
+      return false;
+    if (wait == portMAX_DELAY)
+      pthread_cond_wait(&q->changed, &q->lock);
+    else if (pthread_cond_timedwait(&q->changed, &q->lock, &deadline) == ETIMEDOUT)
+      return ready(q);
+  }
+  return true;
+}
+
+static bool queue_has_space(struct host_queue *q)
+{
+  return q->count < q->length;
+}
+
+static bool queue_has_item(struct host_queue *q)
+{
+  return q->count > 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  struct host_queue *q = calloc(1, sizeof(*q));
+  if (q == NULL)
+    return NULL;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+  q->length = length;
+  q->item_size = item_size;
+  if (item_size)
+    q->items = calloc(length, item_size);
+  return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+  pthread_mutex_lock(&q->lock);
+  if (!queue_wait(q, queue_has_space, wait))
+  {
+    pthread_mutex_unlock(&q->lock);
+    return pdFALSE;
+  }
+  if (q->item_size)
+    memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+  q->count++;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+  pthread_mutex_lock(&q->lock);
+  if (!queue_wait(q, queue_has_item, wait))
+  {
+    pthread_mutex_unlock(&q->lock);
+    return pdFALSE;
+  }
+  if (q->item_size)
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+  q->head = (q->head + 1) % q->length;
+  q->count--;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  UBaseType_t count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->count = 0;
+  q->head = 0;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+  return pdPASS;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+  pthread_cond_destroy(&q->changed);
+  pthread_mutex_destroy(&q->lock);
+  free(q->items);
+  free(q);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+  return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  SemaphoreHandle_t sem = xQueueCreate(1, 0);
+  if (sem)
+    xSemaphoreGive(sem);
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+  SemaphoreHandle_t sem = xQueueCreate(max, 0);
+  for (UBaseType_t i = 0; sem && (i < initial); i++)
+    xSemaphoreGive(sem);
+  return sem;
+}
+
+static void *task_entry(void *arg)
+{
+  struct host_task task = *(struct host_task *)arg;
+  free(arg);
+  task.fn(task.arg);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+  struct host_task *task = malloc(sizeof(*task));
+  pthread_t thread;
+  if (task == NULL)
+    return pdFAIL;
+  task->fn = fn;
+  task->arg = arg;
+  if (pthread_create(&thread, NULL, task_entry, task) != 0)
+  {
+    free(task);
+    return pdFAIL;
+  }
+  pthread_detach(thread);
+  // Only ever compared against NULL by the sources under test
+  if (handle)
+    *handle = (TaskHandle_t)(uintptr_t)thread;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+  return xTaskCreate(fn, name, stack, arg, priority, handle);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  if (task == NULL)
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  struct timespec ts = { ticks / 1000, (long)(ticks % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+  return 5;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  return (TaskHandle_t)(uintptr_t)pthread_self();
+}
+
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index, void *value)
+{
+  tls_pointers[index] = value;
+}
+
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index)
+{
+  return tls_pointers[index];
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <stdio.h>
+
+// Errors always show; the rest only with HOST_TEST_VERBOSE set
+extern int host_log_verbose;
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E (%s) " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) do { if (host_log_verbose) fprintf(stderr, "W (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { if (host_log_verbose) fprintf(stderr, "I (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { } while (0)
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+// Host build: the ROM's CRC-32 (IEEE 802.3, reflected), bit by bit
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+  crc = ~crc;
+  while (len--)
+  {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
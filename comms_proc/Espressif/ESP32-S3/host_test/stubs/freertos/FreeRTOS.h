@@ -0,0 +1,23 @@
+#pragma once
+// Host build: just enough of the FreeRTOS API for the firmware sources under
+// test, implemented on pthreads in host_freertos.c
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef struct host_queue *QueueHandle_t;
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef struct host_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configMAX_PRIORITIES 25
@@ -0,0 +1,9 @@
+#pragma once
+#include "freertos/queue.h"
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+#define xSemaphoreTake(sem, wait) xQueueReceive((sem), NULL, (wait))
+#define xSemaphoreGive(sem) xQueueSend((sem), NULL, 0)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
@@ -0,0 +1,11 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index, void *value);
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index);
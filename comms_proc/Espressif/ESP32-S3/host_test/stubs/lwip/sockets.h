@@ -0,0 +1,8 @@
+#pragma once
+// Host build: lwIP's BSD socket API is the system one
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
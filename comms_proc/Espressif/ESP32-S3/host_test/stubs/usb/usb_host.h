@@ -0,0 +1,17 @@
+#pragma once
+// Host build: the parts of the ESP-IDF USB host types the FTDI layer touches
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct host_usb_device *usb_device_handle_t;
+
+typedef struct usb_transfer_s {
+    uint8_t *data_buffer;
+    size_t data_buffer_size;
+    int num_bytes;
+    int actual_num_bytes;
+    uint8_t bEndpointAddress;
+    usb_device_handle_t device_handle;
+    void (*callback)(struct usb_transfer_s *transfer);
+    void *context;
+} usb_transfer_t;
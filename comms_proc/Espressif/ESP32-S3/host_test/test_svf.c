@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "arty_driver.h"
+#include "ftdi.h"
+#include "bitstream.h"
+#include "svf.h"
+#include "fake_arty.h"
+
+// Plays SVF files through ../main/svf.c and jtag.c into the TAP simulated by
+// fake_arty: IDCODE, USERCODE and BYPASS checks, a mismatch that has to be
+// caught, and a long SDR into CFG_IN that is timed. The rate is what the
+// parser, JTAG queue and MPSSE encoding manage on this host, with the USB
+// link and TCK taken out, so it only compares builds of the firmware.
+
+#define LOAD_BITS (1 << 22)
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// jtag.c loads bitstreams, which the SVF player never does
+bitstream_t *bitstream_open(const char *filename) { return NULL; }
+uint32_t bitstream_read(bitstream_t *bs, uint8_t *buf, uint32_t len) { return 0; }
+bool bitstream_complete(bitstream_t *bs) { return false; }
+void bitstream_close(bitstream_t *bs) { }
+
+static const char checks_svf[] =
+  "! Device checks\n"
+  "TRST ABSENT;\n"
+  "ENDIR IDLE;\n"
+  "ENDDR IDLE;\n"
+  "FREQUENCY 1E6 HZ;\n"
+  "STATE RESET;\n"
+  "STATE IDLE;\n"
+  "SIR 6 TDI (09) TDO (11) MASK (03);\n"
+  "SDR 32 TDI (00000000) TDO (0362D093) MASK (0FFFFFFF);\n"
+  "SIR 6 TDI (08);\n"
+  "SDR 32 TDI (00000000) TDO (C0DE2024);\n"
+  "SIR 6 TDI (3F);\n"
+  "SDR 64 TDI (80000000000000F3) TDO (00000000000001E6);\n";
+
+// Line 5 expects the wrong IDCODE
+static const char mismatch_svf[] =
+  "STATE RESET;\n"
+  "STATE IDLE;\n"
+  "SIR 6 TDI (09);\n"
+  "RUNTEST 10 TCK;\n"
+  "SDR 32 TDI (00000000) TDO (0362D094);\n"
+  "SIR 6 TDI (3F);\n";
+
+static char *write_svf(const char *head, uint32_t load_bits)
+{
+  static char name[32];
+  strcpy(name, "/tmp/test_svf_XXXXXX");
+  int fd = mkstemp(name);
+  FILE *f = fdopen(fd, "w");
+  fputs(head, f);
+  if (load_bits)
+  {
+    fprintf(f, "SIR 6 TDI (05);\nSDR %u TDI (", load_bits);
+    for (uint32_t i = 0; i < load_bits / 4; i++)
+    {
+      fputc("0123456789ABCDEF"[(i * 7) & 15], f);
+      if (i % 64 == 63)
+        fputc('\n', f);
+    }
+    fputs(");\n", f);
+  }
+  fclose(f);
+  return name;
+}
+
+int main(void)
+{
+  struct svf_result result;
+
+  fake_arty_init();
+  arty_select_device(0);
+  uint32_t tck = ftdi_mpsse_get_frequency();
+
+  char *name = write_svf(checks_svf, LOAD_BITS);
+  CHECK(svf_play(name, &result));
+  unlink(name);
+  CHECK(result.checks == 4);
+  CHECK(result.failed_checks == 0);
+  CHECK(fake_arty.cfg_in_bits == LOAD_BITS);
+  CHECK(result.bits >= LOAD_BITS);
+  // FREQUENCY lasts for the file only
+  CHECK(ftdi_mpsse_get_frequency() == tck);
+  CHECK(fake_arty.tck_divisor == 30000000 / tck - 1);
+  CHECK(fake_arty_transfers_held() == 0);
+  double bits_per_s = result.time_us ? result.bits * 1e6 / result.time_us : 0;
+
+  name = write_svf(mismatch_svf, 0);
+  CHECK(!svf_play(name, &result));
+  unlink(name);
+  CHECK(result.failed_checks == 1);
+  CHECK(result.fail_at == 5);
+  CHECK(fake_arty_transfers_held() == 0);
+
+  printf("svf: %s\n", failures ? "FAIL" : "PASS");
+  printf("%u-bit SDR: %.0f bits/s on this host\n", LOAD_BITS, bits_per_s);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "arty_driver.h"
+#include "ftdi.h"
+#include "fake_arty.h"
+
+// Setting TCK before the MPSSE is set up must not leave bytes in a held
+// transfer: the next control request waits for every transfer to come back
+// and on the ESP32 would wait forever. fake_arty aborts instead.
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static bool sent(const uint8_t *seq, int len, uint32_t from)
+{
+  for (uint32_t i = from; i + len <= fake_arty.mpsse_out_count; i++)
+    if (memcmp(fake_arty.mpsse_out + i, seq, len) == 0)
+      return true;
+  return false;
+}
+
+int main(void)
+{
+  fake_arty_init();
+  arty_select_device(0);
+
+  // As JTAGSetTCK and JTAGProgramFPGA do before anything else
+  CHECK(ftdi_mpsse_set_frequency(1000000) == 1000000);
+  CHECK(fake_arty.mpsse_out_count == 0);
+  CHECK(fake_arty_transfers_held() == 0);
+  ftdi_mpsse_open();
+  const uint8_t tck_1mhz[] = { 0x8A, 0x86, 29, 0 };
+  CHECK(sent(tck_1mhz, sizeof(tck_1mhz), 0));
+
+  // Once set up a new rate goes out straight away
+  uint32_t mark = fake_arty.mpsse_out_count;
+  CHECK(ftdi_mpsse_set_frequency(100) == 100);
+  const uint8_t tck_100hz[] = { 0x8B, 0x86, 59999 & 0xff, 59999 >> 8 };
+  CHECK(sent(tck_100hz, sizeof(tck_100hz), mark));
+  CHECK(fake_arty_transfers_held() == 0);
+
+  // A rate the divisor cannot hit exactly is sent again unchanged
+  uint32_t tck = ftdi_mpsse_set_frequency(4300000);
+  CHECK(tck == 30000000 / 7);
+  ftdi_mpsse_setup_lost();
+  mark = fake_arty.mpsse_out_count;
+  ftdi_mpsse_open();
+  const uint8_t tck_odd[] = { 0x8A, 0x86, 6, 0 };
+  CHECK(sent(tck_odd, sizeof(tck_odd), mark));
+  CHECK(ftdi_mpsse_get_frequency() == tck);
+
+  // A control request sends what the task still holds before waiting
+  mark = fake_arty.mpsse_out_count;
+  ftdi_buffer_write_byte(0x87);
+  ftdi_mpsse_purge();
+  CHECK(fake_arty.mpsse_out_count > mark);
+  CHECK(fake_arty.mpsse_out[fake_arty.mpsse_out_count - 1] == 0x87);
+
+  printf("tck: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "fake_arty.h"
+
+// Runs an XVC session of ../main/appxvc.c against a client on the other end
+// of a socket pair, with the MPSSE and TAP simulated by fake_arty. Checks
+// the session holds the board and forgets the cached bitstream, the TCK it
+// reports and puts back, the latency timer it leaves, IDCODE and USERCODE
+// reads through every kind of shift ftdi_shift_vectors() makes, and a
+// BYPASS loop; then times long shifts. A client that stays connected
+// without sending must lose the board after the idle timeout.
+
+#define CONFIG_XVC_PORT 2542
+#define CONFIG_XVC_IDLE_TIMEOUT 1
+#include "../main/appxvc.c"
+
+#define BENCH_SHIFTS 200
+
+static int failures;
+static int cache_forgotten;
+
+void write_bitstream_cache(const char* serial, const uint8_t* sha256, uint32_t usercode)
+{
+  if (sha256 == NULL && strcmp(serial, FAKE_ARTY_SERIAL) == 0)
+    cache_forgotten++;
+}
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+struct session {
+  int sock;
+  SemaphoreHandle_t done;
+};
+
+static void session_task(void *arg)
+{
+  struct session *session = arg;
+  arty_select_device(0);
+  xvc_session(0, session->sock);
+  xSemaphoreGive(session->done);
+  vTaskDelete(NULL);
+}
+
+// The TMS and TDI bits of one shift command and the TDO it reads back
+struct vector {
+  uint8_t tms[XVC_MAX_VECTOR_BYTES];
+  uint8_t tdi[XVC_MAX_VECTOR_BYTES];
+  uint8_t tdo[XVC_MAX_VECTOR_BYTES];
+  uint32_t bits;
+};
+
+static void vector_add(struct vector *v, int tms, int tdi)
+{
+  if (v->bits == 0)
+  {
+    memset(v->tms, 0, sizeof(v->tms));
+    memset(v->tdi, 0, sizeof(v->tdi));
+  }
+  v->tms[v->bits / 8] |= (tms & 1) << (v->bits % 8);
+  v->tdi[v->bits / 8] |= (tdi & 1) << (v->bits % 8);
+  v->bits++;
+}
+
+// Adds each character of path as a TMS bit with TDI low
+static void vector_tms(struct vector *v, const char *path)
+{
+  for (; *path; path++)
+    vector_add(v, *path == '1', 0);
+}
+
+static uint32_t vector_tdo(struct vector *v, uint32_t pos, int bits)
+{
+  uint32_t val = 0;
+  for (int i = 0; i < bits; i++)
+    val |= (uint32_t)((v->tdo[(pos + i) / 8] >> ((pos + i) % 8)) & 1) << i;
+  return val;
+}
+
+static bool xvc_shift(int sock, struct vector *v)
+{
+  uint8_t word[4];
+  uint32_t bytes = DIV_ROUND_UP(v->bits, 8);
+  xvc_put_u32(word, v->bits);
+  bool ok = xvc_send_all(sock, "shift:", 6) && xvc_send_all(sock, word, 4) &&
+            xvc_send_all(sock, v->tms, bytes) && xvc_send_all(sock, v->tdi, bytes) &&
+            xvc_recv_all(sock, v->tdo, bytes);
+  v->bits = 0;
+  return ok;
+}
+
+// From Run-Test/Idle through Shift-IR and back, loading ir
+static void vector_ir(struct vector *v, uint8_t ir)
+{
+  vector_tms(v, "1100");
+  for (int i = 0; i < FAKE_ARTY_IR_LENGTH; i++)
+    vector_add(v, i == FAKE_ARTY_IR_LENGTH - 1, ir >> i);
+  vector_tms(v, "10");
+}
+
+int main(void)
+{
+  static struct vector v;
+  int socks[2];
+  uint8_t word[4];
+  char info[32];
+
+  fake_arty_init();
+  uint32_t tck = ftdi_mpsse_get_frequency();
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+  // A session that dies leaves the client waiting for a reply
+  struct timeval timeout = { 5, 0 };
+  setsockopt(socks[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct session session = { socks[0], xSemaphoreCreateBinary() };
+  xTaskCreate(session_task, "xvc", XVC_TASK_STACK, &session, XVC_TASK_PRIORITY, NULL);
+
+  const char *expect_info = "xvcServer_v1.0:2048\n";
+  CHECK(xvc_send_all(socks[1], "getinfo:", 8));
+  CHECK(xvc_recv_all(socks[1], info, strlen(expect_info)));
+  CHECK(memcmp(info, expect_info, strlen(expect_info)) == 0);
+
+  // Once the session answers it holds the board
+  CHECK(!arty_lock_device(0, 0));
+  CHECK(cache_forgotten == 1);
+
+  // 1000 ns is 1 MHz, 30 MHz / 30 exactly
+  xvc_put_u32(word, 1000);
+  CHECK(xvc_send_all(socks[1], "settck:", 7) && xvc_send_all(socks[1], word, 4));
+  CHECK(xvc_recv_all(socks[1], word, 4));
+  CHECK(xvc_get_u32(word) == 1000);
+  CHECK(fake_arty.tck_divisor == 29 && !fake_arty.tck_div5);
+
+  // Reset selects IDCODE; read it with the shift's last bit leaving Shift-DR
+  vector_tms(&v, "111110100");
+  uint32_t pos = v.bits;
+  for (int i = 0; i < 32; i++)
+    vector_add(&v, i == 31, 0);
+  vector_tms(&v, "10");
+  CHECK(xvc_shift(socks[1], &v));
+  CHECK(vector_tdo(&v, pos, 32) == FAKE_ARTY_IDCODE);
+  // Replies come back on the short latency timer
+  CHECK(fake_arty.latency_timer[0] == FTDI_LATENCY_INTERACTIVE_MS);
+
+  // USERCODE in two halves with a pause between, so a data shift has to
+  // follow a TMS command that left TMS high
+  vector_ir(&v, FAKE_ARTY_IR_USERCODE);
+  vector_tms(&v, "100");
+  pos = v.bits;
+  for (int i = 0; i < 16; i++)
+    vector_add(&v, i == 15, 0);
+  vector_tms(&v, "0000000000010");
+  uint32_t pos2 = v.bits;
+  for (int i = 0; i < 16; i++)
+    vector_add(&v, i == 15, 0);
+  vector_tms(&v, "10");
+  CHECK(xvc_shift(socks[1], &v));
+  // Capture-IR is the fourth bit from Run-Test/Idle
+  CHECK(vector_tdo(&v, 4, FAKE_ARTY_IR_LENGTH) == FAKE_ARTY_IR_CAPTURE);
+  CHECK(fake_arty.ir == FAKE_ARTY_IR_USERCODE);
+  CHECK((vector_tdo(&v, pos, 16) | (vector_tdo(&v, pos2, 16) << 16)) == FAKE_ARTY_USERCODE);
+
+  // BYPASS delays TDI by one bit; the shift is longer than the MPSSE read
+  // buffer, so it takes more than one flush
+  uint32_t loop_bits = 8 * XVC_MAX_VECTOR_BYTES - 64;
+  vector_ir(&v, FAKE_ARTY_IR_BYPASS);
+  vector_tms(&v, "100");
+  pos = v.bits;
+  srand(1);
+  uint8_t *pattern = malloc(loop_bits);
+  for (uint32_t i = 0; i < loop_bits; i++)
+  {
+    pattern[i] = rand() & 1;
+    vector_add(&v, i == loop_bits - 1, pattern[i]);
+  }
+  vector_tms(&v, "10");
+  CHECK(xvc_shift(socks[1], &v));
+  CHECK(fake_arty.ir == FAKE_ARTY_IR_BYPASS);
+  int mismatches = 0;
+  for (uint32_t i = 1; i < loop_bits; i++)
+    mismatches += vector_tdo(&v, pos + i, 1) != pattern[i - 1];
+  CHECK(mismatches == 0);
+  free(pattern);
+
+  // Time long data shifts through the session, socket and MPSSE model
+  int64_t start = esp_timer_get_time();
+  uint64_t shifted = 0;
+  for (int n = 0; n < BENCH_SHIFTS; n++)
+  {
+    vector_tms(&v, "100");
+    for (uint32_t i = 0; i < loop_bits; i++)
+      vector_add(&v, i == loop_bits - 1, i >> 3);
+    vector_tms(&v, "10");
+    shifted += v.bits;
+    if (!xvc_shift(socks[1], &v))
+    {
+      CHECK(false);
+      break;
+    }
+  }
+  int64_t us = esp_timer_get_time() - start;
+
+  // The board is free again once the client goes
+  close(socks[1]);
+  CHECK(xSemaphoreTake(session.done, 5000) == pdTRUE);
+  CHECK(arty_lock_device(0, 0));
+  arty_unlock_device(0);
+  CHECK(ftdi_tap_get_state() == TAP_IDLE);
+  CHECK(ftdi_mpsse_get_frequency() == tck);
+  CHECK(fake_arty.tck_divisor == 30000000 / tck - 1);
+  CHECK(fake_arty_transfers_held() == 0);
+  // An idle board does not send status packets every millisecond
+  CHECK(fake_arty.latency_timer[0] == FTDI_LATENCY_BULK_MS);
+  CHECK(ftdi_get_latency_mode(FTDI_CHANNEL_B) == FTDI_LATENCY_BULK);
+
+  // An idle client is dropped and the board freed, though it never closes
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+  session.sock = socks[0];
+  xTaskCreate(session_task, "xvc", XVC_TASK_STACK, &session, XVC_TASK_PRIORITY, NULL);
+  CHECK(xvc_send_all(socks[1], "getinfo:", 8));
+  CHECK(xvc_recv_all(socks[1], info, strlen(expect_info)));
+  CHECK(xSemaphoreTake(session.done, 3000) == pdTRUE);
+  CHECK(arty_lock_device(0, 0));
+  arty_unlock_device(0);
+  close(socks[0]);
+  close(socks[1]);
+
+  printf("xvc: %s\n", failures ? "FAIL" : "PASS");
+  printf("%d shifts of %u bits: %.1f Mbit/s on this host\n", BENCH_SHIFTS, loop_bits + 5, us ? shifted / (double)us : 0.0);
+  return failures ? 1 : 0;
+}
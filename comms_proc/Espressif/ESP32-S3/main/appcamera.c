@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include <mqtt_client.h>
+#include "appmqtt.h"
+#include "appstate.h"
+#include "arty_driver.h"
+#include "ftdi.h"
+#include "esp_timer.h"
+#include "softcore_frame.h"
+#include "appcamera.h"
+
+// Camera frames from capture_and_transmit() in the edgetestbed firmware
+// arrive on channel B as a plain byte stream. A task per board cuts them
+// out at their markers into PSRAM buffers, and one publisher task sends
+// each completed frame as numbered chunks, so reading never waits on MQTT
+// for longer than it takes to swap buffers. Messages are short and are
+// published by the task itself; the IN ring absorbs the wait.
+
+#define CAMERA_TASK_STACK 4096
+#define CAMERA_TASK_PRIORITY 3
+#define CAMERA_PUBLISH_TASK_STACK 4096
+#define CAMERA_PEEK_TIMEOUT_MS 100
+#define CAMERA_STOP_TIMEOUT_MS 500
+#define CAMERA_JPEG_SOI 0xFFD8
+#define CAMERA_JPEG_EOI 0xFFD9
+#define CAMERA_RAW_TRAILER 0x01020408
+
+struct camera_stream;
+
+struct camera_frame {
+  struct camera_stream *stream;
+  uint8_t *data;
+  uint32_t len;
+  uint32_t seq;
+  camera_format_t format;
+};
+
+struct camera_stream {
+  int device;
+  TaskHandle_t task;
+  volatile bool running;
+  camera_format_t format;
+  // Channel B latency mode from before the stream, put back by stop
+  ftdi_latency_mode_t latency;
+  struct camera_frame frames[CAMERA_FRAME_BUFFERS];
+  QueueHandle_t free_frames;
+  // Buffer of the frame being assembled, taken when its first byte arrives
+  struct camera_frame *current;
+  bool in_frame;
+  // Counter to charge the frame being assembled to, NULL if it is kept
+  uint32_t *drop;
+  // Last four bytes received, for spotting the markers
+  uint32_t history;
+  // Message being assembled in the messages format; in_frame is false
+  // until the first delimiter, as the stream may be joined mid-message
+  uint8_t message[CAMERA_MESSAGE_MAX_SIZE + 1];
+  uint32_t message_len;
+  struct softcore_frame_decoder decoder;
+  struct camera_stream_stats stats;
+  int64_t stats_start_us;
+};
+
+static const char *TAG = "appcamera";
+
+static struct camera_stream streams[ARTY_MAX_DEVICES];
+static QueueHandle_t full_frames;
+
+static void camera_put_u32(uint8_t *bytes, uint32_t val)
+{
+  bytes[0] = val & 255;
+  bytes[1] = (val >> 8) & 255;
+  bytes[2] = (val >> 16) & 255;
+  bytes[3] = (val >> 24) & 255;
+}
+
+static void camera_put_u16(uint8_t *bytes, uint16_t val)
+{
+  bytes[0] = val & 255;
+  bytes[1] = (val >> 8) & 255;
+}
+
+static void camera_frame_begin(struct camera_stream *s)
+{
+  s->in_frame = true;
+  s->drop = NULL;
+  if (s->current != NULL)
+    s->current->len = 0;
+}
+
+static void camera_frame_append(struct camera_stream *s, uint8_t c)
+{
+  if (s->drop != NULL)
+    return;
+  if (s->current == NULL)
+  {
+    if (xQueueReceive(s->free_frames, &s->current, 0) != pdTRUE)
+    {
+      s->current = NULL;
+      s->drop = &s->stats.dropped_busy;
+      return;
+    }
+    s->current->len = 0;
+  }
+  if (s->current->len == CAMERA_FRAME_MAX_SIZE)
+  {
+    s->drop = &s->stats.dropped_oversize;
+    return;
+  }
+  s->current->data[s->current->len++] = c;
+}
+
+// Every frame takes a sequence number, published or not
+static void camera_frame_end(struct camera_stream *s)
+{
+  uint32_t seq = s->stats.next_seq++;
+  s->in_frame = false;
+  if (s->drop != NULL)
+  {
+    (*s->drop)++;
+    return;
+  }
+  if (!isMQTTConnected())
+  {
+    s->stats.dropped_offline++;
+    return;
+  }
+  if (s->current == NULL)
+    return;
+  s->current->seq = seq;
+  s->current->format = s->format;
+  // Holds every buffer of every board, so this never waits
+  xQueueSend(full_frames, &s->current, portMAX_DELAY);
+  s->current = NULL;
+  s->stats.frames++;
+}
+
+static void camera_message_feed(struct camera_stream *s, const uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+  {
+    if (s->message_len < CAMERA_MESSAGE_MAX_SIZE)
+      s->message[s->message_len] = data[i];
+    s->message_len++;
+    if (data[i] != SOFTCORE_FRAME_DELIMITER)
+      continue;
+    if (!s->in_frame)
+      s->in_frame = true;
+    else if (s->message_len > CAMERA_MESSAGE_MAX_SIZE)
+      s->stats.dropped_oversize++;
+    else
+      softcore_frame_process(&s->decoder, s->message, s->message_len);
+    s->message_len = 0;
+  }
+}
+
+static void camera_stream_feed(struct camera_stream *s, const uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+  {
+    uint8_t c = data[i];
+    s->history = (s->history << 8) | c;
+    if (s->format == CAMERA_FORMAT_JPEG)
+    {
+      if (s->in_frame)
+      {
+        camera_frame_append(s, c);
+        if ((s->history & 0xFFFF) == CAMERA_JPEG_EOI)
+          camera_frame_end(s);
+      }
+      else if ((s->history & 0xFFFF) == CAMERA_JPEG_SOI)
+      {
+        camera_frame_begin(s);
+        camera_frame_append(s, CAMERA_JPEG_SOI >> 8);
+        camera_frame_append(s, CAMERA_JPEG_SOI & 0xFF);
+      }
+    }
+    else if (s->history == CAMERA_RAW_TRAILER)
+    {
+      // Raw frames have no start marker: the stream may have been joined
+      // mid-frame, so the first trailer only tells where the next one starts
+      if (s->in_frame)
+      {
+        camera_frame_append(s, c);
+        camera_frame_end(s);
+      }
+      camera_frame_begin(s);
+    }
+    else if (s->in_frame)
+    {
+      camera_frame_append(s, c);
+    }
+  }
+}
+
+static void camera_publish_task(void *arg)
+{
+  static uint8_t chunk[CAMERA_CHUNK_HEADER_SIZE + CAMERA_CHUNK_SIZE];
+  struct camera_frame *frame;
+
+  while (1)
+  {
+    if (xQueueReceive(full_frames, &frame, portMAX_DELAY) != pdTRUE)
+      continue;
+    char *topic = NULL;
+    if (asprintf(&topic, "/%s/camera/%s", getHostname(), arty_device_serial(frame->stream->device)) > 0)
+    {
+      uint16_t count = DIV_ROUND_UP(frame->len, CAMERA_CHUNK_SIZE);
+      camera_put_u32(chunk, frame->seq);
+      camera_put_u32(chunk + 4, frame->len);
+      camera_put_u16(chunk + 10, count);
+      chunk[12] = frame->format;
+      memset(chunk + 13, 0, CAMERA_CHUNK_HEADER_SIZE - 13);
+      // A frame cut short by a disconnect shows up as missing chunks
+      for (uint16_t i = 0; (i < count) && isMQTTConnected(); i++)
+      {
+        uint32_t offset = (uint32_t)i * CAMERA_CHUNK_SIZE;
+        uint32_t n = frame->len - offset < CAMERA_CHUNK_SIZE ? frame->len - offset : CAMERA_CHUNK_SIZE;
+        camera_put_u16(chunk + 8, i);
+        memcpy(chunk + CAMERA_CHUNK_HEADER_SIZE, frame->data + offset, n);
+        appmqtt_send_msg_n(topic, (char *)chunk, CAMERA_CHUNK_HEADER_SIZE + n);
+      }
+      free(topic);
+    }
+    xQueueSend(frame->stream->free_frames, &frame, 0);
+  }
+}
+
+static void camera_stream_task(void *arg)
+{
+  struct camera_stream *s = arg;
+  arty_select_device(s->device);
+
+  ESP_LOGI(TAG, "Streaming %s from board %s", s->format == CAMERA_FORMAT_JPEG ? "JPEG frames" : \
+           s->format == CAMERA_FORMAT_RAW ? "raw frames" : "messages", arty_device_serial(s->device));
+  while (s->running && arty_device_present(s->device))
+  {
+    const uint8_t *data;
+    uint32_t n = ftdi_uart_peek(&data, CAMERA_PEEK_TIMEOUT_MS);
+    if (n == 0)
+      continue;
+    if (s->format == CAMERA_FORMAT_MESSAGES)
+      camera_message_feed(s, data, n);
+    else
+      camera_stream_feed(s, data, n);
+    ftdi_uart_consume(n);
+    s->stats.bytes += n;
+  }
+  ESP_LOGI(TAG, "Stopped streaming from board %s", arty_device_serial(s->device));
+  s->running = false;
+  s->task = NULL;
+  vTaskDelete(NULL);
+}
+
+// The frame buffers stay allocated once a board has streamed, as the
+// publisher may still hold one when the stream is stopped
+static bool camera_stream_alloc(struct camera_stream *s)
+{
+  if (s->free_frames != NULL)
+    return true;
+  for (int i = 0; i < CAMERA_FRAME_BUFFERS; i++)
+  {
+    s->frames[i].stream = s;
+    s->frames[i].data = heap_caps_malloc(CAMERA_FRAME_MAX_SIZE, MALLOC_CAP_SPIRAM);
+    if (s->frames[i].data == NULL)
+    {
+      ESP_LOGE(TAG, "No PSRAM for %d frame buffers of %d bytes", CAMERA_FRAME_BUFFERS, CAMERA_FRAME_MAX_SIZE);
+      for (int j = 0; j < i; j++)
+      {
+        heap_caps_free(s->frames[j].data);
+        s->frames[j].data = NULL;
+      }
+      return false;
+    }
+  }
+  s->free_frames = xQueueCreate(CAMERA_FRAME_BUFFERS, sizeof(struct camera_frame *));
+  for (int i = 0; i < CAMERA_FRAME_BUFFERS; i++)
+  {
+    struct camera_frame *frame = &s->frames[i];
+    xQueueSend(s->free_frames, &frame, 0);
+  }
+  return true;
+}
+
+bool camera_stream_start(camera_format_t format, uint32_t baud_rate)
+{
+  int device = arty_current_device();
+  if (!arty_device_present(device) || (format == CAMERA_FORMAT_OFF))
+    return false;
+  struct camera_stream *s = &streams[device];
+  camera_stream_stop();
+  if (s->task != NULL)
+  {
+    ESP_LOGE(TAG, "Stream of board %s did not stop", arty_device_serial(device));
+    return false;
+  }
+  bool images = (format != CAMERA_FORMAT_MESSAGES);
+  if (images && (full_frames == NULL))
+  {
+    full_frames = xQueueCreate(ARTY_MAX_DEVICES * CAMERA_FRAME_BUFFERS, sizeof(struct camera_frame *));
+    if (xTaskCreate(camera_publish_task, "camera_publish", CAMERA_PUBLISH_TASK_STACK, NULL, CAMERA_TASK_PRIORITY, NULL) != pdPASS)
+    {
+      ESP_LOGE(TAG, "Cannot start the publisher task");
+      vQueueDelete(full_frames);
+      full_frames = NULL;
+      return false;
+    }
+  }
+  if (images && !camera_stream_alloc(s))
+    return false;
+  s->device = device;
+  s->decoder.board = arty_device_serial(device);
+  s->message_len = 0;
+  if (s->stats_start_us == 0)
+    s->stats_start_us = esp_timer_get_time();
+  s->format = format;
+  s->in_frame = false;
+  s->drop = NULL;
+  s->history = 0;
+  // Channel B is set up here, under the caller's board lock, and only
+  // read by the task; commands that would reconfigure or read it check
+  // camera_stream_active() first
+  s->latency = ftdi_get_latency_mode(FTDI_CHANNEL_B);
+  ftdi_set_latency_mode(FTDI_CHANNEL_B, FTDI_LATENCY_BULK);
+  // Matches the uart_configure() of the firmware's own test scripts
+  ftdi_uart_configure(8, baud_rate, XON_XOFF, FTDI_UART_BASE_CLOCK);
+  s->running = true;
+  if (xTaskCreate(camera_stream_task, "camera_stream", CAMERA_TASK_STACK, s, CAMERA_TASK_PRIORITY, &s->task) != pdPASS)
+  {
+    ESP_LOGE(TAG, "Cannot start a stream task for board %s", arty_device_serial(device));
+    ftdi_set_latency_mode(FTDI_CHANNEL_B, s->latency);
+    s->running = false;
+    s->task = NULL;
+    return false;
+  }
+  return true;
+}
+
+void camera_stream_stop(void)
+{
+  int device = arty_current_device();
+  struct camera_stream *s = &streams[device];
+  if (s->task == NULL)
+    return;
+  s->running = false;
+  for (int waited = 0; (s->task != NULL) && (waited < CAMERA_STOP_TIMEOUT_MS); waited += 10)
+    vTaskDelay(pdMS_TO_TICKS(10));
+  if (arty_device_present(device))
+    ftdi_set_latency_mode(FTDI_CHANNEL_B, s->latency);
+}
+
+bool camera_stream_active(void)
+{
+  return streams[arty_current_device()].task != NULL;
+}
+
+camera_format_t camera_stream_format(void)
+{
+  struct camera_stream *s = &streams[arty_current_device()];
+  return s->running ? s->format : CAMERA_FORMAT_OFF;
+}
+
+void camera_stream_get_stats(struct camera_stream_stats *stats)
+{
+  struct camera_stream *s = &streams[arty_current_device()];
+  *stats = s->stats;
+  stats->messages = s->decoder.stats;
+  stats->elapsed_us = s->stats_start_us ? esp_timer_get_time() - s->stats_start_us : 0;
+}
+
+// Sequence numbers carry on, so subscribers do not see a restart as a gap
+void camera_stream_reset_stats(void)
+{
+  struct camera_stream *s = &streams[arty_current_device()];
+  uint32_t next_seq = s->stats.next_seq;
+  memset(&s->stats, 0, sizeof(s->stats));
+  memset(&s->decoder.stats, 0, sizeof(s->decoder.stats));
+  s->stats.next_seq = next_seq;
+  s->stats_start_us = esp_timer_get_time();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "softcore_frame.h"
+
+// Largest frame reassembled, the size of the ArduCAM's FIFO plus the
+// firmware's counters and trailer. Two of these per board live in PSRAM.
+#define CAMERA_FRAME_MAX_SIZE (384 * 1024 + 64)
+#define CAMERA_FRAME_BUFFERS 2
+// Frame bytes per MQTT message, after a CAMERA_CHUNK_HEADER_SIZE header of
+//   frame sequence (u32), frame length (u32), chunk index (u16),
+//   chunk count (u16), format (u8) and three reserved bytes, little-endian
+#define CAMERA_CHUNK_SIZE 4096
+#define CAMERA_CHUNK_HEADER_SIZE 16
+
+typedef enum {
+  CAMERA_FORMAT_OFF = 0,
+  // FF D8 up to and including FF D9
+  CAMERA_FORMAT_JPEG = 1,
+  // RGB565, gray and binary images: everything up to and including the
+  // 01 02 04 08 trailer that follows the timing counters
+  CAMERA_FORMAT_RAW = 2,
+  // Not images: the softcore's JSON lines and frame_send() frames, which
+  // the examples print to channel B, published as the comms UART's are
+  CAMERA_FORMAT_MESSAGES = 3,
+} camera_format_t;
+// Longest message taken from channel B, delimiter included
+#define CAMERA_MESSAGE_MAX_SIZE 1023
+
+struct camera_stream_stats {
+  uint64_t bytes;
+  // Frames handed to MQTT; sequence numbers count every frame seen, so
+  // the ones dropped below show up to subscribers as gaps
+  uint32_t frames;
+  // Frame completed while both buffers were still being published
+  uint32_t dropped_busy;
+  uint32_t dropped_oversize;
+  uint32_t dropped_offline;
+  uint32_t next_seq;
+  // Messages format only; oversize messages count in dropped_oversize
+  struct softcore_frame_stats messages;
+  int64_t elapsed_us;
+};
+
+// Forwards the frames the softcore sends over channel B of the board the
+// calling task has selected to /BOARDNAME/camera/<serial>, or its messages
+// as softcore_frame_process() does. Restarts the stream if it is already
+// running. Start and stop set up and restore channel B, so call them with
+// the board lock held.
+bool camera_stream_start(camera_format_t format, uint32_t baud_rate);
+void camera_stream_stop(void);
+// True while a stream task owns channel B of the selected board, including
+// one that did not stop in time
+bool camera_stream_active(void);
+camera_format_t camera_stream_format(void);
+void camera_stream_get_stats(struct camera_stream_stats *stats);
+void camera_stream_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
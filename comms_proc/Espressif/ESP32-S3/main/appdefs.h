@@ -16,6 +16,10 @@
 #define HAS_ADDRESS_BIT    BIT2
 
 #define BITSTREAM_PACKAGE_FILENAME CONFIG_SD_FS_MOUNT_POINT"/package.zip" 
+// Stack of the task running a command on one board when it targets all of them
+#define APPMQTT_BOARD_TASK_STACK 8192
+// How long a command waits for another job on the same board to finish
+#define APPMQTT_BOARD_LOCK_TIMEOUT_MS 10000
 
 #define CHECK(expr, msg) \
   while ((res = expr) != ESP_OK) { \
@@ -33,17 +33,31 @@
 #include "arty_driver.h"
 #include "jtag.h"
 #include "ftdi.h"
+#include "bitstream.h"
+#include "svf.h"
+#include "appcamera.h"
 
 static char* commands[] = 
 {
   "GetVersion",
   "ListCommands",
+  "UARTRXStats [reset]",
 #if CONFIG_SD_FS_ENABLE
   "ListSDCardFiles",
   "GetFileFromURL <url> <filename>",
   "RemoveFile <filename>",
-  "JTAGProgramFPGA <filename>",
+  "JTAGProgramFPGA <filename> [force]",
+  "JTAGCalibrateTCK",
+  "JTAGSetTCK <frequency>",
+  "FTDILatencyStats [reset]",
+  "FTDIUARTStats [reset]",
+  "CameraStream <format jpeg|raw|messages|off> [baud]",
+  "CameraStreamStats [reset]",
   "FlashSoftcore <filename>",
+  "JTAGUARTProgramSoftcore <filename> [baud] [burst]",
+  "JTAGLoadSoftcore <filename>",
+  "JTAGVerifySoftcore <filename> <crc_base> [block_size]",
+  "JTAGPlaySVF <filename>",
 #endif
 #if CONFIG_OLED_ENABLE    
   "DisplayClear",
@@ -123,7 +137,7 @@ bool isMQTTConnected(void)
   return mqtt_connected;
 }
 
-void getFileFromURL(char *str, size_t len)
+void getFileFromURL(char *str, size_t len, char *out_buffer)
 {
   char* url = NULL;
   char* filename = NULL;
@@ -262,7 +276,60 @@ fail:
     ;
 }
 
-static void commandInterpreter(char* str, size_t len)
+#if CONFIG_SD_FS_ENABLE
+// Skips configuration when the FPGA reports DONE with the USERCODE recorded
+// for the same file hash last time, unless force is set
+static void jtag_program_fpga(char *command, char *fname, int force, char *out_buffer)
+{
+  const char *serial = arty_get_serial();
+  uint8_t sha256[BITSTREAM_SHA256_SIZE];
+  uint8_t cached_sha256[BITSTREAM_SHA256_SIZE];
+  uint32_t cached_usercode = 0;
+  uint32_t usercode = 0;
+  bool done = false;
+  bool hashed = bitstream_sha256(fname, sha256);
+  uint32_t tck = read_tck_config(serial);
+
+  if (tck)
+    ftdi_mpsse_set_frequency(tck);
+  if (!force && hashed && read_bitstream_cache(serial, cached_sha256, &cached_usercode) && \
+      (memcmp(sha256, cached_sha256, BITSTREAM_SHA256_SIZE) == 0) && \
+      jtag_read_config_state(&usercode, &done) && done && (usercode == cached_usercode))
+  {
+    ESP_LOGI(TAG, "FPGA already configured with %s", fname);
+    sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"FPGA already configured with %s\", \"skipped\": true}", command, fname);
+    return;
+  }
+
+  // Forget the old entry first so a failed load is never mistaken for it
+  write_bitstream_cache(serial, NULL, 0);
+  struct jtag_program_stats stats;
+  if (jtag_program(fname, &stats))
+  {
+    // Integer math only: bytes per microsecond is MB/s
+    uint32_t centi_mbps = stats.time_us ? (uint32_t)(((uint64_t)stats.bytes * 100) / stats.time_us) : 0;
+    if (hashed && jtag_read_config_state(&usercode, &done) && done)
+      write_bitstream_cache(serial, sha256, usercode);
+    ESP_LOGI(TAG, "JTAG Program FPGA complete");
+    sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"FPGA configured with %s\", \"done\": %s, \"bytes\": %" PRIu32 ", \"time_ms\": %" PRIu32 ", \"MBps\": %" PRIu32 ".%02" PRIu32 "}", \
+            command, fname, done ? "true" : "false", stats.bytes, (uint32_t)(stats.time_us / 1000), centi_mbps / 100, centi_mbps % 100);
+  }
+  else
+  {
+    sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Error programming FPGA with %s\"}", command, fname);
+  }
+}
+
+// Commands that reset the softcore or reconfigure and read channel B, and
+// so would break a CameraStream on the same board or lose its data
+static bool command_needs_channel_b(const char *command)
+{
+  return (strcmp(command, "JTAGUARTLoopbackTest")==0) || (strcmp(command, "JTAGUARTProgramSoftcore")==0) ||
+         (strcmp(command, "JTAGLoadSoftcore")==0) || (strcmp(command, "FlashSoftcore")==0);
+}
+#endif
+
+static void command_execute(char* str, size_t len, char* out_buffer)
 {
   char *command = NULL;
 
@@ -296,10 +363,31 @@ static void commandInterpreter(char* str, size_t len)
       }
       strcat(out_buffer, "]}");
     }
+    else if(strcmp(command, "UARTRXStats")==0)
+    {
+      int reset = 0;
+      json_scanf(str, len, "{reset: %d}", &reset);
+      struct uart_rx_stats stats;
+      getUARTRXStats(&stats);
+      // Throughput and rx_task load since the last reset, so a reset before
+      // a burst of traffic and a query after it gives a benchmark
+      uint32_t elapsed_ms = stats.elapsedUs / 1000;
+      uint32_t bytes_per_s = stats.elapsedUs ? (uint32_t)(stats.bytes * 1000000 / stats.elapsedUs) : 0;
+      uint32_t goodput = stats.elapsedUs ? (uint32_t)(stats.messages.payloadBytes * 1000000 / stats.elapsedUs) : 0;
+      uint32_t busy_permille = stats.elapsedUs ? (uint32_t)(stats.busyUs * 1000 / stats.elapsedUs) : 0;
+      sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"UART receive\", \"bytes\": %" PRIu64 ", \"frames\": %" PRIu32 ", \"binary_frames\": %" PRIu32 ", \"payload_bytes\": %" PRIu64 ", \"malformed\": %" PRIu32 ", \"crc_errors\": %" PRIu32 ", \"oversize\": %" PRIu32 ", \"fifo_overflows\": %" PRIu32 ", \"buffer_full\": %" PRIu32 ", \"pattern_overflows\": %" PRIu32 ", \"frame_errors\": %" PRIu32 ", \"parity_errors\": %" PRIu32 ", \"elapsed_ms\": %" PRIu32 ", \"bytes_per_s\": %" PRIu32 ", \"payload_bytes_per_s\": %" PRIu32 ", \"busy_permille\": %" PRIu32 "}", \
+              command, stats.bytes, stats.messages.frames, stats.messages.binaryFrames, stats.messages.payloadBytes, stats.messages.malformed, stats.messages.crcErrors, stats.oversize, stats.fifoOverflows, stats.bufferFull, stats.patternOverflows, stats.frameErrors, stats.parityErrors, elapsed_ms, bytes_per_s, goodput, busy_permille);
+      if (reset)
+        resetUARTRXStats();
+    }
 #if CONFIG_SD_FS_ENABLE
+    else if(command_needs_channel_b(command) && camera_stream_active())
+    {
+      sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Channel B busy with CameraStream, stop it first\"}", command);
+    }
     else if(strcmp(command, "GetFileFromURL")==0)
     {
-      getFileFromURL(str, len);	    
+      getFileFromURL(str, len, out_buffer);
     }
     else if(strcmp(command, "ListSDCardFiles")==0)
     {
@@ -333,11 +421,12 @@ static void commandInterpreter(char* str, size_t len)
     else if(strcmp(command, "JTAGProgramFPGA")==0)
     {
       char *fname = NULL;
-      if((json_scanf(str, len, "{filename: %Q}", &fname))==1)
+      int force = 0;
+      json_scanf(str, len, "{filename: %Q, force: %B}", &fname, &force);
+      if(fname != NULL)
       {
-	jtag_program(fname);
-	ESP_LOGI(TAG, "JTAG Program FPGA complete");
-        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"FPGA configured with %s\"}", command, fname);
+        jtag_program_fpga(command, fname, force, out_buffer);
+        free(fname);
       }
       else
       {
@@ -347,17 +436,61 @@ static void commandInterpreter(char* str, size_t len)
     else if(strcmp(command, "JTAGVerifySoftcore")==0)
     {
       char *fname = NULL;
-      if((json_scanf(str, len, "{filename: %Q}", &fname))==1)
+      unsigned int block_size = 0;
+      unsigned int crc_base = 0;
+      json_scanf(str, len, "{filename: %Q, block_size: %u}", &fname, &block_size);
+      // Where the CRC engine sits depends on the system, so there is no default
+      bool has_base = json_scanf(str, len, "{crc_base: %u}", &crc_base) == 1;
+      if((fname != NULL) && !has_base)
       {
-        jtag_verify_softcore(fname);
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No crc_base field\"}", command);
+        free(fname);
+      }
+      else if((fname != NULL) && (block_size % 4 != 0))
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"block_size must be a multiple of 4\"}", command);
+        free(fname);
+      }
+      else if(fname != NULL)
+      {
+        struct jtag_verify_result result;
+        // Hold the softcore in reset and give its memory to the CRC engine
+        // (control bit 2 in edgetestbed_jtag_uartprog_no_dram) while it runs
+        jtag_control_write(6,0,0);
+        vTaskDelay(10/portTICK_PERIOD_MS);
+        bool ok = jtag_verify_softcore(fname, crc_base, block_size, &result);
+        jtag_control_write(0,0,0);
         ESP_LOGI(TAG, "JTAG Verify Softcore complete");
-        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Softcore verified\"}", command);
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"%s\", \"bytes\": %" PRIu32 ", \"segments\": %" PRIu32 ", \"blocks\": %" PRIu32 ", \"bad_blocks\": %" PRIu32 ", \"first_bad\": \"%08" PRIX32 "\"}", \
+                command, ok ? "Softcore verified" : "Softcore mismatch", result.bytes, result.segments, result.blocks, result.bad_blocks, result.first_bad);
+        free(fname);
       }
       else 
       {
         sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No filename field\"}", command);
       }
     }
+    else if(strcmp(command, "JTAGPlaySVF")==0)
+    {
+      char *fname = NULL;
+      if((json_scanf(str, len, "{filename: %Q}", &fname))==1)
+      {
+        struct svf_result result;
+        // The file may reconfigure the FPGA, so the cached bitstream no
+        // longer tells what it holds
+        write_bitstream_cache(arty_get_serial(), NULL, 0);
+        bool ok = svf_is_xsvf(fname) ? xsvf_play(fname, &result) : svf_play(fname, &result);
+        uint32_t time_ms = result.time_us / 1000;
+        uint32_t kbps = result.time_us ? (uint32_t)(result.bits * 1000 / result.time_us) : 0;
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"%s %s\", \"statements\": %" PRIu32 ", \"bits\": %" PRIu64 ", \"kbps\": %" PRIu32 ", \"checks\": %" PRIu32 ", \"failed_checks\": %" PRIu32 ", \"fail_at\": %" PRIu32 ", \"time_ms\": %" PRIu32 "}", \
+                command, ok ? "Played" : "Failed to play", fname, result.statements, result.bits, kbps, result.checks, result.failed_checks, result.fail_at, time_ms);
+        free(fname);
+      }
+      else
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No filename field\"}", command);
+      }
+    }
     else if(strcmp(command, "JTAGUARTLoopbackTest")==0)
     {
       jtag_uart_loopback_test();
@@ -373,22 +506,52 @@ static void commandInterpreter(char* str, size_t len)
     else if(strcmp(command, "JTAGUARTProgramSoftcore")==0)
     {
       char *fname = NULL;
-      if((json_scanf(str, len, "{filename: %Q}", &fname))==1)
+      unsigned int baud = JTAG_SOFTCORE_BAUD_RATE;
+      int burst = 0;
+      json_scanf(str, len, "{filename: %Q, baud: %u, burst: %B}", &fname, &baud, &burst);
+      if(fname != NULL)
       {
-#if 0 
-	ftdi_uart_configure(8,115200, XON_XOFF, 10000000);
-	jtag_control_write(3,0,0);
-	vTaskDelay(10/portTICK_PERIOD_MS);
-	jtag_control_write(2,0,0);
-	vTaskDelay(10/portTICK_PERIOD_MS);
-	jtag_program_softcore(fname);
-#endif
-	jtag_program_softcore(fname);
-	vTaskDelay(10/portTICK_PERIOD_MS);
-//	jtag_control_write(0,0,0);
+        struct jtag_program_stats stats;
+        // Hold the softcore in reset with the loader enabled while the image streams in
+        jtag_control_write(3,0,0);
+        vTaskDelay(10/portTICK_PERIOD_MS);
+        jtag_control_write(2,0,0);
+        vTaskDelay(10/portTICK_PERIOD_MS);
+        bool ok = jtag_program_softcore(fname, baud, JTAG_SOFTCORE_FLOW_CONTROL, burst, &stats);
+        jtag_control_write(0,0,0);
         ESP_LOGI(TAG, "JTAG Program Softcore complete");
-        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Softcore flashed with %s\"}", command, fname);
-      } 
+        uint32_t time_ms = stats.time_us / 1000;
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"%s %s\", \"bytes\": %" PRIu32 ", \"time_ms\": %" PRIu32 ", \"retries\": %" PRIu32 "}", \
+                command, ok ? "Softcore flashed with" : "Failed to flash softcore with", fname, stats.bytes, time_ms, stats.retries);
+        free(fname);
+      }
+      else
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No filename field\"}", command);
+      }
+    }
+    else if(strcmp(command, "JTAGLoadSoftcore")==0)
+    {
+      char *fname = NULL;
+      if((json_scanf(str, len, "{filename: %Q}", &fname))==1)
+      {
+        struct jtag_program_stats stats;
+        // Same reset sequence as the UART loader; the image goes over the AXI master instead
+        jtag_control_write(3,0,0);
+        vTaskDelay(10/portTICK_PERIOD_MS);
+        jtag_control_write(2,0,0);
+        vTaskDelay(10/portTICK_PERIOD_MS);
+        bool ok = jtag_load_softcore(fname, &stats);
+        jtag_control_write(0,0,0);
+        uint32_t time_ms = stats.time_us / 1000;
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"%s %s\", \"bytes\": %" PRIu32 ", \"time_ms\": %" PRIu32 "}", \
+                command, ok ? "Softcore loaded with" : "Failed to load softcore with", fname, stats.bytes, time_ms);
+        free(fname);
+      }
+      else
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No filename field\"}", command);
+      }
     }
     else if(strcmp(command, "FlashSoftcore")==0)
     {
@@ -428,6 +591,8 @@ static void commandInterpreter(char* str, size_t len)
       char *fname = NULL;
       if((json_scanf(str, len, "{filename: %Q}", &fname))==1)
       {
+        // The recorded MPSSE stream reconfigures the FPGA behind the bitstream cache's back
+        write_bitstream_cache(arty_get_serial(), NULL, 0);
 	arty_flash(fname);
         ESP_LOGI(TAG, "Finished arty_task");
         sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"FPGA configured\"}", command);
@@ -442,6 +607,113 @@ static void commandInterpreter(char* str, size_t len)
         free(fname);
       }
     }
+    else if(strcmp(command, "JTAGCalibrateTCK")==0)
+    {
+      uint32_t tck = jtag_calibrate_tck();
+      if (tck)
+      {
+        write_tck_config(arty_get_serial(), tck);
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"TCK calibrated\", \"frequency\": %" PRIu32 "}", command, tck);
+      }
+      else
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"JTAG chain not responding\"}", command);
+      }
+    }
+    else if(strcmp(command, "JTAGSetTCK")==0)
+    {
+      unsigned int frequency = 0;
+      if((json_scanf(str, len, "{frequency: %u}", &frequency))==1)
+      {
+        uint32_t tck = ftdi_mpsse_set_frequency(frequency);
+        write_tck_config(arty_get_serial(), tck);
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"TCK set\", \"frequency\": %" PRIu32 "}", command, tck);
+      }
+      else
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No frequency field\"}", command);
+      }
+    }
+    else if(strcmp(command, "FTDILatencyStats")==0)
+    {
+      static const char *modes[FTDI_LATENCY_MODES] = {"interactive", "bulk"};
+      int reset = 0;
+      json_scanf(str, len, "{reset: %d}", &reset);
+      int n = sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"MPSSE read latency\"", command);
+      for (int i = 0; i < FTDI_LATENCY_MODES; i++)
+      {
+        struct ftdi_latency_stats stats;
+        ftdi_get_latency_stats(i, &stats);
+        uint32_t avg_us = stats.reads ? (uint32_t)(stats.total_us / stats.reads) : 0;
+        n += sprintf(out_buffer + n, ", \"%s\": {\"reads\": %" PRIu32 ", \"bytes\": %" PRIu32 ", \"min_us\": %" PRIu32 ", \"avg_us\": %" PRIu32 ", \"max_us\": %" PRIu32 "}", \
+                     modes[i], stats.reads, stats.bytes, stats.min_us, avg_us, stats.max_us);
+      }
+      sprintf(out_buffer + n, "}");
+      if (reset)
+        ftdi_reset_latency_stats();
+    }
+    else if(strcmp(command, "FTDIUARTStats")==0)
+    {
+      int reset = 0;
+      json_scanf(str, len, "{reset: %d}", &reset);
+      struct arty_receive_stats stats;
+      ftdi_uart_get_stats(&stats);
+      sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Channel B receive\", \"bytes\": %" PRIu64 ", \"overruns\": %" PRIu32 ", \"high_water\": %" PRIu32 ", \"ftdi_overruns\": %" PRIu32 ", \"parity_errors\": %" PRIu32 ", \"framing_errors\": %" PRIu32 ", \"breaks\": %" PRIu32 ", \"resubmit_failures\": %" PRIu32 "}", \
+              command, stats.bytes, stats.overruns, stats.high_water, stats.ftdi_overruns, stats.parity_errors, stats.framing_errors, stats.breaks, stats.resubmit_failures);
+      if (reset)
+        ftdi_uart_reset_stats();
+    }
+    else if(strcmp(command, "CameraStream")==0)
+    {
+      char *format = NULL;
+      unsigned int baud = JTAG_SOFTCORE_BAUD_RATE;
+      json_scanf(str, len, "{format: %Q, baud: %u}", &format, &baud);
+      if(format == NULL)
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"No format field\"}", command);
+      }
+      else if(strcmp(format, "off") == 0)
+      {
+        camera_stream_stop();
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Stream stopped\"}", command);
+      }
+      else if((strcmp(format, "jpeg") != 0) && (strcmp(format, "raw") != 0) && (strcmp(format, "messages") != 0))
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Unknown format %.16s\"}", command, format);
+      }
+      else if(strcmp(format, "messages") == 0)
+      {
+        if(camera_stream_start(CAMERA_FORMAT_MESSAGES, baud))
+          sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Forwarding messages\", \"topic\": \"/%s/%s/<TOPIC>\"}", \
+                  command, getHostname(), arty_device_serial(arty_current_device()));
+        else
+          sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Stream not started\"}", command);
+      }
+      else if(camera_stream_start(strcmp(format, "jpeg") == 0 ? CAMERA_FORMAT_JPEG : CAMERA_FORMAT_RAW, baud))
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Streaming %s frames\", \"topic\": \"/%s/camera/%s\"}", \
+                command, format, getHostname(), arty_device_serial(arty_current_device()));
+      }
+      else
+      {
+        sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Stream not started\"}", command);
+      }
+      free(format);
+    }
+    else if(strcmp(command, "CameraStreamStats")==0)
+    {
+      int reset = 0;
+      json_scanf(str, len, "{reset: %d}", &reset);
+      struct camera_stream_stats stats;
+      camera_stream_get_stats(&stats);
+      // Goodput of the messages format, comparable with UARTRXStats
+      uint32_t goodput = stats.elapsed_us ? (uint32_t)(stats.messages.payloadBytes * 1000000 / stats.elapsed_us) : 0;
+      sprintf(out_buffer, "{\"command\": \"%s\", \"response\":\"Camera stream\", \"streaming\": %s, \"bytes\": %" PRIu64 ", \"frames\": %" PRIu32 ", \"dropped_busy\": %" PRIu32 ", \"dropped_oversize\": %" PRIu32 ", \"dropped_offline\": %" PRIu32 ", \"next_seq\": %" PRIu32 ", \"messages\": %" PRIu32 ", \"binary_frames\": %" PRIu32 ", \"payload_bytes\": %" PRIu64 ", \"malformed\": %" PRIu32 ", \"crc_errors\": %" PRIu32 ", \"elapsed_ms\": %" PRIu32 ", \"payload_bytes_per_s\": %" PRIu32 "}", \
+              command, camera_stream_format() == CAMERA_FORMAT_OFF ? "false" : "true", stats.bytes, stats.frames, stats.dropped_busy, stats.dropped_oversize, stats.dropped_offline, stats.next_seq, \
+              stats.messages.frames, stats.messages.binaryFrames, stats.messages.payloadBytes, stats.messages.malformed, stats.messages.crcErrors, (uint32_t)(stats.elapsed_us / 1000), goodput);
+      if (reset)
+        camera_stream_reset_stats();
+    }
 #endif
 #if CONFIG_OLED_ENABLE    
     else if(strcmp(command, "DisplayClear")==0)
@@ -499,6 +771,173 @@ static void commandInterpreter(char* str, size_t len)
   {
     free(command);
   }
+}
+
+// Commands that only use the ESP32 itself: the comms UART, the SD card and
+// the display. These run once without taking a board, whatever the board
+// field says.
+static const char* host_commands[] =
+{
+  "GetVersion",
+  "ListCommands",
+  "UARTRXStats",
+  "GetFileFromURL",
+  "ListSDCardFiles",
+  "RemoveFile",
+  "DisplayClear",
+  "DisplayHeartbeat",
+  "DisplayString",
+};
+
+static bool command_uses_board(char* str, size_t len)
+{
+  char *command = NULL;
+  bool uses_board = true;
+
+  if((json_scanf(str, len, "{command: %Q}", &command))!=1)
+    return false;
+  for(int i = 0; i < sizeof(host_commands)/sizeof(char*); i++)
+  {
+    if(strcmp(command, host_commands[i])==0)
+    {
+      uses_board = false;
+      break;
+    }
+  }
+  free(command);
+  return uses_board;
+}
+
+// Puts the board's serial in front of the other fields of a response
+static void command_tag_board(char* out, size_t size, const char* serial)
+{
+  char tag[ARTY_SERIAL_SIZE + 16];
+  int n = snprintf(tag, sizeof(tag), "\"board\": \"%s\", ", serial);
+  size_t len = strlen(out);
+  if(out[0] != '{' || len + n >= size)
+    return;
+  memmove(out + 1 + n, out + 1, len);
+  memcpy(out + 1, tag, n);
+}
+
+// Runs the command on one board while holding that board, so a fan-out job,
+// a command naming the board and an XVC session never drive it at once
+static void command_execute_locked(int device, char* str, size_t len, char* out)
+{
+  arty_select_device(device);
+  if(!arty_lock_device(device, APPMQTT_BOARD_LOCK_TIMEOUT_MS))
+  {
+    ESP_LOGW(TAG, "Board %s busy", arty_device_serial(device));
+    sprintf(out, "{\"response\":\"Board busy\"}");
+    return;
+  }
+  command_execute(str, len, out);
+  // No reply is awaited once the command is done
+  if(arty_device_present(device))
+    ftdi_latency_idle();
+  arty_unlock_device(device);
+}
+
+struct command_job {
+  char* str;
+  size_t len;
+  int device;
+  SemaphoreHandle_t done;
+  char out[sizeof(out_buffer)];
+};
+
+static void command_board_task(void *arg)
+{
+  struct command_job *job = (struct command_job *)arg;
+  command_execute_locked(job->device, job->str, job->len, job->out);
+  command_tag_board(job->out, sizeof(job->out), arty_device_serial(job->device));
+  xSemaphoreGive(job->done);
+  vTaskDelete(NULL);
+}
+
+// Runs the command on every board at once, one task each, and sends the
+// responses once all of them have finished
+static void command_fan_out(char* str, size_t len)
+{
+  struct command_job *jobs[ARTY_MAX_DEVICES];
+  SemaphoreHandle_t done = xSemaphoreCreateCounting(ARTY_MAX_DEVICES, 0);
+  int n = 0;
+  for(int i = 0; i < ARTY_MAX_DEVICES; i++)
+  {
+    if(!arty_device_present(i))
+      continue;
+    struct command_job *job = calloc(1, sizeof(struct command_job));
+    if(job == NULL)
+      break;
+    job->str = str;
+    job->len = len;
+    job->device = i;
+    job->done = done;
+    if(xTaskCreate(command_board_task, "mqtt_board", APPMQTT_BOARD_TASK_STACK, job, uxTaskPriorityGet(NULL), NULL) != pdPASS)
+    {
+      ESP_LOGE(TAG, "Cannot start a task for board %s", arty_device_serial(i));
+      free(job);
+      continue;
+    }
+    jobs[n++] = job;
+  }
+  for(int i = 0; i < n; i++)
+    xSemaphoreTake(done, portMAX_DELAY);
+  for(int i = 0; i < n; i++)
+  {
+    appmqtt_send_msg(out_command_topic, jobs[i]->out);
+    free(jobs[i]);
+  }
+  vSemaphoreDelete(done);
+  if(n == 0)
+  {
+    sprintf(out_buffer, "{\"board\": \"all\", \"response\":\"No boards present\"}");
+    appmqtt_send_msg(out_command_topic, out_buffer);
+  }
+}
+
+// The optional board field names the target by serial number, or "all" for
+// every board present. Without it the first board present is used.
+static void commandInterpreter(char* str, size_t len)
+{
+  char *board = NULL;
+
+  // Without the board lock, so a busy board or an XVC client does not hold
+  // up commands that never touch it
+  if(!command_uses_board(str, len))
+  {
+    command_execute(str, len, out_buffer);
+    appmqtt_send_msg(out_command_topic, out_buffer);
+    return;
+  }
+  json_scanf(str, len, "{board: %Q}", &board);
+  if(board == NULL)
+  {
+    command_execute_locked(arty_current_device(), str, len, out_buffer);
+    arty_select_device(-1);
+  }
+  else if(strcmp(board, "all") == 0)
+  {
+    command_fan_out(str, len);
+    free(board);
+    return;
+  }
+  else
+  {
+    int device = arty_find_device(board);
+    if(device < 0)
+    {
+      ESP_LOGI(TAG, "Board %s not found", board);
+      sprintf(out_buffer, "{\"board\": \"%.*s\", \"response\":\"Board not found\"}", ARTY_SERIAL_SIZE, board);
+    }
+    else
+    {
+      command_execute_locked(device, str, len, out_buffer);
+      command_tag_board(out_buffer, sizeof(out_buffer), arty_device_serial(device));
+      arty_select_device(-1);
+    }
+    free(board);
+  }
   appmqtt_send_msg(out_command_topic, out_buffer);
 }
 
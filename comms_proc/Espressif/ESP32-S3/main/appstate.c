@@ -182,3 +182,120 @@ void setup_mdns(void)
 }
 
 
+
+// NVS keys are limited to 15 characters, so only the tail of the serial
+// number is used; FTDI serials differ in their last digits.
+static void board_key(char* key, const char* prefix, const char* serial)
+{
+  size_t len = strlen(serial);
+  if (len > NVS_KEY_NAME_MAX_SIZE - 1 - strlen(prefix))
+  {
+    serial += len - (NVS_KEY_NAME_MAX_SIZE - 1 - strlen(prefix));
+  }
+  snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%s%s", prefix, serial);
+}
+
+uint32_t read_tck_config(const char* serial)
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  uint32_t frequency = 0;
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &handle);
+  if (err != ESP_OK)
+  {
+    return 0;
+  }
+
+  board_key(key, "tck", serial);
+  err = nvs_get_u32(handle, key, &frequency);
+  if (err != ESP_OK)
+  {
+    frequency = 0;
+  }
+
+  nvs_close(handle);
+  return frequency;
+}
+
+void write_tck_config(const char* serial, uint32_t frequency)
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle);
+  if (err != ESP_OK)
+  {
+    ESP_LOGI(TAG, "cannot save TCK frequency: %s", esp_err_to_name(err));
+    return;
+  }
+
+  board_key(key, "tck", serial);
+  err = nvs_set_u32(handle, key, frequency);
+  if (err == ESP_OK)
+  {
+    nvs_commit(handle);
+  }
+  else
+  {
+    ESP_LOGI(TAG, "failed to write TCK frequency: %s", esp_err_to_name(err));
+  }
+
+  nvs_close(handle);
+}
+
+// The last bitstream loaded into a board: SHA-256 of the file followed by the
+// USERCODE the FPGA reported once DONE went high
+bool read_bitstream_cache(const char* serial, uint8_t* sha256, uint32_t* usercode)
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  uint8_t blob[BITSTREAM_CACHE_SIZE];
+  size_t required_size = sizeof(blob);
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &handle);
+  if (err != ESP_OK)
+  {
+    return false;
+  }
+
+  board_key(key, "bit", serial);
+  err = nvs_get_blob(handle, key, blob, &required_size);
+  nvs_close(handle);
+  if (err != ESP_OK || required_size != sizeof(blob))
+  {
+    return false;
+  }
+
+  memcpy(sha256, blob, 32);
+  memcpy(usercode, blob + 32, sizeof(uint32_t));
+  return true;
+}
+
+void write_bitstream_cache(const char* serial, const uint8_t* sha256, uint32_t usercode)
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  uint8_t blob[BITSTREAM_CACHE_SIZE];
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle);
+  if (err != ESP_OK)
+  {
+    ESP_LOGI(TAG, "cannot save bitstream cache: %s", esp_err_to_name(err));
+    return;
+  }
+
+  board_key(key, "bit", serial);
+  if (sha256 == NULL)
+  {
+    err = nvs_erase_key(handle, key);
+  }
+  else
+  {
+    memcpy(blob, sha256, 32);
+    memcpy(blob + 32, &usercode, sizeof(uint32_t));
+    err = nvs_set_blob(handle, key, blob, sizeof(blob));
+  }
+  if (err == ESP_OK)
+  {
+    nvs_commit(handle);
+  }
+
+  nvs_close(handle);
+}
@@ -2,12 +2,18 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#define BITSTREAM_CACHE_SIZE (32 + sizeof(uint32_t))
 void read_wifi_config(void);
 void write_wifi_config(void);
 void init_time(void);
 char* getHostname(void);
 void setHostname(uint8_t* mac);
 void setup_mdns(void);
+uint32_t read_tck_config(const char* serial);
+void write_tck_config(const char* serial, uint32_t frequency);
+bool read_bitstream_cache(const char* serial, uint8_t* sha256, uint32_t* usercode);
+// Passing a NULL sha256 forgets the cached entry
+void write_bitstream_cache(const char* serial, const uint8_t* sha256, uint32_t usercode);
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,7 @@
 #include "esp_log.h"
 #include "esp_intr_alloc.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "driver/uart.h"
 #include "frozen.h"
 #include "string.h"
@@ -12,15 +13,27 @@
 #include "appmqtt.h"
 #include "appstate.h"
 #include "appuart.h"
+#include "softcore_frame.h"
 
 static const char *TAG = "appuart";
 
-static char* out_topic;
-static size_t out_topic_len; 
-
 #define RX_BUF_SIZE  1024
-static char rxData[RX_BUF_SIZE];
-static int rxLength = 0;
+// Longest frame, including its 0x0D; decoding needs one byte more
+#define UART_FRAME_BUF_SIZE (RX_BUF_SIZE - 1)
+// Driver ring: absorbs about 150 ms at 921600 baud while MQTT publishing stalls
+#define UART_RX_RING_SIZE (16 * 1024)
+#define UART_EVENT_QUEUE_SIZE 32
+#define UART_PATTERN_QUEUE_SIZE 64
+#define UART_FRAME_DELIMITER SOFTCORE_FRAME_DELIMITER
+// Timings of the delimiter detection, in baud periods
+#define UART_PATTERN_CHR_TOUT 9
+#define UART_READ_TIMEOUT_MS 100
+
+static uint8_t frameData[RX_BUF_SIZE];
+static QueueHandle_t uartQueue;
+static struct uart_rx_stats rxStats;
+static int64_t rxStatsStart;
+static struct softcore_frame_decoder uartDecoder;
 
 #define TXD_PIN CONFIG_COMMS_PROC_UART_TX_GPIO
 #define RXD_PIN CONFIG_COMMS_PROC_UART_RX_GPIO
@@ -42,89 +55,114 @@ int sendUARTBytes(const uint8_t* bytes, int len)
 
 void resetUARTRXData(void)
 {
-  memset(rxData, '\0', RX_BUF_SIZE);
-  rxLength = 0;
+  memset(frameData, '\0', sizeof(frameData));
+}
+
+// Drops everything buffered together with its delimiter positions and
+// events, so later frame boundaries line up with the pattern queue again
+static void restartUARTRX(void)
+{
+    uart_flush_input(UART_NUM_1);
+    uart_pattern_queue_reset(UART_NUM_1, UART_PATTERN_QUEUE_SIZE);
+    xQueueReset(uartQueue);
 }
 
 void flushUART(void)
 {
-  uart_flush(UART_NUM_1);
+  restartUARTRX();
 }
 
-static void rx_task(void *arg)
+// Reads the frame ending at the next 0x0D in one go. Frames that do not fit
+// frameData are read out and dropped.
+static int readUARTFrame(void)
 {
-    static const char *RX_TASK_TAG = "RX_TASK";
-    static unsigned char rxByteIn = '\0';
-    char *message = NULL;
-    char *topic = NULL;
-    int jsonStatus = -1;
+    int pos = uart_pattern_pop_pos(UART_NUM_1);
+    if (pos < 0)
+    {
+      // More delimiters arrived than the position queue holds
+      rxStats.patternOverflows++;
+      restartUARTRX();
+      return -1;
+    }
+    int frameLength = pos + 1;
+    int remaining = frameLength;
+    while (remaining > 0)
+    {
+      int chunk = remaining < UART_FRAME_BUF_SIZE ? remaining : UART_FRAME_BUF_SIZE;
+      int n = uart_read_bytes(UART_NUM_1, frameData, chunk, UART_READ_TIMEOUT_MS / portTICK_PERIOD_MS);
+      if (n <= 0)
+        return -1;
+      rxStats.bytes += n;
+      remaining -= n;
+    }
+    if (frameLength > UART_FRAME_BUF_SIZE)
+    {
+      rxStats.oversize++;
+      ESP_LOGI("UART", "Dropped %d byte frame", frameLength);
+      return -1;
+    }
+    return frameLength;
+}
 
-    esp_log_level_set(RX_TASK_TAG, ESP_LOG_INFO);
+static void rx_task(void *arg)
+{
+    uart_event_t event;
 
     while (1) 
     {
-      char *message = NULL;
-      char *topic = NULL;
-      xSemaphoreTake(uartMutex, portMAX_DELAY);      
-      const int rxBytes = uart_read_bytes(UART_NUM_1, &rxByteIn, 1, 10 / portTICK_PERIOD_MS );
-      if (rxBytes > 0) 
-      {
-	//ESP_LOGI("UART", "Received byte: %c %" PRIX8, rxByteIn, rxByteIn);
-	if((rxByteIn!=0x0D)&&((rxByteIn<32)||(rxByteIn>126)))
-	{
-	  //ESP_LOGI("UART", "Ignoring byte");
-          xSemaphoreGive(uartMutex);      
-	  continue;
-	}
-	rxData[rxLength] = rxByteIn;
-	rxLength++;
-	//ESP_LOGI("UART", "Received byte: %c %" PRIX8, rxByteIn, rxByteIn);
-	//ESP_LOGI("UART", "Received byte: %" PRIX8, rxByteIn);
-	if(rxByteIn == 0x0D)
-	{
-	  rxData[rxLength] = '\0';
-	  ESP_LOGI("UART", "Received 0x0D");
-          jsonStatus = json_scanf(rxData, rxLength, "{topic: %Q, message: %Q}", &topic, &message);
-	  if(jsonStatus == 2) // Valid format 
-	  {
-	    if(topic != NULL)
-	    {
-	      //out_topic_len = asprintf(&out_topic, "/%s/risc_v", getHostname());
-	      out_topic_len = asprintf(&out_topic, "/%s/%s", getHostname(), topic);
-	      if(isMQTTConnected())
-	      {
-	        //appmqtt_send_msg_n(out_topic, rxData,rxLength-1);
-	        appmqtt_send_msg(out_topic, message);
-	      }
-	    }
-	  }
-	  else
-	  {
-	    ESP_LOGI("UART", "Recieved 0x0D but JSON malformed");
-	  }
-          resetUARTRXData();
-	}
-	else if(rxLength==RX_BUF_SIZE)  // Full buffer
-	{
-	  ESP_LOGI(RX_TASK_TAG, "rxLength == RX_BUF_SIZE Resetting buffer!!!");
-          resetUARTRXData();
-	}
-	// Otherwise, assume JSON string is still forthcoming
-      }
-      if(message)
-      {
-        free(message);
-	message = NULL;
-      }
-      if(topic)
+      if (xQueueReceive(uartQueue, &event, portMAX_DELAY) != pdTRUE)
+        continue;
+      int64_t start = esp_timer_get_time();
+      switch (event.type)
       {
-        free(topic);
-	topic = NULL;
+        case UART_PATTERN_DET:
+        {
+          // The lock covers one frame, so a softcore flash waits at most that long
+          xSemaphoreTake(uartMutex, portMAX_DELAY);
+          int frameLength = readUARTFrame();
+          xSemaphoreGive(uartMutex);
+          if (frameLength > 0)
+            softcore_frame_process(&uartDecoder, frameData, frameLength);
+          break;
+        }
+        case UART_DATA:
+          // Partial frames stay in the driver ring until their 0x0D arrives
+          break;
+        case UART_FIFO_OVF:
+          rxStats.fifoOverflows++;
+          restartUARTRX();
+          break;
+        case UART_BUFFER_FULL:
+          rxStats.bufferFull++;
+          restartUARTRX();
+          break;
+        case UART_FRAME_ERR:
+          rxStats.frameErrors++;
+          break;
+        case UART_PARITY_ERR:
+          rxStats.parityErrors++;
+          break;
+        default:
+          break;
       }
-      xSemaphoreGive(uartMutex);      
+      rxStats.busyUs += esp_timer_get_time() - start;
     }
 }
 
+void getUARTRXStats(struct uart_rx_stats *stats)
+{
+    *stats = rxStats;
+    stats->messages = uartDecoder.stats;
+    stats->elapsedUs = esp_timer_get_time() - rxStatsStart;
+}
+
+void resetUARTRXStats(void)
+{
+    memset(&rxStats, 0, sizeof(rxStats));
+    memset(&uartDecoder.stats, 0, sizeof(uartDecoder.stats));
+    rxStatsStart = esp_timer_get_time();
+}
+
 void init_uart(void) 
 {
     const uart_config_t uart_config = {
@@ -139,9 +177,14 @@ void init_uart(void)
     };
 
     // We won't use a buffer for sending data.
-    uart_driver_install(UART_NUM_1, RX_BUF_SIZE * 2, 0, 0, NULL, 0);
+    uart_driver_install(UART_NUM_1, UART_RX_RING_SIZE, 0, UART_EVENT_QUEUE_SIZE, &uartQueue, 0);
     uart_param_config(UART_NUM_1, &uart_config);
     uart_set_pin(UART_NUM_1, TXD_PIN, RXD_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    // Each 0x0D raises UART_PATTERN_DET with its position in the ring, so
+    // whole frames are read at once instead of scanning byte by byte
+    uart_enable_pattern_det_baud_intr(UART_NUM_1, UART_FRAME_DELIMITER, 1, UART_PATTERN_CHR_TOUT, 0, 0);
+    uart_pattern_queue_reset(UART_NUM_1, UART_PATTERN_QUEUE_SIZE);
+    resetUARTRXStats();
 
     uartMutex = xSemaphoreCreateMutex();
     xTaskCreate(rx_task, "uart_rx_task", 1024*4, NULL, 3, NULL);
@@ -1,7 +1,29 @@
 #pragma once
+#include <stdint.h>
+#include "softcore_frame.h"
+
+// Receive counters of the comms UART since the last resetUARTRXStats()
+struct uart_rx_stats {
+  uint64_t bytes;
+  struct softcore_frame_stats messages;
+  // Frames longer than the frame buffer, dropped
+  uint32_t oversize;
+  // Data lost in the hardware FIFO or the driver ring, or delimiters lost
+  // from the pattern position queue; each one flushes what was buffered
+  uint32_t fifoOverflows;
+  uint32_t bufferFull;
+  uint32_t patternOverflows;
+  uint32_t frameErrors;
+  uint32_t parityErrors;
+  // Time rx_task spent handling events, against the time since the reset
+  int64_t busyUs;
+  int64_t elapsedUs;
+};
+
 void init_uart(void);
 int sendUARTData(const char*);
 int sendUARTBytes(const uint8_t* bytes, int len);
 void flushUART(void);
 void resetUARTRXData(void);
-
+void getUARTRXStats(struct uart_rx_stats *stats);
+void resetUARTRXStats(void);
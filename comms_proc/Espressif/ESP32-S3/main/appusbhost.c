@@ -52,6 +52,7 @@ static void host_lib_daemon_task(void *arg)
 void init_usbhost(void)
 {
     SemaphoreHandle_t signaling_sem = xSemaphoreCreateBinary();
+    arty_driver_init();
 
     TaskHandle_t daemon_task_hdl;
     TaskHandle_t arty_driver_task_hdl;
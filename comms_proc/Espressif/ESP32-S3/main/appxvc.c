@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "arty_driver.h"
+#include "ftdi.h"
+#include "appstate.h"
+#include "appxvc.h"
+
+// Xilinx Virtual Cable 1.0 server. The board in USB slot n is served on
+// CONFIG_XVC_PORT + n, one client at a time, so vendor tools and
+// openFPGALoader can drive its JTAG chain over the network.
+
+#define XVC_MAX_VECTOR_BYTES 2048
+#define XVC_TASK_STACK 4096
+#define XVC_TASK_PRIORITY 4
+
+static const char *TAG = "appxvc";
+
+static bool xvc_recv_all(int sock, void *buf, size_t len)
+{
+  uint8_t *p = buf;
+  while (len > 0)
+  {
+    int n = recv(sock, p, len, 0);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool xvc_send_all(int sock, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  while (len > 0)
+  {
+    int n = send(sock, p, len, 0);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static uint32_t xvc_get_u32(const uint8_t *bytes)
+{
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void xvc_put_u32(uint8_t *bytes, uint32_t val)
+{
+  bytes[0] = val & 255;
+  bytes[1] = (val >> 8) & 255;
+  bytes[2] = (val >> 16) & 255;
+  bytes[3] = (val >> 24) & 255;
+}
+
+// Serves one client until it disconnects or sends something malformed.
+// vectors holds the TMS, TDI and TDO vectors of a shift back to back.
+static void xvc_serve(int sock, uint8_t *vectors)
+{
+  uint8_t *tms = vectors;
+  uint8_t *tdi = vectors + XVC_MAX_VECTOR_BYTES;
+  uint8_t *tdo = vectors + 2 * XVC_MAX_VECTOR_BYTES;
+  char cmd[8];
+  uint8_t word[4];
+
+  ftdi_mpsse_open();
+  while (1)
+  {
+    // The first two characters tell getinfo:, settck: and shift: apart
+    if (!xvc_recv_all(sock, cmd, 2))
+      return;
+    if (memcmp(cmd, "ge", 2) == 0)
+    {
+      if (!xvc_recv_all(sock, cmd, 6))
+        return;
+      char info[32];
+      int n = snprintf(info, sizeof(info), "xvcServer_v1.0:%d\n", XVC_MAX_VECTOR_BYTES);
+      if (!xvc_send_all(sock, info, n))
+        return;
+    }
+    else if (memcmp(cmd, "se", 2) == 0)
+    {
+      if (!xvc_recv_all(sock, cmd, 5) || !xvc_recv_all(sock, word, 4))
+        return;
+      uint32_t period_ns = xvc_get_u32(word);
+      uint32_t frequency = ftdi_mpsse_get_frequency();
+      if (period_ns)
+      {
+        uint32_t requested = 1000000000 / period_ns;
+        // 0 would select the default rate rather than the slowest one
+        frequency = ftdi_mpsse_set_frequency(requested ? requested : 1);
+        ftdi_mpsse_flush();
+      }
+      // Report the period actually set, which is never shorter than asked
+      xvc_put_u32(word, DIV_ROUND_UP(1000000000, frequency));
+      if (!xvc_send_all(sock, word, 4))
+        return;
+    }
+    else if (memcmp(cmd, "sh", 2) == 0)
+    {
+      if (!xvc_recv_all(sock, cmd, 4) || !xvc_recv_all(sock, word, 4))
+        return;
+      uint32_t num_bits = xvc_get_u32(word);
+      uint32_t num_bytes = DIV_ROUND_UP(num_bits, 8);
+      if (num_bytes > XVC_MAX_VECTOR_BYTES)
+      {
+        ESP_LOGE(TAG, "Shift of %" PRIu32 " bits is longer than the %d bytes offered", num_bits, XVC_MAX_VECTOR_BYTES);
+        return;
+      }
+      if (!xvc_recv_all(sock, tms, num_bytes) || !xvc_recv_all(sock, tdi, num_bytes))
+        return;
+      memset(tdo, 0, num_bytes);
+      ftdi_shift_vectors(num_bits, tms, tdi, tdo);
+      if (!xvc_send_all(sock, tdo, num_bytes))
+        return;
+    }
+    else
+    {
+      ESP_LOGE(TAG, "Unknown command %.2s", cmd);
+      return;
+    }
+  }
+}
+
+// The session holds the board throughout, so MQTT commands for it wait or
+// report it busy instead of interleaving their MPSSE traffic with the
+// client's shifts. It ends when the client has sent nothing for
+// CONFIG_XVC_IDLE_TIMEOUT seconds.
+static void xvc_session(int device, int sock)
+{
+  int opt = 1;
+  uint8_t *vectors = NULL;
+  if (!arty_device_present(device))
+    ESP_LOGI(TAG, "No board in slot %d", device);
+  else if ((vectors = malloc(3 * XVC_MAX_VECTOR_BYTES)) == NULL)
+    ESP_LOGE(TAG, "No memory for the shift vectors");
+  else
+  {
+    if (!arty_lock_device(device, 0))
+    {
+      ESP_LOGI(TAG, "Board %s busy, client waits", arty_device_serial(device));
+      arty_lock_device(device, ARTY_LOCK_FOREVER);
+    }
+    ESP_LOGI(TAG, "Client connected to board %s", arty_device_serial(device));
+    // The client may reconfigure the FPGA behind the bitstream cache's back
+    write_bitstream_cache(arty_device_serial(device), NULL, 0);
+    // settck: lasts for the session only, as FREQUENCY does in SVF playback
+    uint32_t tck = ftdi_mpsse_get_frequency();
+    // Shifts are request/response round trips, so do not hold back replies
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    // A client that goes quiet without closing gives the board back
+    struct timeval idle = { CONFIG_XVC_IDLE_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    xvc_serve(sock, vectors);
+    if (ftdi_mpsse_get_frequency() != tck)
+      ftdi_mpsse_set_frequency(tck);
+    if (arty_device_present(device))
+      ftdi_latency_idle();
+    arty_unlock_device(device);
+    ESP_LOGI(TAG, "Client of board %s disconnected", arty_device_serial(device));
+  }
+  free(vectors);
+}
+
+static void xvc_task(void *arg)
+{
+  int device = (int)(intptr_t)arg;
+  int port = CONFIG_XVC_PORT + device;
+  arty_select_device(device);
+
+  int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+  if (listener < 0)
+  {
+    ESP_LOGE(TAG, "Unable to create socket for port %d", port);
+    vTaskDelete(NULL);
+    return;
+  }
+  int opt = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0)
+  {
+    ESP_LOGE(TAG, "Unable to listen on port %d", port);
+    close(listener);
+    vTaskDelete(NULL);
+    return;
+  }
+  ESP_LOGI(TAG, "Listening on port %d for slot %d", port, device);
+
+  while (1)
+  {
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0)
+      continue;
+    xvc_session(device, sock);
+    close(sock);
+  }
+}
+
+void init_xvc(void)
+{
+  for (int i = 0; i < ARTY_MAX_DEVICES; i++)
+  {
+    char name[8];
+    snprintf(name, sizeof(name), "xvc%d", i);
+    xTaskCreate(xvc_task, name, XVC_TASK_STACK, (void *)(intptr_t)i, XVC_TASK_PRIORITY, NULL);
+  }
+}
@@ -4,9 +4,11 @@
  * SPDX-License-Identifier: Unlicense OR CC0-1.0
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "appfilesystem.h"
 #include <esp_vfs.h>
@@ -16,6 +18,9 @@
 #include "esp_log.h"
 #include "usb/usb_host.h"
 #include "appuart.h"
+#include "arty_driver.h"
+#include "ftdi.h"
+#include "softcore_image.h"
 
 #define CLIENT_NUM_EVENT_MSG        5
 
@@ -29,6 +34,29 @@
 #define ACTION_TRANSFER             0x80
 #define ACTION_CONTROL_TRANSFER     0x40
 
+#define ARTY_IN_TRANSFER_MAX        8
+#define ARTY_MPSSE_IN_TRANSFER_COUNT 4
+#define ARTY_MPSSE_IN_TRANSFER_SIZE 512
+// Channel B streams without being asked, so it keeps more and larger
+// transfers queued: 8 KB in flight covers several ms at 3 Mbaud
+#define ARTY_UART_IN_TRANSFER_COUNT 8
+#define ARTY_UART_IN_TRANSFER_SIZE  1024
+#define ARTY_IN_PACKET_SIZE         64
+#define ARTY_IN_STATUS_BYTES        2
+// Second status byte of every FTDI IN packet: the UART's line status
+#define ARTY_LINE_STATUS_OE         0x02
+#define ARTY_LINE_STATUS_PE         0x04
+#define ARTY_LINE_STATUS_FE         0x08
+#define ARTY_LINE_STATUS_BI         0x10
+#define ARTY_MPSSE_FIFO_SIZE        8192
+#define ARTY_UART_FIFO_SIZE         32768
+#define ARTY_RECEIVE_TIMEOUT_MS     1000
+// Longest wait for the transfers of an unplugged board to come back
+#define ARTY_CLOSE_TIMEOUT_MS       1000
+#define ARTY_RISCV_FLASH_CHUNK      256
+#define ARTY_FTDI_VID               0x0403
+#define ARTY_FT2232H_PID            0x6010
+
 typedef struct {
 
         union { // offset   description
@@ -54,41 +82,241 @@ typedef struct {
         uint16_t wLength; //   6      Depends on bRequest
 } __attribute__((packed)) SETUP_PKT, *PSETUP_PKT;
 
+// Single producer (IN transfer callbacks on the driver task), single consumer
+// (the ftdi reader). head and tail are free-running, size is a power of two.
+typedef struct {
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    SemaphoreHandle_t data_sem;
+} arty_fifo_t;
+
+typedef struct {
+    uint8_t EP;
+    arty_fifo_t fifo;
+    uint8_t transfer_count;
+    usb_transfer_t *transfers[ARTY_IN_TRANSFER_MAX];
+    volatile uint8_t in_flight;
+    struct arty_receive_stats stats;
+} arty_in_ring_t;
+
+// One FT2232H. The transfers and rings are allocated the first time the slot
+// is used and kept for whatever board takes the slot next.
 typedef struct {
-    usb_host_client_handle_t client_hdl;
     uint8_t dev_addr;
     usb_device_handle_t dev_hdl;
     uint32_t actions;
+    bool allocated;
+    bool ready;
+    char serial[ARTY_SERIAL_SIZE];
+    usb_transfer_t *transfer;
+    QueueHandle_t control_transfer_queue;
+    usb_transfer_t *out_transfers[ARTY_OUT_TRANSFER_COUNT];
+    QueueHandle_t out_free_queue;
+    SemaphoreHandle_t out_idle_sem;
+    arty_in_ring_t in_rings[2];
+    // Held by whichever job is using the board, see arty_lock_device()
+    SemaphoreHandle_t lock;
+} arty_device_t;
+
+typedef struct {
+    usb_host_client_handle_t client_hdl;
+    arty_device_t devices[ARTY_MAX_DEVICES];
 } class_driver_t;
 
 static const char *TAG = "arty_driver";
 static class_driver_t driver_obj = {0};
-usb_transfer_t *transfer;
-usb_transfer_t *read_transfer;
-static QueueHandle_t transfer_queue;
-static QueueHandle_t in_transfer_queue;
-static QueueHandle_t control_transfer_queue;
-TaskHandle_t arty_receive_task_hdl;
+
+static uint32_t arty_fifo_count(arty_fifo_t *fifo)
+{
+    return __atomic_load_n(&fifo->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&fifo->tail, __ATOMIC_ACQUIRE);
+}
+
+// Returns the number of bytes dropped because the fifo was full
+static uint32_t arty_fifo_put(arty_fifo_t *fifo, const uint8_t *data, uint32_t len)
+{
+    uint32_t head = fifo->head;
+    uint32_t space = fifo->size - (head - __atomic_load_n(&fifo->tail, __ATOMIC_ACQUIRE));
+    uint32_t dropped = 0;
+    if (len > space)
+    {
+        dropped = len - space;
+        len = space;
+    }
+    uint32_t offset = head & (fifo->size - 1);
+    uint32_t first = fifo->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(fifo->buf + offset, data, first);
+    memcpy(fifo->buf, data + first, len - first);
+    __atomic_store_n(&fifo->head, head + len, __ATOMIC_RELEASE);
+    return dropped;
+}
+
+static uint32_t arty_fifo_get(arty_fifo_t *fifo, uint8_t *data, uint32_t len)
+{
+    uint32_t tail = fifo->tail;
+    uint32_t count = __atomic_load_n(&fifo->head, __ATOMIC_ACQUIRE) - tail;
+    if (len > count)
+        len = count;
+    uint32_t offset = tail & (fifo->size - 1);
+    uint32_t first = fifo->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(data, fifo->buf + offset, first);
+    memcpy(data + first, fifo->buf, len - first);
+    __atomic_store_n(&fifo->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+static arty_in_ring_t *arty_in_ring(arty_device_t *dev, uint8_t EP)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (dev->in_rings[i].EP == (EP | 0x80))
+            return &dev->in_rings[i];
+    }
+    return NULL;
+}
+
+static void in_transfer_cb(usb_transfer_t *transfer)
+{
+    arty_in_ring_t *ring = (arty_in_ring_t *)transfer->context;
+
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    if (transfer->status != USB_TRANSFER_STATUS_COMPLETED)
+    {
+        // Device gone or endpoint halted, the ring is re-armed on the next open
+        ring->in_flight--;
+        return;
+    }
+    // Every FTDI packet starts with two status bytes, strip them
+    struct arty_receive_stats *stats = &ring->stats;
+    bool received = false;
+    for (int offset = 0; offset < transfer->actual_num_bytes; offset += ARTY_IN_PACKET_SIZE)
+    {
+        int len = transfer->actual_num_bytes - offset;
+        if (len > ARTY_IN_PACKET_SIZE)
+            len = ARTY_IN_PACKET_SIZE;
+        if (len < ARTY_IN_STATUS_BYTES)
+            continue;
+        uint8_t line_status = transfer->data_buffer[offset + 1];
+        if (line_status & ARTY_LINE_STATUS_OE)
+            stats->ftdi_overruns++;
+        if (line_status & ARTY_LINE_STATUS_PE)
+            stats->parity_errors++;
+        if (line_status & ARTY_LINE_STATUS_FE)
+            stats->framing_errors++;
+        if (line_status & ARTY_LINE_STATUS_BI)
+            stats->breaks++;
+        if (len > ARTY_IN_STATUS_BYTES)
+        {
+            len -= ARTY_IN_STATUS_BYTES;
+            stats->overruns += arty_fifo_put(&ring->fifo, transfer->data_buffer + offset + ARTY_IN_STATUS_BYTES, len);
+            stats->bytes += len;
+            received = true;
+        }
+    }
+    if (received)
+    {
+        uint32_t count = arty_fifo_count(&ring->fifo);
+        if (count > stats->high_water)
+            stats->high_water = count;
+        xSemaphoreGive(ring->fifo.data_sem);
+    }
+    // Straight back in the queue, so the endpoint is never left without one
+    if (usb_host_transfer_submit(transfer) != ESP_OK)
+    {
+        stats->resubmit_failures++;
+        ring->in_flight--;
+    }
+}
+
+static void arty_in_ring_init(arty_in_ring_t *ring, uint8_t EP, uint32_t fifo_size, uint8_t transfer_count, uint32_t transfer_size)
+{
+    ring->EP = EP | 0x80;
+    ring->fifo.buf = malloc(fifo_size);
+    ring->fifo.size = fifo_size;
+    ring->fifo.head = 0;
+    ring->fifo.tail = 0;
+    ring->fifo.data_sem = xSemaphoreCreateBinary();
+    ring->in_flight = 0;
+    ring->transfer_count = transfer_count;
+    memset(&ring->stats, 0, sizeof(ring->stats));
+    for (int i = 0; i < transfer_count; i++)
+    {
+        usb_host_transfer_alloc(transfer_size, 0, &ring->transfers[i]);
+        ring->transfers[i]->num_bytes = transfer_size;
+        ring->transfers[i]->callback = in_transfer_cb;
+        ring->transfers[i]->bEndpointAddress = ring->EP;
+        ring->transfers[i]->context = ring;
+    }
+}
+
+// Forgets what the last board left in the ring; its transfers must all
+// have come back
+static void arty_in_ring_reset(arty_in_ring_t *ring)
+{
+    ring->in_flight = 0;
+    ring->fifo.head = 0;
+    ring->fifo.tail = 0;
+    xSemaphoreTake(ring->fifo.data_sem, 0);
+}
+
+// Keep all IN transfers of a ring queued so data is pulled off the FTDI as
+// soon as it is available
+static void arty_in_ring_start(arty_in_ring_t *ring, usb_device_handle_t dev_hdl)
+{
+    if (ring->in_flight != 0)
+        return;
+    for (int i = 0; i < ring->transfer_count; i++)
+    {
+        ring->transfers[i]->device_handle = dev_hdl;
+        if (usb_host_transfer_submit(ring->transfers[i]) == ESP_OK)
+            ring->in_flight++;
+    }
+}
+
+static arty_device_t *arty_device_by_handle(usb_device_handle_t dev_hdl)
+{
+    for (int i = 0; i < ARTY_MAX_DEVICES; i++)
+    {
+        if (driver_obj.devices[i].dev_hdl == dev_hdl)
+            return &driver_obj.devices[i];
+    }
+    return NULL;
+}
 
 static void client_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg)
 {
     class_driver_t *driver_obj = (class_driver_t *)arg;
+    arty_device_t *dev;
     switch (event_msg->event) 
     {
         case USB_HOST_CLIENT_EVENT_NEW_DEV:
-            if (driver_obj->dev_addr == 0) 
+            for (int i = 0; i < ARTY_MAX_DEVICES; i++)
             {
-                driver_obj->dev_addr = event_msg->new_dev.address;
-                //Open the device next
-                driver_obj->actions |= ACTION_OPEN_DEV;
+                dev = &driver_obj->devices[i];
+                if (dev->dev_addr == 0) 
+                {
+                    dev->dev_addr = event_msg->new_dev.address;
+                    //Open the device next
+                    dev->actions |= ACTION_OPEN_DEV;
+                    return;
+                }
             }
+            ESP_LOGW(TAG, "No free slot for the device at address %d", event_msg->new_dev.address);
             break;
         case USB_HOST_CLIENT_EVENT_DEV_GONE:
-            if (driver_obj->dev_hdl != NULL) 
+            dev = arty_device_by_handle(event_msg->dev_gone.dev_hdl);
+            if (dev != NULL) 
             {
                 ESP_LOGI("class_driver","Received event dev gone");
+                dev->ready = false;
+                ftdi_state_invalidate(dev - driver_obj->devices);
                 //Cancel any other actions and close the device next
-                driver_obj->actions = ACTION_CLOSE_DEV;
+                dev->actions = ACTION_CLOSE_DEV;
             }
             break;
         default:
@@ -97,61 +325,115 @@ static void client_event_cb(const usb_host_client_event_msg_t *event_msg, void *
     }
 }
 
-static void action_open_dev(class_driver_t *driver_obj)
+static void control_transfer_cb(usb_transfer_t *transfer)
+{
+    uint8_t outByte = 0;
+    arty_device_t *dev = (arty_device_t *)transfer->context;
+
+    //printf("Control transfer status %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
+    xQueueSend(dev->control_transfer_queue, &outByte, 0);
+}
+
+static void transfer_cb(usb_transfer_t *transfer)
+{
+    arty_device_t *dev = (arty_device_t *)transfer->context;
+
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    if (transfer->status != USB_TRANSFER_STATUS_COMPLETED)
+        ESP_LOGE(TAG, "OUT transfer on EP %" PRIu8 " failed with status %d", transfer->bEndpointAddress, transfer->status);
+    // Hand the buffer back to the pool
+    xQueueSend(dev->out_free_queue, &transfer, 0);
+    if (uxQueueMessagesWaiting(dev->out_free_queue) == ARTY_OUT_TRANSFER_COUNT)
+        xSemaphoreGive(dev->out_idle_sem);
+}
+
+static void arty_device_alloc(arty_device_t *dev)
+{
+    dev->control_transfer_queue = xQueueCreate(1, sizeof(uint8_t));
+    dev->out_free_queue = xQueueCreate(ARTY_OUT_TRANSFER_COUNT, sizeof(usb_transfer_t *));
+    dev->out_idle_sem = xSemaphoreCreateBinary();
+    usb_host_transfer_alloc(ARTY_TRANSFER_SIZE, 0, &dev->transfer);
+    dev->transfer->context = dev;
+    for (int i = 0; i < ARTY_OUT_TRANSFER_COUNT; i++)
+    {
+        usb_host_transfer_alloc(ARTY_TRANSFER_SIZE, 0, &dev->out_transfers[i]);
+        dev->out_transfers[i]->context = dev;
+        xQueueSend(dev->out_free_queue, &dev->out_transfers[i], 0);
+    }
+    arty_in_ring_init(&dev->in_rings[0], FT2232H_MPSSE_READ_EP, ARTY_MPSSE_FIFO_SIZE, ARTY_MPSSE_IN_TRANSFER_COUNT, ARTY_MPSSE_IN_TRANSFER_SIZE);
+    arty_in_ring_init(&dev->in_rings[1], FT2232H_UART_READ_EP, ARTY_UART_FIFO_SIZE, ARTY_UART_IN_TRANSFER_COUNT, ARTY_UART_IN_TRANSFER_SIZE);
+    dev->allocated = true;
+}
+
+static void action_open_dev(class_driver_t *driver_obj, arty_device_t *dev)
 {
-    assert(driver_obj->dev_addr != 0);
-    ESP_LOGI(TAG, "Opening device at address %d", driver_obj->dev_addr);
-    ESP_ERROR_CHECK(usb_host_device_open(driver_obj->client_hdl, driver_obj->dev_addr, &driver_obj->dev_hdl));
-    usb_host_interface_claim(driver_obj->client_hdl, driver_obj->dev_hdl, 1, 0);
+    assert(dev->dev_addr != 0);
+    ESP_LOGI(TAG, "Opening device at address %d", dev->dev_addr);
+    if (!dev->allocated)
+        arty_device_alloc(dev);
+    ESP_ERROR_CHECK(usb_host_device_open(driver_obj->client_hdl, dev->dev_addr, &dev->dev_hdl));
+    // Anything else on the hub is left alone and does not hold a slot
+    const usb_device_desc_t *dev_desc;
+    ESP_ERROR_CHECK(usb_host_get_device_descriptor(dev->dev_hdl, &dev_desc));
+    if (dev_desc->idVendor != ARTY_FTDI_VID || dev_desc->idProduct != ARTY_FT2232H_PID)
+    {
+        ESP_LOGI(TAG, "Ignoring device %04x:%04x at address %d", dev_desc->idVendor, dev_desc->idProduct, dev->dev_addr);
+        usb_host_device_close(driver_obj->client_hdl, dev->dev_hdl);
+        dev->dev_hdl = NULL;
+        dev->dev_addr = 0;
+        dev->actions = 0;
+        return;
+    }
+    usb_host_interface_claim(driver_obj->client_hdl, dev->dev_hdl, 1, 0);
     //Get the device's information next
-    driver_obj->actions &= ~ACTION_OPEN_DEV;
-    driver_obj->actions |= ACTION_GET_DEV_INFO;
+    dev->actions &= ~ACTION_OPEN_DEV;
+    dev->actions |= ACTION_GET_DEV_INFO;
 }
 
-static void action_get_info(class_driver_t *driver_obj)
+static void action_get_info(arty_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     ESP_LOGI(TAG, "Getting device information");
     usb_device_info_t dev_info;
-    ESP_ERROR_CHECK(usb_host_device_info(driver_obj->dev_hdl, &dev_info));
+    ESP_ERROR_CHECK(usb_host_device_info(dev->dev_hdl, &dev_info));
     ESP_LOGI(TAG, "\t%s speed", (dev_info.speed == USB_SPEED_LOW) ? "Low" : "Full");
     ESP_LOGI(TAG, "\tbConfigurationValue %d", dev_info.bConfigurationValue);
     //Todo: Print string descriptors
 
     //Get the device descriptor next
-    driver_obj->actions &= ~ACTION_GET_DEV_INFO;
-    driver_obj->actions |= ACTION_GET_DEV_DESC;
+    dev->actions &= ~ACTION_GET_DEV_INFO;
+    dev->actions |= ACTION_GET_DEV_DESC;
 }
 
-static void action_get_dev_desc(class_driver_t *driver_obj)
+static void action_get_dev_desc(arty_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     ESP_LOGI(TAG, "Getting device descriptor");
     const usb_device_desc_t *dev_desc;
-    ESP_ERROR_CHECK(usb_host_get_device_descriptor(driver_obj->dev_hdl, &dev_desc));
+    ESP_ERROR_CHECK(usb_host_get_device_descriptor(dev->dev_hdl, &dev_desc));
     usb_print_device_descriptor(dev_desc);
     //Get the device's config descriptor next
-    driver_obj->actions &= ~ACTION_GET_DEV_DESC;
-    driver_obj->actions |= ACTION_GET_CONFIG_DESC;
+    dev->actions &= ~ACTION_GET_DEV_DESC;
+    dev->actions |= ACTION_GET_CONFIG_DESC;
 }
 
-static void action_get_config_desc(class_driver_t *driver_obj)
+static void action_get_config_desc(arty_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     ESP_LOGI(TAG, "Getting config descriptor");
     const usb_config_desc_t *config_desc;
-    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc));
+    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(dev->dev_hdl, &config_desc));
     usb_print_config_descriptor(config_desc, NULL);
     //Get the device's string descriptors next
-    driver_obj->actions &= ~ACTION_GET_CONFIG_DESC;
-    driver_obj->actions |= ACTION_GET_STR_DESC;
+    dev->actions &= ~ACTION_GET_CONFIG_DESC;
+    dev->actions |= ACTION_GET_STR_DESC;
 }
 
-static void action_get_str_desc(class_driver_t *driver_obj)
+static void action_get_str_desc(arty_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     usb_device_info_t dev_info;
-    ESP_ERROR_CHECK(usb_host_device_info(driver_obj->dev_hdl, &dev_info));
+    ESP_ERROR_CHECK(usb_host_device_info(dev->dev_hdl, &dev_info));
     if (dev_info.str_desc_manufacturer) 
     {
         ESP_LOGI(TAG, "Getting Manufacturer string descriptor");
@@ -162,57 +444,139 @@ static void action_get_str_desc(class_driver_t *driver_obj)
         ESP_LOGI(TAG, "Getting Product string descriptor");
         usb_print_string_descriptor(dev_info.str_desc_product);
     }
+    // Boards are addressed by serial, so one without a serial gets a name
+    // from its bus address
+    snprintf(dev->serial, ARTY_SERIAL_SIZE, "usb%d", dev->dev_addr);
     if (dev_info.str_desc_serial_num) 
     {
         ESP_LOGI(TAG, "Getting Serial Number string descriptor");
         usb_print_string_descriptor(dev_info.str_desc_serial_num);
+        // Keep an ASCII copy so per-board settings can be keyed on it
+        const usb_str_desc_t *desc = dev_info.str_desc_serial_num;
+        int n = (desc->bLength - 2) / 2;
+        if (n > ARTY_SERIAL_SIZE - 1)
+            n = ARTY_SERIAL_SIZE - 1;
+        for (int i = 0; i < n; i++)
+            dev->serial[i] = (desc->wData[i] < 0x80) ? (char)desc->wData[i] : '?';
+        dev->serial[n] = '\0';
     }
     //Nothing to do until the device disconnects
-    driver_obj->actions &= ~ACTION_GET_STR_DESC;
+    dev->actions &= ~ACTION_GET_STR_DESC;
 }
 
-static void action_close_dev(class_driver_t *driver_obj)
+int arty_find_device(const char *serial)
 {
-    ESP_ERROR_CHECK(usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl));
-    driver_obj->dev_hdl = NULL;
-    driver_obj->dev_addr = 0;
-    //We need to exit the event handler loop
-    driver_obj->actions &= ~ACTION_CLOSE_DEV;
-    //driver_obj->actions |= ACTION_EXIT;
+    for (int i = 0; i < ARTY_MAX_DEVICES; i++)
+    {
+        if (driver_obj.devices[i].ready && strcmp(driver_obj.devices[i].serial, serial) == 0)
+            return i;
+    }
+    return -1;
 }
 
-static void control_transfer_cb(usb_transfer_t *transfer)
+bool arty_device_present(int device)
 {
-    uint8_t outByte = 0;
+    return (device >= 0) && (device < ARTY_MAX_DEVICES) && driver_obj.devices[device].ready;
+}
 
-    //class_driver_t *driver_obj = (class_driver_t *)transfer->context;
-    //printf("Control transfer status %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
-    xQueueSend(control_transfer_queue, &outByte, 0);
+const char *arty_device_serial(int device)
+{
+    return driver_obj.devices[device].serial;
 }
 
-static void transfer_cb(usb_transfer_t *transfer)
+// The selection is kept in a thread-local pointer as index + 1, so a task
+// that never selected a board reads back NULL
+void arty_select_device(int device)
 {
-    uint8_t outByte = 0;
+    vTaskSetThreadLocalStoragePointer(NULL, ARTY_TLS_INDEX, (void *)(intptr_t)(device + 1));
+}
 
-    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
-    //class_driver_t *driver_obj = (class_driver_t *)transfer->context;
-    //printf("Transfer status %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
-    xQueueSend(transfer_queue, &outByte, 0);
+int arty_current_device(void)
+{
+    intptr_t selected = (intptr_t)pvTaskGetThreadLocalStoragePointer(NULL, ARTY_TLS_INDEX);
+    if (selected > 0)
+        return selected - 1;
+    for (int i = 0; i < ARTY_MAX_DEVICES; i++)
+    {
+        if (driver_obj.devices[i].ready)
+            return i;
+    }
+    return 0;
 }
 
-static void in_transfer_cb(usb_transfer_t *transfer)
+// The locks exist before any board is attached, so a job can hold a slot
+// across a replug
+void arty_driver_init(void)
 {
-    uint8_t outByte = 0;
+    for (int i = 0; i < ARTY_MAX_DEVICES; i++)
+        driver_obj.devices[i].lock = xSemaphoreCreateMutex();
+}
 
-    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
-    //class_driver_t *driver_obj = (class_driver_t *)transfer->context;
-    //printf("Transfer status %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
-    //usb_host_transfer_submit(read_transfer);   
-    ESP_LOGI("ARTY_IN_CB","Bytes %" PRIu16 " received", transfer->actual_num_bytes);
-    xQueueSend(in_transfer_queue, &outByte, 0);
-    usb_host_transfer_submit(read_transfer);   
+bool arty_lock_device(int device, uint32_t timeout_ms)
+{
+    TickType_t wait = (timeout_ms == ARTY_LOCK_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    return xSemaphoreTake(driver_obj.devices[device].lock, wait) == pdTRUE;
+}
+
+void arty_unlock_device(int device)
+{
+    xSemaphoreGive(driver_obj.devices[device].lock);
 }
 
+static arty_device_t *arty_device(void)
+{
+    return &driver_obj.devices[arty_current_device()];
+}
+
+const char *arty_get_serial(void)
+{
+    return arty_device()->serial;
+}
+
+usb_device_handle_t arty_get_device(void)
+{
+    return arty_device()->dev_hdl;
+}
+
+static bool arty_transfers_idle(arty_device_t *dev)
+{
+    return (dev->in_rings[0].in_flight == 0) && (dev->in_rings[1].in_flight == 0) &&
+           (uxQueueMessagesWaiting(dev->out_free_queue) == ARTY_OUT_TRANSFER_COUNT);
+}
+
+// The IN rings and OUT transfers are still queued when the board goes. They
+// are cancelled and waited for, and the interfaces released, before the
+// device can be closed. Their callbacks run from usb_host_client_handle_events(),
+// so this task keeps handling events while it waits.
+static void action_close_dev(class_driver_t *driver_obj, arty_device_t *dev)
+{
+    static const uint8_t endpoints[] = {
+        FT2232H_MPSSE_READ_EP | 0x80, FT2232H_MPSSE_WRITE_EP,
+        FT2232H_UART_READ_EP | 0x80, FT2232H_UART_WRITE_EP,
+    };
+    dev->serial[0] = '\0';
+    for (int i = 0; i < sizeof(endpoints); i++)
+    {
+        usb_host_endpoint_halt(dev->dev_hdl, endpoints[i]);
+        usb_host_endpoint_flush(dev->dev_hdl, endpoints[i]);
+    }
+    for (int waited = 0; !arty_transfers_idle(dev) && (waited < ARTY_CLOSE_TIMEOUT_MS); waited += 10)
+        usb_host_client_handle_events(driver_obj->client_hdl, pdMS_TO_TICKS(10));
+    if (!arty_transfers_idle(dev))
+        ESP_LOGW(TAG, "Transfers of the board at address %d did not come back", dev->dev_addr);
+    usb_host_interface_release(driver_obj->client_hdl, dev->dev_hdl, 0);
+    usb_host_interface_release(driver_obj->client_hdl, dev->dev_hdl, 1);
+    esp_err_t err = usb_host_device_close(driver_obj->client_hdl, dev->dev_hdl);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Closing the board at address %d failed: %s", dev->dev_addr, esp_err_to_name(err));
+    arty_in_ring_reset(&dev->in_rings[0]);
+    arty_in_ring_reset(&dev->in_rings[1]);
+    dev->dev_hdl = NULL;
+    dev->dev_addr = 0;
+    //We need to exit the event handler loop
+    dev->actions &= ~ACTION_CLOSE_DEV;
+    //dev->actions |= ACTION_EXIT;
+}
 
 void arty_transfer_control(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi, uint16_t wInd, uint16_t total)
 {
@@ -226,57 +590,144 @@ void arty_transfer_control(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t
     setup_pkt.wIndex = wInd;
     setup_pkt.wLength = total;
 
+    // Requests such as purges must not overtake bulk data still in flight.
+    // A transfer the calling task is still filling would never come back
+    // to the pool, so it goes out first.
+    ftdi_write_transfer();
+    arty_transfer_wait_idle();
+
+    arty_device_t *dev = arty_device();
+    usb_transfer_t *transfer = dev->transfer;
     transfer->num_bytes = 8;
     transfer->callback = control_transfer_cb;
     transfer->bEndpointAddress = ep;
+    transfer->device_handle = dev->dev_hdl;
     memcpy(transfer->data_buffer, (void *) & setup_pkt, 8);
     
-    //driver_obj.actions |= ACTION_CONTROL_TRANSFER;
+    //dev->actions |= ACTION_CONTROL_TRANSFER;
     usb_host_transfer_submit_control(driver_obj.client_hdl, transfer);	
     //ESP_LOGI("class_driver", "Waiting on control transfer queue");
-    xQueueReceive(control_transfer_queue,&inbyte,portMAX_DELAY);
+    xQueueReceive(dev->control_transfer_queue,&inbyte,portMAX_DELAY);
+}
+
+// Takes a free OUT transfer from the pool. Blocks only when all
+// ARTY_OUT_TRANSFER_COUNT transfers are in flight.
+usb_transfer_t *arty_transfer_get(void)
+{
+    usb_transfer_t *xfer = NULL;
+    xQueueReceive(arty_device()->out_free_queue, &xfer, portMAX_DELAY);
+    return xfer;
+}
+
+// Submits size bytes already placed in xfer->data_buffer and returns
+// immediately; the completion callback recycles the transfer
+void arty_transfer_submit(usb_transfer_t *xfer, int size, uint8_t EP)
+{
+    xfer->num_bytes = size;
+    xfer->callback = transfer_cb;
+    xfer->bEndpointAddress = EP;
+    xfer->device_handle = ((arty_device_t *)xfer->context)->dev_hdl;
+    if (usb_host_transfer_submit(xfer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to submit OUT transfer on EP %" PRIu8, EP);
+        xQueueSend(((arty_device_t *)xfer->context)->out_free_queue, &xfer, 0);
+    }
+}
+
+// Waits until every OUT transfer has completed
+void arty_transfer_wait_idle(void)
+{
+    arty_device_t *dev = arty_device();
+    while (uxQueueMessagesWaiting(dev->out_free_queue) != ARTY_OUT_TRANSFER_COUNT)
+        xSemaphoreTake(dev->out_idle_sem, portMAX_DELAY);
 }
 
 void arty_transfer_data(uint8_t *data, int size, uint8_t EP)
 {
-    uint8_t inbyte; 
-    
-    transfer->num_bytes = size;
-    transfer->callback = transfer_cb;
-    transfer->bEndpointAddress = EP;
-    memcpy(transfer->data_buffer, data, size);
-    //driver_obj.actions |= ACTION_TRANSFER;
-    usb_host_transfer_submit(transfer);   
-    //ESP_LOGI("class_driver", "Waiting on transfer queue");
-    xQueueReceive(transfer_queue,&inbyte,portMAX_DELAY);
+    while (size > 0)
+    {
+        int len = (size > ARTY_TRANSFER_SIZE) ? ARTY_TRANSFER_SIZE : size;
+        usb_transfer_t *xfer = arty_transfer_get();
+        memcpy(xfer->data_buffer, data, len);
+        arty_transfer_submit(xfer, len, EP);
+        data += len;
+        size -= len;
+    }
 }
 
+// Returns up to size payload bytes (FTDI status bytes already stripped),
+// blocking until at least one byte arrives or ARTY_RECEIVE_TIMEOUT_MS passes
 uint16_t arty_receive_data(uint8_t *data, uint16_t size, uint8_t EP)
 {
-    uint16_t recv = 0; 
+    arty_in_ring_t *ring = arty_in_ring(arty_device(), EP);
+    if (ring == NULL)
+        return 0;
+    while (arty_fifo_count(&ring->fifo) == 0)
+    {
+        if (xSemaphoreTake(ring->fifo.data_sem, ARTY_RECEIVE_TIMEOUT_MS / portTICK_PERIOD_MS) != pdTRUE)
+            return 0;
+    }
+    return arty_fifo_get(&ring->fifo, data, size);
+}
 
-#if 0
-    uint8_t inbyte; 
-    read_transfer->num_bytes = size;
-    read_transfer->callback = in_transfer_cb;
-    read_transfer->bEndpointAddress = EP;
-    //driver_obj.actions |= ACTION_TRANSFER;
-    usb_host_transfer_submit(read_transfer);   
-    ESP_LOGI("class_driver", "Waiting on transfer queue");
-    xQueueReceive(in_transfer_queue,&inbyte,portMAX_DELAY);
-    ESP_LOGI("class_driver", "Finished waiting on transfer queue");
-    recv = read_transfer->actual_num_bytes;
-    for (int i =0; i < recv; i++)
+// Zero-copy read: points data at the oldest bytes received on EP and returns
+// how many follow contiguously, waiting up to timeout_ms for the first one.
+// They stay in the fifo until arty_receive_consume() releases them.
+uint32_t arty_receive_peek(const uint8_t **data, uint32_t timeout_ms, uint8_t EP)
+{
+    arty_in_ring_t *ring = arty_in_ring(arty_device(), EP);
+    if (ring == NULL)
+        return 0;
+    while (arty_fifo_count(&ring->fifo) == 0)
     {
-      data[i] = read_transfer->data_buffer[i];
+        if (xSemaphoreTake(ring->fifo.data_sem, timeout_ms / portTICK_PERIOD_MS) != pdTRUE)
+            return 0;
     }
-#endif
-    return recv;
+    uint32_t count = arty_fifo_count(&ring->fifo);
+    uint32_t offset = ring->fifo.tail & (ring->fifo.size - 1);
+    *data = ring->fifo.buf + offset;
+    return count < ring->fifo.size - offset ? count : ring->fifo.size - offset;
+}
+
+void arty_receive_consume(uint32_t len, uint8_t EP)
+{
+    arty_in_ring_t *ring = arty_in_ring(arty_device(), EP);
+    if (ring == NULL)
+        return;
+    uint32_t count = arty_fifo_count(&ring->fifo);
+    if (len > count)
+        len = count;
+    __atomic_store_n(&ring->fifo.tail, ring->fifo.tail + len, __ATOMIC_RELEASE);
+}
+
+void arty_receive_get_stats(uint8_t EP, struct arty_receive_stats *stats)
+{
+    arty_in_ring_t *ring = arty_in_ring(arty_device(), EP);
+    if (ring == NULL)
+        memset(stats, 0, sizeof(*stats));
+    else
+        *stats = ring->stats;
+}
+
+void arty_receive_reset_stats(uint8_t EP)
+{
+    arty_in_ring_t *ring = arty_in_ring(arty_device(), EP);
+    if (ring != NULL)
+        memset(&ring->stats, 0, sizeof(ring->stats));
+}
+
+// Drops anything already received on EP, used after purging the FTDI buffers
+void arty_receive_flush(uint8_t EP)
+{
+    arty_in_ring_t *ring = arty_in_ring(arty_device(), EP);
+    if (ring == NULL)
+        return;
+    __atomic_store_n(&ring->fifo.tail, __atomic_load_n(&ring->fifo.head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    xSemaphoreTake(ring->fifo.data_sem, 0);
 }
 
 void arty_flash(char *filename)
 {
-    uint8_t arty_bAddress = 1;
     FILE *f = fopen(filename, "rb");
     size_t ret;
     uint8_t buf[2048];
@@ -291,11 +742,8 @@ void arty_flash(char *filename)
       ESP_LOGE(TAG,"File does not exist!");
       return;
     } 
-    arty_transfer_control(arty_bAddress, 0, 0x40, 0, 0, 0, 1, 0);
-    arty_transfer_control(arty_bAddress, 0, 0x40, 9, 255, 0, 1, 0);
-    arty_transfer_control(arty_bAddress, 0, 0x40, 11, 11, 2, 1, 0);
-    arty_transfer_control(arty_bAddress, 0, 0x40, 0, 1, 0, 1, 0);
-    arty_transfer_control(arty_bAddress, 0, 0x40, 0, 2, 0, 1, 0);
+    ftdi_mpsse_mode();
+    ftdi_mpsse_setup_lost();
 
    while(1)
    {
@@ -315,26 +763,6 @@ void arty_flash(char *filename)
 
 }
 
-static uint8_t asciihex2byte(uint8_t *hex)
-{
-   uint8_t result;
-
-   result = 0x00;
-   if((*hex >= 0x30) && (*hex <= 0x39))
-     result = (*hex - 0x30) << 4;
-   else
-     result = (*hex - 0x37) << 4;
-
-   hex++;
-
-   if((*hex >= 0x30) && (*hex <= 0x39))
-     result = result | ((*hex - 0x30) & 0x0F);
-   else
-     result = result | ((*hex - 0x37) & 0x0F);
-
-   return(result);
-}
-
 static void uint2bytes(uint32_t val, uint8_t *bytes)
 {
   bytes[0] = 0x000000FF & val;
@@ -345,14 +773,10 @@ static void uint2bytes(uint32_t val, uint8_t *bytes)
 
 void arty_gpio_uart_riscv_flash(char *filename)
 {
-  FILE*    inFile;
-  uint8_t  inLine[256];
-  uint8_t  asciiData[16][3];
-  uint8_t  hexAddress[4];
-  uint8_t  hexData[16];
-  uint32_t currAddress = 0;
-  uint32_t nextAddress = 0;
-  uint32_t currLine = 0;
+  uint8_t  words[ARTY_RISCV_FLASH_CHUNK];
+  uint8_t  tuples[2 * ARTY_RISCV_FLASH_CHUNK];
+  struct softcore_segment seg;
+  uint32_t n;
 #if 0
   // Flip SW0 and SW1 to on
   gpio_set_level(GPIO_OUTPUT_FPGA_SW0, 1);
@@ -364,119 +788,41 @@ void arty_gpio_uart_riscv_flash(char *filename)
   // Delay
   vTaskDelay(500 / portTICK_RATE_MS);
 #endif
-  // Open hex file
   flushUART();
   resetUARTRXData();
-  inFile = fopen(filename, "r");
-  if(inFile == NULL)
+  softcore_image_t *img = softcore_image_open(filename);
+  if(img == NULL)
     return;
-  // fread record byte at a time until \n
-  while(fgets((char *)inLine, sizeof(inLine), inFile)!=NULL)
+  while(softcore_image_next_segment(img, &seg))
   {
-    currLine++;
-    // check if address (starts with @)
-    if(inLine[0] == '@')
+    uint32_t currAddress = seg.address;
+    // Each word goes out as its address followed by the data, both little-endian
+    while((n = softcore_image_read(img, words, sizeof(words)) & ~3u) > 0)
     {
-      uint8_t* linePtr = inLine;
-      linePtr++;
-      // if so, set currAddress
-      if(sscanf((char *)linePtr,"%" SCNu32 "\r\n", &nextAddress)==1)
+      for(uint32_t i = 0; i < n; i += 4, currAddress += 4)
       {
-	currAddress = nextAddress;
-        ESP_LOGI("ARTY_FLASH_SOFTCORE", "Got line %" PRIu32 " with currAddress of %" PRIu32 " == %" PRIX32, currLine, currAddress, currAddress);
-      }
-      else
-      {
-        ESP_LOGI("ARTY_FLASH_SOFTCORE", "Did not scan currAddress");
-	goto clean;
+        uint2bytes(currAddress, &tuples[2*i]);
+        memcpy(&tuples[2*i + 4], &words[i], 4);
       }
+      sendUARTBytes(tuples, 2*n);
     }
-    else
+    if(!softcore_image_segment_ok(img))
     {
-      if(sscanf((char *)inLine, "%s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s\r\n", \
-		      asciiData[0], asciiData[1], asciiData[2], asciiData[3], \
-		      asciiData[4], asciiData[5], asciiData[6], asciiData[7], \
-		      asciiData[8], asciiData[9], asciiData[10], asciiData[11], \
-		      asciiData[12], asciiData[13], asciiData[14], asciiData[15])==16) 
-      {
-#if 0 
-        ESP_LOGI("ARTY_FLASH_SOFTCORE", "Got line %" PRIu32 " with strings %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s", \
-		      currLine, \
-    	 	      asciiData[0], asciiData[1], asciiData[2], asciiData[3], \
-		      asciiData[4], asciiData[5], asciiData[6], asciiData[7], \
-		      asciiData[8], asciiData[9], asciiData[10], asciiData[11], \
-		      asciiData[12], asciiData[13], asciiData[14], asciiData[15]); 
-#endif		      
-	for(int j=0; j<4; j++)
-	{
-          for(int i=0; i<4; i++)
-          {
-            hexData[i] = asciihex2byte(asciiData[i+j*4]);
-          }
-          // First convert and send currAddress bytes
-          uint2bytes(currAddress, hexAddress);
-#if 0 
-	  // ESP_LOGI("ARTY_FLASH_SOFTCORE", "Sending to address %02X%02X%02X%02X data %02X %02X %02X %02X", 
-	  ESP_LOGI("ARTY_FLASH_SOFTCORE", "Sending to address %" PRIX8 " %" PRIX8 " %" PRIX8 " %" PRIX8 " data %" PRIX8 " %" PRIX8 " %" PRIX8 " %" PRIX8, \
-			hexAddress[0], hexAddress[1], hexAddress[2], hexAddress[3], \
-			hexData[0], hexData[1], hexData[2], hexData[3]); 
-#endif
-          sendUARTBytes(hexAddress, 4);
-          // Then send the data word as bytes
-          sendUARTBytes(hexData, 4); 
-          // And increment current address by 4
-          currAddress += 4; 
-	}
-      }
-      else
-      {
-        ESP_LOGI("ARTY_FLASH_SOFTCORE", "Got non-data inLine of %s", inLine);
-	goto clean;
-      }
+      ESP_LOGE("ARTY_FLASH_SOFTCORE", "Segment at %" PRIX32 " is corrupt", seg.address);
+      break;
     }
   }
-clean:  fclose(inFile);
-}
-
-void arty_receive_task(void *arg)
-{
-	uint8_t inbyte;
-	while(1)
-	{
-		    	if(xQueueReceive(in_transfer_queue,&inbyte,portMAX_DELAY))
-	{
-	  ESP_LOGI("ARTY_TASK", "Something arrived in in_transfer_queue!");
-	  uint16_t receivedbytes = read_transfer->actual_num_bytes;
-	  ESP_LOGI("ARTY_TASK", "Received this many bytes %" PRIu16 " received", receivedbytes);
-	  for(int i=0; i < receivedbytes; i++)
-	  {
-		ESP_LOGI("ARTY_TASK", "Byte: %" PRIu8 " received", read_transfer->data_buffer[i]);
-	  }  
-	}
-	  ESP_LOGI("ARTY_TASK", "Nothing arrived in in_transfer_queue!");
-	}
+  softcore_image_close(img);
 }
 
 void arty_driver_task(void *arg)
 {
     SemaphoreHandle_t signaling_sem = (SemaphoreHandle_t)arg;
-    control_transfer_queue = xQueueCreate(1, sizeof(uint8_t));
-    transfer_queue = xQueueCreate(1, sizeof(uint8_t));
-    in_transfer_queue = xQueueCreate(1, sizeof(uint8_t));
     
     //uint8_t inbyte;
 
     //Wait until daemon task has installed USB Host Library
     xSemaphoreTake(signaling_sem, portMAX_DELAY);
-#if 0
-    xTaskCreatePinnedToCore(arty_receive_task,
-                            "arty",
-                            1024,
-       			    NULL,
-                            3,
-                            &arty_receive_task_hdl,
-                            0);
-#endif
     ESP_LOGI(TAG, "Registering Client");
     usb_host_client_config_t client_config = {
         .is_synchronous = false,    //Synchronous clients currently not supported. Set this to false
@@ -488,68 +834,57 @@ void arty_driver_task(void *arg)
     };
     ESP_ERROR_CHECK(usb_host_client_register(&client_config, &driver_obj.client_hdl));
 
-    usb_host_transfer_alloc(2048, 0, &transfer);
-    usb_host_transfer_alloc(2048, 0, &read_transfer);
-    read_transfer->num_bytes = 256;
-    read_transfer->callback = in_transfer_cb;
-    read_transfer->bEndpointAddress = 3;
-
-    while (1) 
+    bool exit = false;
+    while (!exit) 
     {	
-        if (driver_obj.actions == 0) 
+        bool idle = true;
+        for (int i = 0; i < ARTY_MAX_DEVICES; i++)
         {
-            usb_host_client_handle_events(driver_obj.client_hdl, portMAX_DELAY);
-        } 
-        else 
-        {
-            if (driver_obj.actions & ACTION_TRANSFER) 
-            {   
-                ESP_LOGI("class_driver", "ACTION_TRANSFER issuing");           
-                usb_host_transfer_submit(transfer);   
-                driver_obj.actions &= ~ACTION_TRANSFER;
-            }
-            if (driver_obj.actions & ACTION_CONTROL_TRANSFER) 
+            arty_device_t *dev = &driver_obj.devices[i];
+            if (dev->actions == 0) 
+                continue;
+            idle = false;
+            if (dev->actions & ACTION_OPEN_DEV) 
             {
-                ESP_LOGI("class_driver", "ACTION_CONTROL_TRANSFER issuing");
-                usb_host_transfer_submit_control(driver_obj.client_hdl, transfer);	
-                driver_obj.actions &= ~ACTION_CONTROL_TRANSFER;
+                action_open_dev(&driver_obj, dev);
             }
-            if (driver_obj.actions & ACTION_OPEN_DEV) 
+            if (dev->actions & ACTION_GET_DEV_INFO) 
             {
-                action_open_dev(&driver_obj);
+                action_get_info(dev);
             }
-            if (driver_obj.actions & ACTION_GET_DEV_INFO) 
+            if (dev->actions & ACTION_GET_DEV_DESC) 
             {
-                action_get_info(&driver_obj);
+                action_get_dev_desc(dev);
             }
-            if (driver_obj.actions & ACTION_GET_DEV_DESC) 
+            if (dev->actions & ACTION_GET_CONFIG_DESC) 
             {
-                action_get_dev_desc(&driver_obj);
+                action_get_config_desc(dev);
             }
-            if (driver_obj.actions & ACTION_GET_CONFIG_DESC) 
+            if (dev->actions & ACTION_GET_STR_DESC) 
             {
-                action_get_config_desc(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_GET_STR_DESC) 
-            {
-                action_get_str_desc(&driver_obj);
-    		    transfer->device_handle = driver_obj.dev_hdl;
-    		    read_transfer->device_handle = driver_obj.dev_hdl;
-                usb_host_interface_claim(driver_obj.client_hdl, driver_obj.dev_hdl, 0, 0);
-    		//usb_host_transfer_submit(read_transfer);   
+                action_get_str_desc(dev);
+                usb_host_interface_claim(driver_obj.client_hdl, dev->dev_hdl, 0, 0);
+                arty_in_ring_start(&dev->in_rings[0], dev->dev_hdl);
+                arty_in_ring_start(&dev->in_rings[1], dev->dev_hdl);
+                dev->ready = true;
+                ESP_LOGI(TAG, "Board %s ready in slot %d", dev->serial, i);
                 //xSemaphoreGive(signaling_sem);
             }
-            if (driver_obj.actions & ACTION_CLOSE_DEV) 
+            if (dev->actions & ACTION_CLOSE_DEV) 
             {
                 ESP_LOGI("class_driver","ACTION_CLOSE_DEV");
-                action_close_dev(&driver_obj);
+                action_close_dev(&driver_obj, dev);
             }
-            if (driver_obj.actions & ACTION_EXIT) 
+            if (dev->actions & ACTION_EXIT) 
             {
                 ESP_LOGI("class_driver","ACTION_EXIT");
-                break;
+                exit = true;
             }
         }
+        if (idle)
+        {
+            usb_host_client_handle_events(driver_obj.client_hdl, portMAX_DELAY);
+        }
     }
 
     ESP_LOGI(TAG, "Deregistering Client");
@@ -1,10 +1,62 @@
 #pragma once
+#include <stdbool.h>
+#include "usb/usb_host.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
+#define ARTY_TRANSFER_SIZE 4096
+#define ARTY_OUT_TRANSFER_COUNT 4
+#define ARTY_SERIAL_SIZE 32
+// FT2232H boards served at once, e.g. behind one hub
+#define ARTY_MAX_DEVICES 4
+// FreeRTOS thread-local slot holding the board a task works on; slot 0
+// belongs to pthreads
+#define ARTY_TLS_INDEX 1
+// Timeout for arty_lock_device() that waits as long as it takes
+#define ARTY_LOCK_FOREVER UINT32_MAX
+
+// Counters of one IN endpoint, kept from the first open of the slot
+struct arty_receive_stats {
+    uint64_t bytes;
+    // Bytes dropped because the fifo was full
+    uint32_t overruns;
+    // Most bytes ever waiting in the fifo
+    uint32_t high_water;
+    // Packets whose line status reports an FT2232H receive overrun, parity
+    // error, framing error or break
+    uint32_t ftdi_overruns;
+    uint32_t parity_errors;
+    uint32_t framing_errors;
+    uint32_t breaks;
+    // Transfers that could not be queued again, leaving fewer in flight
+    uint32_t resubmit_failures;
+};
+
+void arty_driver_init(void);
+usb_transfer_t *arty_transfer_get(void);
+void arty_transfer_submit(usb_transfer_t *xfer, int size, uint8_t EP);
+void arty_transfer_wait_idle(void);
 void arty_transfer_data(uint8_t *data, int size, uint8_t EP);
 void arty_transfer_control(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi, uint16_t wInd, uint16_t total);
 uint16_t arty_receive_data(uint8_t *data, uint16_t size, uint8_t EP);
+uint32_t arty_receive_peek(const uint8_t **data, uint32_t timeout_ms, uint8_t EP);
+void arty_receive_consume(uint32_t len, uint8_t EP);
+void arty_receive_get_stats(uint8_t EP, struct arty_receive_stats *stats);
+void arty_receive_reset_stats(uint8_t EP);
+void arty_receive_flush(uint8_t EP);
+// Every call below acts on the board selected by the calling task, or on
+// the first board present if the task never selected one or selected -1
+int arty_find_device(const char *serial);
+bool arty_device_present(int device);
+const char *arty_device_serial(int device);
+void arty_select_device(int device);
+int arty_current_device(void);
+// Gives one job at a time a board: an MQTT command, a fan-out job, an XVC
+// session. The calls above do not take it; the job holds it throughout.
+bool arty_lock_device(int device, uint32_t timeout_ms);
+void arty_unlock_device(int device);
+const char *arty_get_serial(void);
+usb_device_handle_t arty_get_device(void);
 void arty_gpio_uart_riscv_flash(char *filename);
 void arty_flash(char *filename);
 #ifdef __cplusplus
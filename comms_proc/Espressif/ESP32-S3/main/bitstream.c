@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include "rom/miniz.h"
+#include "mbedtls/sha256.h"
+#include "bitstream.h"
+
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+
+#define ZIP_METHOD_STORED  0
+#define ZIP_METHOD_DEFLATE 8
+
+static const char *TAG = "bitstream";
+
+struct bitstream {
+  FILE *f;
+  bitstream_format_t format;
+  bool deflate;
+  bool eof;
+  bool failed;
+  // Bytes left in a stored zip member
+  uint32_t stored_left;
+  uint8_t in_buf[BITSTREAM_INPUT_SIZE];
+  uint32_t in_pos;
+  uint32_t in_avail;
+  tinfl_status status;
+  tinfl_decompressor inflator;
+  // Inflated data is produced into the dictionary window itself and copied
+  // out from there before the window wraps over it
+  uint8_t *dict;
+  uint32_t dict_ofs;
+  uint32_t out_ofs;
+  uint32_t out_pending;
+};
+
+static bool skip_bytes(FILE *f, uint32_t len)
+{
+  return fseek(f, len, SEEK_CUR) == 0;
+}
+
+static bool skip_string(FILE *f)
+{
+  int c;
+  do
+  {
+    c = fgetc(f);
+  } while (c != EOF && c != 0);
+  return c == 0;
+}
+
+// RFC 1952 member header; the deflate data follows it directly
+static bool parse_gzip_header(bitstream_t *bs)
+{
+  uint8_t hdr[10];
+  if (fread(hdr, 1, sizeof(hdr), bs->f) != sizeof(hdr) || hdr[2] != 8)
+    return false;
+  uint8_t flags = hdr[3];
+  if (flags & GZIP_FEXTRA)
+  {
+    uint8_t xlen[2];
+    if (fread(xlen, 1, 2, bs->f) != 2 || !skip_bytes(bs->f, xlen[0] | (xlen[1] << 8)))
+      return false;
+  }
+  if ((flags & GZIP_FNAME) && !skip_string(bs->f))
+    return false;
+  if ((flags & GZIP_FCOMMENT) && !skip_string(bs->f))
+    return false;
+  if ((flags & GZIP_FHCRC) && !skip_bytes(bs->f, 2))
+    return false;
+  bs->deflate = true;
+  return true;
+}
+
+// Only the first local file header of the archive is used
+static bool parse_zip_header(bitstream_t *bs)
+{
+  uint8_t hdr[30];
+  if (fread(hdr, 1, sizeof(hdr), bs->f) != sizeof(hdr))
+    return false;
+  uint16_t flags = hdr[6] | (hdr[7] << 8);
+  uint16_t method = hdr[8] | (hdr[9] << 8);
+  uint32_t csize = hdr[18] | (hdr[19] << 8) | (hdr[20] << 16) | ((uint32_t)hdr[21] << 24);
+  uint16_t name_len = hdr[26] | (hdr[27] << 8);
+  uint16_t extra_len = hdr[28] | (hdr[29] << 8);
+  if (!skip_bytes(bs->f, name_len + extra_len))
+    return false;
+  if (method == ZIP_METHOD_DEFLATE)
+  {
+    bs->deflate = true;
+    return true;
+  }
+  // A stored member needs its size up front, which a data descriptor hides
+  if (method == ZIP_METHOD_STORED && !(flags & 0x08))
+  {
+    bs->stored_left = csize;
+    return true;
+  }
+  ESP_LOGE(TAG, "Unsupported zip member (method %u, flags %04x)", method, flags);
+  return false;
+}
+
+bitstream_t *bitstream_open(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+  bitstream_t *bs = calloc(1, sizeof(bitstream_t));
+  if (bs == NULL)
+  {
+    fclose(f);
+    return NULL;
+  }
+  bs->f = f;
+  bs->format = BITSTREAM_RAW;
+  uint8_t magic[4] = {0, 0, 0, 0};
+  size_t n = fread(magic, 1, sizeof(magic), f);
+  fseek(f, 0, SEEK_SET);
+  bool ok = true;
+  if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+  {
+    bs->format = BITSTREAM_GZIP;
+    ok = parse_gzip_header(bs);
+  }
+  else if (n == 4 && magic[0] == 'P' && magic[1] == 'K' && magic[2] == 3 && magic[3] == 4)
+  {
+    bs->format = BITSTREAM_ZIP;
+    ok = parse_zip_header(bs);
+  }
+  if (ok && bs->deflate)
+  {
+    bs->dict = malloc(TINFL_LZ_DICT_SIZE);
+    ok = (bs->dict != NULL);
+    tinfl_init(&bs->inflator);
+    bs->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  }
+  if (!ok)
+  {
+    ESP_LOGE(TAG, "Cannot open %s as a bitstream", filename);
+    bitstream_close(bs);
+    return NULL;
+  }
+  return bs;
+}
+
+static uint32_t bitstream_inflate(bitstream_t *bs, uint8_t *buf, uint32_t len)
+{
+  uint32_t n = 0;
+  while (n < len)
+  {
+    if (bs->out_pending)
+    {
+      uint32_t chunk = (bs->out_pending < len - n) ? bs->out_pending : len - n;
+      memcpy(buf + n, bs->dict + bs->out_ofs, chunk);
+      bs->out_ofs += chunk;
+      bs->out_pending -= chunk;
+      n += chunk;
+      continue;
+    }
+    if (bs->status == TINFL_STATUS_DONE || bs->failed)
+      break;
+    if (bs->in_avail == 0 && !bs->eof)
+    {
+      bs->in_pos = 0;
+      bs->in_avail = fread(bs->in_buf, 1, BITSTREAM_INPUT_SIZE, bs->f);
+      bs->eof = (bs->in_avail < BITSTREAM_INPUT_SIZE);
+    }
+    size_t in_bytes = bs->in_avail;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - bs->dict_ofs;
+    bs->status = tinfl_decompress(&bs->inflator, bs->in_buf + bs->in_pos, &in_bytes, bs->dict, bs->dict + bs->dict_ofs, &out_bytes, \
+                                  bs->eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+    bs->in_pos += in_bytes;
+    bs->in_avail -= in_bytes;
+    bs->out_ofs = bs->dict_ofs;
+    bs->out_pending = out_bytes;
+    bs->dict_ofs = (bs->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+    if (bs->status < TINFL_STATUS_DONE || (bs->status == TINFL_STATUS_NEEDS_MORE_INPUT && bs->eof && bs->in_avail == 0))
+    {
+      ESP_LOGE(TAG, "Inflate failed with status %d", bs->status);
+      bs->failed = true;
+    }
+  }
+  return n;
+}
+
+uint32_t bitstream_read(bitstream_t *bs, uint8_t *buf, uint32_t len)
+{
+  if (bs->deflate)
+    return bitstream_inflate(bs, buf, len);
+  if (bs->format == BITSTREAM_ZIP && len > bs->stored_left)
+    len = bs->stored_left;
+  uint32_t n = fread(buf, 1, len, bs->f);
+  if (bs->format == BITSTREAM_ZIP)
+    bs->stored_left -= n;
+  if (n < len)
+    bs->eof = true;
+  return n;
+}
+
+bool bitstream_complete(bitstream_t *bs)
+{
+  if (bs->deflate)
+    return (bs->status == TINFL_STATUS_DONE) && !bs->failed && (bs->out_pending == 0);
+  if (bs->format == BITSTREAM_ZIP)
+    return bs->stored_left == 0;
+  return bs->eof && !ferror(bs->f);
+}
+
+bitstream_format_t bitstream_format(bitstream_t *bs)
+{
+  return bs->format;
+}
+
+void bitstream_close(bitstream_t *bs)
+{
+  if (bs == NULL)
+    return;
+  if (bs->f)
+    fclose(bs->f);
+  free(bs->dict);
+  free(bs);
+}
+
+bool bitstream_sha256(const char *filename, uint8_t *sha256)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return false;
+  uint8_t *buf = malloc(BITSTREAM_INPUT_SIZE);
+  if (buf == NULL)
+  {
+    fclose(f);
+    return false;
+  }
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  size_t n;
+  while ((n = fread(buf, 1, BITSTREAM_INPUT_SIZE, f)) > 0)
+    mbedtls_sha256_update(&ctx, buf, n);
+  bool ok = !ferror(f);
+  mbedtls_sha256_finish(&ctx, sha256);
+  mbedtls_sha256_free(&ctx);
+  free(buf);
+  fclose(f);
+  return ok;
+}
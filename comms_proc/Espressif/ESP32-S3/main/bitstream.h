@@ -0,0 +1,38 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BITSTREAM_INPUT_SIZE 4096
+#define BITSTREAM_SHA256_SIZE 32
+
+typedef enum bitstream_format {
+	BITSTREAM_RAW,
+	BITSTREAM_GZIP,
+	BITSTREAM_ZIP,
+} bitstream_format_t;
+
+typedef struct bitstream bitstream_t;
+
+// Opens a configuration file for sequential reading. Raw .bin files, gzip
+// files and the first member of a zip package (stored or deflated) are
+// recognised from their magic bytes; compressed data is inflated on the fly
+// through a 32 KB window, so nothing uncompressed is ever written back.
+bitstream_t *bitstream_open(const char *filename);
+// Returns the number of bytes placed in buf; 0 at the end of the stream or
+// on error, which bitstream_complete() tells apart.
+uint32_t bitstream_read(bitstream_t *bs, uint8_t *buf, uint32_t len);
+bool bitstream_complete(bitstream_t *bs);
+bitstream_format_t bitstream_format(bitstream_t *bs);
+void bitstream_close(bitstream_t *bs);
+// Hashes the file as stored, so a package is identified without inflating it
+bool bitstream_sha256(const char *filename, uint8_t *sha256);
+
+#ifdef __cplusplus
+}
+#endif
@@ -30,6 +30,7 @@
 #include "appusbhost.h"
 #include "appuart.h"
 #include "ftdi.h"
+#include "appxvc.h"
 
 extern const uint8_t server_cert_pem_start[] asm("_binary_caroot_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_caroot_pem_end");
@@ -77,6 +78,9 @@ void app_main(void)
   establish_ssid_and_pw();
 
   start_webserver(false);
+#if CONFIG_XVC_ENABLE
+  init_xvc();
+#endif
 
   init_time();
 
@@ -1,20 +1,22 @@
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "arty_driver.h"
 #include "ftdi.h"
 
 
-static struct mpsse_ctx ctx;
-static tap_state_t current_state;
-static tap_state_t target_state;
+static const char *TAG = "ftdi";
 static uint8_t ftdi_jtag_mode;
 static uint8_t mpsse_ep_wr;
 static uint8_t mpsse_ep_rd;
 static uint8_t uart_ep_wr;
 static uint8_t uart_ep_rd;
 static uint32_t uart_ep_rd_wMaxPacketSize;
-static uint32_t FTDI_BASECLOCK;
+static struct ftdi_device ftdi_devices[ARTY_MAX_DEVICES];
     
 const uint8_t POS_EDGE_OUT = 0x00;
 const uint8_t NEG_EDGE_OUT = 0x01;
@@ -78,23 +80,75 @@ const uint8_t tms_seqs_bit_count[6][6] = {
 
 
 
+// The board the calling task has selected, see arty_select_device()
+static struct ftdi_device *ftdi_dev(void)
+{
+        return &ftdi_devices[arty_current_device()];
+}
+
+// The FT2232H clocks TCK at base / ((1 + divisor) * 2) where base is 60 MHz,
+// or 12 MHz with the divide-by-5 prescaler for rates below ~458 Hz. Sets the
+// highest frequency not above the one requested.
+static void ftdi_tck_divisor(struct ftdi_device *dev, uint32_t frequency)
+{
+        uint32_t base = FTDI_MPSSE_BASE_CLOCK;
+        if (frequency == 0)
+            frequency = FTDI_TCK_DEFAULT_FREQUENCY;
+        dev->tck_div5 = frequency < FTDI_MPSSE_BASE_CLOCK / 2 / 65536;
+        if (dev->tck_div5)
+            base = FTDI_MPSSE_DIV5_BASE_CLOCK;
+        uint32_t divisor = DIV_ROUND_UP(base / 2, frequency) - 1;
+        if (divisor > 0xFFFF)
+            divisor = 0xFFFF;
+        dev->tck_divisor = divisor;
+        dev->tck_frequency = base / 2 / (divisor + 1);
+}
+
 void ftdi_init(void)
 {
-        current_state = TAP_RESET;
-        target_state = TAP_RESET;
+        for (int i = 0; i < ARTY_MAX_DEVICES; i++)
+        {
+            struct ftdi_device *dev = &ftdi_devices[i];
+            dev->current_state = TAP_RESET;
+            dev->target_state = TAP_RESET;
+            dev->ctx.type = TYPE_FT2232H;
+            dev->ctx.write_transfer = NULL;
+            dev->ctx.write_count = 0;
+            dev->ctx.read_count = 0;
+            dev->ctx.read_queue_count = 0;
+            dev->ctx.transferred = 0; 
+            ftdi_tck_divisor(dev, FTDI_TCK_DEFAULT_FREQUENCY);
+            dev->latency_mode[0] = FTDI_LATENCY_INTERACTIVE;
+            // The IN ring is always armed, so an interactive channel B would
+            // return a status packet every millisecond; readers that want
+            // short replies ask for it
+            dev->latency_mode[1] = FTDI_LATENCY_BULK;
+        }
         ftdi_jtag_mode = (LSB_FIRST | POS_EDGE_IN | NEG_EDGE_OUT);
-        ctx.type = TYPE_FT2232H;
-        ctx.write_count = 0;
-        ctx.write_count_bits = 0;
-        ctx.read_count = 0;
-        ctx.read_count_bits = 0;
-        ctx.transferred = 0; 
         mpsse_ep_wr = FT2232H_MPSSE_WRITE_EP;
         mpsse_ep_rd = FT2232H_MPSSE_READ_EP;
         uart_ep_wr = FT2232H_UART_WRITE_EP;
         uart_ep_rd = FT2232H_UART_READ_EP;
 }
 
+// Called from the USB driver task when a board goes away
+void ftdi_state_invalidate(int device)
+{
+        memset(&ftdi_devices[device].config_state, 0, sizeof(struct ftdi_config_state));
+}
+
+// Starts over if the cached state belongs to another device handle
+static void ftdi_state_check(void)
+{
+        struct ftdi_config_state *state = &ftdi_dev()->config_state;
+        usb_device_handle_t dev = arty_get_device();
+        if (state->dev != dev)
+        {
+            memset(state, 0, sizeof(*state));
+            state->dev = dev;
+        }
+}
+
 uint8_t tap_move_ndx(tap_state_t astate)
 {
 	uint8_t ndx;
@@ -237,54 +291,84 @@ uint8_t tap_get_tms_path_len(tap_state_t start, tap_state_t end)
 
 tap_state_t ftdi_tap_get_state()
 {
-    return current_state;
+    struct ftdi_device *dev = ftdi_dev();
+    return dev->current_state;
 }
 
 void ftdi_tap_set_state(tap_state_t state)
 {
-    current_state = state;
+    struct ftdi_device *dev = ftdi_dev();
+    dev->current_state = state;
     return;
 }
 
 tap_state_t ftdi_tap_get_end_state()
 {
-    return target_state;
+    struct ftdi_device *dev = ftdi_dev();
+    return dev->target_state;
 }
    
-void bit_copy(uint8_t* dst, uint16_t dst_start, uint8_t* src, uint16_t src_start, uint16_t bit_count)
-{
-        uint16_t db = dst_start / 8;
-        uint16_t sb = src_start / 8;
-        uint8_t dq = dst_start % 8;
-        uint8_t sq = src_start % 8;
-        uint16_t lb = bit_count / 8;
-        uint8_t lq = bit_count % 8;
-        if ((sq == 0) && (lq == 0) && (dq == 0))
-	{
-            for (int i = 0; i < lb; i++)
-                dst[db + i] = src[sb + i];
-            return;
+// Returns n (<= 32) bits of src starting at bit pos, LSB first. Only the
+// bytes that actually hold those bits are touched.
+static inline uint32_t bit_load(const uint8_t* src, uint32_t pos, uint32_t n)
+{
+        const uint8_t* p = src + pos / 8;
+        uint32_t shift = pos % 8;
+        uint32_t bytes = DIV_ROUND_UP(shift + n, 8);
+        uint64_t v = 0;
+        for (uint32_t i = 0; i < bytes; i++)
+            v |= (uint64_t)p[i] << (8 * i);
+        v >>= shift;
+        return (n == 32) ? (uint32_t)v : (uint32_t)v & ((1u << n) - 1);
+}
+
+// Copies bit_count bits LSB first between arbitrary bit offsets. The
+// destination is brought to a byte boundary, then the bulk moves a 32-bit
+// word per iteration (plain memcpy when the source is aligned as well) and
+// only the partial bytes at either end are read-modify-written.
+void bit_copy(uint8_t* dst, uint32_t dst_start, uint8_t* src, uint32_t src_start, uint32_t bit_count)
+{
+        uint8_t* d = dst + dst_start / 8;
+        uint32_t dq = dst_start % 8;
+        if (dq && bit_count)
+        {
+            uint32_t n = 8 - dq;
+            if (n > bit_count)
+                n = bit_count;
+            uint8_t mask = ((1u << n) - 1) << dq;
+            *d = (*d & ~mask) | ((bit_load(src, src_start, n) << dq) & mask);
+            d++;
+            src_start += n;
+            bit_count -= n;
         }
-        uint16_t idx = sb;
-        uint16_t odx = db;
-        for (int i = 0; i < bit_count; i++)
-	{
-            if (((src[idx] >> (sq&7)) & 1) == 1)
-                dst[odx] |= 1 << (dq&7);
-            else
-                dst[odx] &= ~(1 << (dq&7));
-            sq += 1;
-            if (sq == 7)
-	    {
-                sq = 0;
-                idx += 1;
-            }
-            dq += 1;
-            if (dq == 7)
-	    {
-                dq = 0;
-                odx += 1;
-            }
+        if ((src_start % 8) == 0)
+        {
+            memcpy(d, src + src_start / 8, bit_count / 8);
+            d += bit_count / 8;
+            src_start += bit_count & ~7u;
+            bit_count %= 8;
+        }
+        while (bit_count >= 32)
+        {
+            uint32_t v = bit_load(src, src_start, 32);
+            d[0] = v;
+            d[1] = v >> 8;
+            d[2] = v >> 16;
+            d[3] = v >> 24;
+            d += 4;
+            src_start += 32;
+            bit_count -= 32;
+        }
+        while (bit_count >= 8)
+        {
+            *d++ = bit_load(src, src_start, 8);
+            src_start += 8;
+            bit_count -= 8;
+        }
+        if (bit_count)
+        {
+            uint8_t mask = (1u << bit_count) - 1;
+            *d = (*d & ~mask) | (bit_load(src, src_start, bit_count) & mask);
         }
         return;
 }
@@ -292,7 +376,8 @@ void bit_copy(uint8_t* dst, uint16_t dst_start, uint8_t* src, uint16_t src_start
 
 void ftdi_tap_set_end_state(tap_state_t state)
 {
-    target_state = state;
+    struct ftdi_device *dev = ftdi_dev();
+    dev->target_state = state;
     return;
 }
 
@@ -333,205 +418,436 @@ void ftdi_execute_scan(struct jtag_command cmd)
             ftdi_move_to_state(TAP_DRSHIFT);
     }
     ftdi_end_state(cmd.end_state);
-    uint16_t scan_size = cmd.num_bits;
-    while (scan_size > 0)
+    uint32_t scan_size = cmd.num_bits;
+    // ftdi_mpsse_clock_data() splits long scans into MPSSE opcodes itself,
+    // so only the last bit needs special handling when the scan exits SHIFT
+    if (ftdi_tap_get_state() != ftdi_tap_get_end_state())
     {
-        if ((scan_size < (PACKET_SIZE << 3)) || ((scan_size == (PACKET_SIZE << 3))  && (ftdi_tap_get_state() != ftdi_tap_get_end_state())))
-	{
-            ftdi_mpsse_clock_data(cmd.out_buffer, 0, cmd.in_buffer, 0, scan_size-1, ftdi_jtag_mode);
-            uint8_t last_bit = 0;
+        ftdi_mpsse_clock_data(cmd.out_buffer, 0, cmd.in_buffer, 0, scan_size-1, ftdi_jtag_mode);
+        uint8_t last_bit = 0;
+        if (cmd.out_buffer)
             bit_copy(&last_bit, 0, cmd.out_buffer, scan_size-1, 1);
-            uint8_t tms_bits = 0x03;
-            ftdi_mpsse_clock_tms_cs(&tms_bits, 0, cmd.in_buffer, scan_size - 1, 1, last_bit, ftdi_jtag_mode);
+        uint8_t tms_bits = 0x03;
+        ftdi_mpsse_clock_tms_cs(&tms_bits, 0, cmd.in_buffer, scan_size - 1, 1, last_bit, ftdi_jtag_mode);
+        ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 1));
+        if (ftdi_tap_get_end_state() == TAP_IDLE)
+        {
+            ftdi_mpsse_clock_tms_cs_out(&tms_bits, 1, 2, last_bit, ftdi_jtag_mode);
             ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 1));
-            if (ftdi_tap_get_end_state() == TAP_IDLE)
-	    {
-                ftdi_mpsse_clock_tms_cs_out(&tms_bits, 1, 2, last_bit, ftdi_jtag_mode);
-                ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 1));
-                ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 0));
-            }
-	    else
-	    {
-                ftdi_mpsse_clock_tms_cs_out(&tms_bits, 2, 1, last_bit, ftdi_jtag_mode);
-                ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 0));
-            }
-            scan_size = 0;
+            ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 0));
         }
         else
-	{
-            ftdi_mpsse_clock_data(cmd.out_buffer, 0, cmd.in_buffer, 0, PACKET_SIZE << 3, ftdi_jtag_mode);
-            scan_size -= PACKET_SIZE << 3;
+        {
+            ftdi_mpsse_clock_tms_cs_out(&tms_bits, 2, 1, last_bit, ftdi_jtag_mode);
+            ftdi_tap_set_state(tap_state_transition(ftdi_tap_get_state(), 0));
         }
     }
+    else
+    {
+        ftdi_mpsse_clock_data(cmd.out_buffer, 0, cmd.in_buffer, 0, scan_size, ftdi_jtag_mode);
+    }
     if (ftdi_tap_get_state() != ftdi_tap_get_end_state())
         ftdi_move_to_state(ftdi_tap_get_end_state());
 }
 
+void ftdi_execute_runtest(struct jtag_command cmd)
+{
+    if (ftdi_tap_get_state() != TAP_IDLE)
+        ftdi_move_to_state(TAP_IDLE);
+    // TMS stays low while data is clocked, so this idles for num_bits cycles
+    if (cmd.num_bits)
+        ftdi_mpsse_clock_data_out(NULL, 0, cmd.num_bits, ftdi_jtag_mode);
+    ftdi_end_state(cmd.end_state);
+    if (ftdi_tap_get_state() != ftdi_tap_get_end_state())
+        ftdi_move_to_state(ftdi_tap_get_end_state());
+}
+
+static inline uint8_t bit_get(const uint8_t* v, uint32_t pos)
+{
+        return (v[pos / 8] >> (pos % 8)) & 1;
+}
+
+// Length of the run of TMS-low bits starting at pos, counted up to limit
+static uint32_t tms_low_run(const uint8_t* tms, uint32_t pos, uint32_t end, uint32_t limit)
+{
+        uint32_t n = 0;
+        while ((pos + n < end) && (n < limit) && !bit_get(tms, pos + n))
+            n++;
+        return n;
+}
+
+// Clocks num_bits arbitrary TMS/TDI bit pairs, LSB first, and captures TDO
+// for each into tdo. Runs of at least FTDI_SHIFT_MIN_DATA_BITS bits with TMS
+// low go out as data shifts, everything else as TMS commands split where TDI
+// changes. The whole vector is read back with a single flush unless it
+// overflows the MPSSE read buffer. The TAP state is followed bit by bit.
+void ftdi_shift_vectors(uint32_t num_bits, uint8_t* tms, uint8_t* tdi, uint8_t* tdo)
+{
+        tap_state_t state = ftdi_tap_get_state();
+        // Data shifts leave TMS where the last TMS command put it
+        bool tms_high = true;
+        uint32_t pos = 0;
+        while (pos < num_bits)
+        {
+            uint32_t run = tms_low_run(tms, pos, num_bits, num_bits);
+            if (run >= FTDI_SHIFT_MIN_DATA_BITS)
+            {
+                if (tms_high)
+                {
+                    ftdi_mpsse_clock_tms_cs(tms, pos, tdo, pos, 1, bit_get(tdi, pos), ftdi_jtag_mode);
+                    pos++;
+                    run--;
+                    tms_high = false;
+                }
+                ftdi_mpsse_clock_data(tdi, pos, tdo, pos, run, ftdi_jtag_mode);
+                pos += run;
+                continue;
+            }
+            uint8_t tdi_bit = bit_get(tdi, pos);
+            uint32_t n = 1;
+            while ((pos + n < num_bits) && (bit_get(tdi, pos + n) == tdi_bit) && \
+                   (tms_low_run(tms, pos + n, num_bits, FTDI_SHIFT_MIN_DATA_BITS) < FTDI_SHIFT_MIN_DATA_BITS))
+                n++;
+            ftdi_mpsse_clock_tms_cs(tms, pos, tdo, pos, n, tdi_bit, ftdi_jtag_mode);
+            pos += n;
+            tms_high = bit_get(tms, pos - 1);
+        }
+        ftdi_mpsse_flush();
+        for (uint32_t i = 0; i < num_bits; i++)
+            state = tap_state_transition(state, bit_get(tms, i));
+        ftdi_tap_set_state(state);
+        ftdi_tap_set_end_state(state);
+}
+
+// Commands are only queued in the MPSSE buffer. Read-back data is valid once
+// ftdi_mpsse_flush() returns; jtag_execute_queue() takes care of that.
 void ftdi_execute_command(struct jtag_command cmd)
 {
     if (cmd.type == JTAG_STATEMOVE)
         ftdi_execute_statemove(cmd);
     else if (cmd.type == JTAG_SCAN)
         ftdi_execute_scan(cmd);
-    ftdi_mpsse_flush();
-    if (cmd.in_buffer)
-    {
-      bit_copy(cmd.in_buffer, 0, ctx.read_buffer, 0, cmd.num_bits);
-    }
+    else if (cmd.type == JTAG_RUNTEST)
+        ftdi_execute_runtest(cmd);
     return;
 }
 
+// Sends the latency timer unless the device has it already
+static void ftdi_latency_timer(uint8_t channel, uint8_t timer)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        if (dev->config_state.latency_timer[channel - 1] == timer)
+            return;
+        ftdi_control(FTDI_SIO_SET_LATENCY_TIMER_REQUEST_TYPE, SIO_SET_LATENCY_TIMER_REQUEST, timer, channel, 0);
+        dev->config_state.latency_timer[channel - 1] = timer;
+}
+
+static uint8_t ftdi_latency_mode_timer(ftdi_latency_mode_t mode)
+{
+        return (mode == FTDI_LATENCY_BULK) ? FTDI_LATENCY_BULK_MS : FTDI_LATENCY_INTERACTIVE_MS;
+}
+
+// Channel B runs on its mode's timer. Channel A needs a short timer only
+// while an MPSSE reply is awaited, so it idles on the bulk timer and
+// ftdi_mpsse_flush() switches it to its mode's timer for reads.
+static void ftdi_latency_apply(uint8_t channel)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        if (channel == FTDI_CHANNEL_A)
+            ftdi_latency_timer(channel, FTDI_LATENCY_BULK_MS);
+        else
+            ftdi_latency_timer(channel, ftdi_latency_mode_timer(dev->latency_mode[channel - 1]));
+}
+
+// The mode sticks to the channel across reconnects. Channel B gets it right
+// away if configured, otherwise when it is; channel A on its next read.
+void ftdi_set_latency_mode(uint8_t channel, ftdi_latency_mode_t mode)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        dev->latency_mode[channel - 1] = mode;
+        ftdi_state_check();
+        if ((channel == FTDI_CHANNEL_B) && dev->config_state.uart_valid)
+            ftdi_latency_apply(channel);
+}
+
+// Puts channel A back on the bulk timer, for when the board is left idle
+void ftdi_latency_idle(void)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        ftdi_state_check();
+        if (dev->config_state.mpsse_mode && (dev->ctx.read_count == 0))
+            ftdi_latency_apply(CHANNEL_A);
+}
+
+ftdi_latency_mode_t ftdi_get_latency_mode(uint8_t channel)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        return dev->latency_mode[channel - 1];
+}
+
+void ftdi_get_latency_stats(ftdi_latency_mode_t mode, struct ftdi_latency_stats *stats)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        *stats = dev->latency_stats[mode];
+}
+
+void ftdi_reset_latency_stats(void)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        memset(dev->latency_stats, 0, sizeof(dev->latency_stats));
+}
+
+static void ftdi_latency_record(uint32_t bytes)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        struct ftdi_latency_stats *stats = &dev->latency_stats[dev->latency_mode[CHANNEL_A - 1]];
+        uint32_t us = esp_timer_get_time() - dev->read_submit_time;
+        if ((stats->reads == 0) || (us < stats->min_us))
+            stats->min_us = us;
+        if (us > stats->max_us)
+            stats->max_us = us;
+        stats->total_us += us;
+        stats->bytes += bytes;
+        stats->reads++;
+}
+
+// Puts channel A in MPSSE mode (reset, latency timer, bitmode and purges).
+// Once done for the current device only a purge after a failed read is repeated.
+void ftdi_mpsse_mode()
+{
+        struct ftdi_device *dev = ftdi_dev();
+        ftdi_state_check();
+        if (!dev->config_state.mpsse_mode)
+        {
+            ftdi_control(0x40, 0, 0, 1, 0);
+            dev->config_state.latency_timer[CHANNEL_A - 1] = 0;
+            ftdi_latency_apply(CHANNEL_A);
+            ftdi_control(0x40, 11, 0x020b, 1, 0);
+            ftdi_mpsse_purge();
+            dev->config_state.mpsse_mode = true;
+            dev->config_state.mpsse_setup = false;
+        }
+        else if (dev->config_state.mpsse_purge_needed)
+            ftdi_mpsse_purge();
+}
+
+// For raw MPSSE streams that set up the pins and clock themselves
+void ftdi_mpsse_setup_lost()
+{
+        struct ftdi_device *dev = ftdi_dev();
+        dev->config_state.mpsse_setup = false;
+}
+
+static void ftdi_tck_write(struct ftdi_device *dev)
+{
+        ftdi_buffer_write_byte(dev->tck_div5 ? 0x8B : 0x8A);
+        ftdi_buffer_write_byte(0x86);
+        ftdi_buffer_write_byte(dev->tck_divisor & 0xff);
+        ftdi_buffer_write_byte(dev->tck_divisor >> 8);
+}
+
 void ftdi_mpsse_open()
 {
-        ftdi_control(0x40, 0, 0, 1, 0);
-        ftdi_control(0x40, 9, 255, 1, 0);
-        ftdi_control(0x40, 11, 0x020b, 1, 0);
-        ftdi_control(0x40, 0, 1, 1, 0);
-        ftdi_control(0x40, 0, 2, 1, 0);
-        uint8_t buf_1[12] = {0x80, 0x88, 0x8b, 0x82, 0x00, 0x00, 0x85, 0x97, 0x8A, 0x86, 0x02, 0x00};
-        uint8_t buf_2[5] = {0x97, 0x8A, 0x86, 0x02, 0x00};
-        uint8_t buf_3[3] = {0x4B, 0x06, 0x7F};
-        ftdi_mpsse_write(buf_1, 12);
-        ftdi_mpsse_write(buf_2,5);  
-        ftdi_mpsse_write(buf_3,3); 
-        uint8_t tms_count = tms_seqs_bit_count[tap_move_ndx(current_state)][tap_move_ndx(target_state)];
-        uint8_t tms_bits = tms_seqs_bits[tap_move_ndx(current_state)][tap_move_ndx(target_state)];
+        struct ftdi_device *dev = ftdi_dev();
+        ftdi_mpsse_mode();
+        if (!dev->config_state.mpsse_setup)
+        {
+            uint8_t buf_1[8] = {0x80, 0x88, 0x8b, 0x82, 0x00, 0x00, 0x85, 0x97};
+            uint8_t buf_3[3] = {0x4B, 0x06, 0x7F};
+            ftdi_mpsse_write(buf_1, 8);
+            ftdi_tck_write(dev);
+            ftdi_mpsse_write(buf_3,3);
+            dev->config_state.mpsse_setup = true;
+        }
+        uint8_t tms_count = tms_seqs_bit_count[tap_move_ndx(dev->current_state)][tap_move_ndx(dev->target_state)];
+        uint8_t tms_bits = tms_seqs_bits[tap_move_ndx(dev->current_state)][tap_move_ndx(dev->target_state)];
         ftdi_mpsse_clock_tms_cs_out(&tms_bits, 0, tms_count, 0, ftdi_jtag_mode);  
         return;
 }
 
+// Returns the frequency actually set. Before ftdi_mpsse_open() has set up
+// the device only the rate is kept and the open sends it; afterwards it is
+// sent at once, so no transfer is left held for a control request to wait on.
+uint32_t ftdi_mpsse_set_frequency(uint32_t frequency)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        ftdi_state_check();
+        ftdi_tck_divisor(dev, frequency);
+        if (dev->config_state.mpsse_setup)
+        {
+            ftdi_tck_write(dev);
+            ftdi_write_transfer();
+        }
+        ESP_LOGI(TAG, "TCK set to %" PRIu32 " Hz", dev->tck_frequency);
+        return dev->tck_frequency;
+}
+
+uint32_t ftdi_mpsse_get_frequency()
+{
+        struct ftdi_device *dev = ftdi_dev();
+        return dev->tck_frequency;
+}
+
 void ftdi_mpsse_purge()
 {
+        struct ftdi_device *dev = ftdi_dev();
         ftdi_control(0x40, 0, 1, 1, 0);
         ftdi_control(0x40, 0, 2, 1, 0);
+        arty_receive_flush(mpsse_ep_rd);
+        dev->config_state.mpsse_purge_needed = false;
 }
         
-uint16_t ftdi_buffer_write_space()
+uint32_t ftdi_buffer_read_space()
 {
-        return (MAX_PACKET_SIZE - ctx.write_count - 1);
+        struct ftdi_device *dev = ftdi_dev();
+        if (dev->ctx.read_queue_count == MPSSE_READ_QUEUE_SIZE)
+            return 0;
+        return (MPSSE_READ_BUFFER_SIZE - dev->ctx.read_count);
 }
-        
-uint16_t ftdi_buffer_read_space()
+
+// Takes a transfer from the pool on first use; a full transfer is submitted
+// straight away so commands may span transfer boundaries
+static uint8_t* ftdi_buffer_reserve()
 {
-        return (MAX_PACKET_SIZE - ctx.read_count);
+        struct ftdi_device *dev = ftdi_dev();
+        if (dev->ctx.write_transfer && dev->ctx.write_count == ARTY_TRANSFER_SIZE)
+            ftdi_write_transfer();
+        if (dev->ctx.write_transfer == NULL)
+        {
+            dev->ctx.write_transfer = arty_transfer_get();
+            dev->ctx.write_count = 0;
+        }
+        return dev->ctx.write_transfer->data_buffer + dev->ctx.write_count;
 }
 
 void ftdi_buffer_write_byte(uint8_t data)
 {
-        ctx.write_buffer[ctx.write_count] = data;
-        ctx.write_count_bits += 8;
-        ctx.write_count = DIV_ROUND_UP(ctx.write_count_bits, 8);
+        struct ftdi_device *dev = ftdi_dev();
+        *ftdi_buffer_reserve() = data;
+        dev->ctx.write_count++;
 }
 
         
-uint16_t ftdi_buffer_write(uint8_t* out, uint16_t out_offset, uint16_t bit_count)
-{
-        bit_copy(ctx.write_buffer, ctx.write_count_bits, out, out_offset, bit_count);
-        ctx.write_count_bits += bit_count;
-        ctx.write_count = DIV_ROUND_UP(ctx.write_count_bits, 8);
+uint32_t ftdi_buffer_write(uint8_t* out, uint32_t out_offset, uint32_t bit_count)
+{
+        struct ftdi_device *dev = ftdi_dev();
+        uint32_t remaining = bit_count;
+        while (remaining > 0)
+        {
+            uint8_t *dst = ftdi_buffer_reserve();
+            uint32_t chunk = (ARTY_TRANSFER_SIZE - dev->ctx.write_count) * 8;
+            if (chunk > remaining)
+                chunk = remaining;
+            bit_copy(dst, 0, out, out_offset, chunk);
+            dev->ctx.write_count += DIV_ROUND_UP(chunk, 8);
+            out_offset += chunk;
+            remaining -= chunk;
+        }
         return bit_count;
 }
 
-uint16_t ftdi_buffer_add_read(uint16_t bit_count)
+// offset is the bit position the data lands at in the returned byte: bit
+// mode commands shift in from the MSB end, so those use 8 - bit_count
+uint32_t ftdi_buffer_add_read(uint8_t* in_, uint32_t in_offset, uint32_t bit_count, uint32_t offset)
 {
-        ctx.read_count_bits += bit_count;
-        ctx.read_count =  DIV_ROUND_UP(ctx.read_count_bits,8);
+        struct ftdi_device *dev = ftdi_dev();
+        struct mpsse_read_op *op = &dev->ctx.read_queue[dev->ctx.read_queue_count++];
+        op->in = in_;
+        op->in_offset = in_offset;
+        op->read_offset = dev->ctx.read_count * 8 + offset;
+        op->bit_count = bit_count;
+        dev->ctx.read_count += DIV_ROUND_UP(offset + bit_count, 8);
         return bit_count;
 }
     
+// Hands the current transfer to the USB host without waiting for it to
+// complete; ordering is kept because the OUT endpoint queue is FIFO
 void ftdi_write_transfer()
 {
-        uint8_t* chunk;
-        uint16_t remaining_bytes = ctx.write_count;
-        ctx.transferred = 0;
-        while (remaining_bytes > 0)
-	{
-            if (remaining_bytes < PACKET_SIZE)
-            {
-                chunk = ctx.write_buffer + ctx.transferred;
-                ftdi_mpsse_write(chunk,remaining_bytes);
-                remaining_bytes = 0;
-            }
-            else
-            {
-                chunk = ctx.write_buffer + ctx.transferred;
-                ftdi_mpsse_write(chunk,PACKET_SIZE);
-                remaining_bytes -= PACKET_SIZE;
-                ctx.transferred += PACKET_SIZE;
-            }
-        }
-        ctx.write_count = 0;
-        ctx.write_count_bits = 0;
-        ctx.transferred = 0;
+        struct ftdi_device *dev = ftdi_dev();
+        if (dev->ctx.write_transfer == NULL)
+            return;
+        arty_transfer_submit(dev->ctx.write_transfer, dev->ctx.write_count, mpsse_ep_wr);
+        dev->ctx.write_transfer = NULL;
+        dev->ctx.write_count = 0;
         return;
 }
 
 void ftdi_read_transfer()
 {
-        uint16_t remaining_bytes = ctx.read_count;
-        ctx.transferred = 0;
+        struct ftdi_device *dev = ftdi_dev();
+        uint32_t remaining_bytes = dev->ctx.read_count;
+        dev->ctx.transferred = 0;
+        // The IN ring strips the FTDI status bytes and blocks until data arrives
         while (remaining_bytes > 0)
 	{
-            uint16_t size;
-            uint8_t chunk[MAX_PACKET_SIZE]={0};
-            size = ftdi_mpsse_read(chunk);
-            for (int i = 2; i < size; i++)
-                ctx.read_buffer[ctx.transferred + i - 2] = chunk[i];
-            
-            if (remaining_bytes < (size-2))
-              remaining_bytes = 0;
-            else
-              remaining_bytes = remaining_bytes - size + 2;
-            ctx.transferred = ctx.transferred - size + 2;
-            vTaskDelay(1000/ portTICK_PERIOD_MS); 
+            uint16_t size = arty_receive_data(dev->ctx.read_buffer + dev->ctx.transferred, remaining_bytes, mpsse_ep_rd);
+            if (size == 0)
+            {
+                ESP_LOGE(TAG, "MPSSE read timed out with %" PRIu32 " bytes outstanding", remaining_bytes);
+                // The rest may still turn up and would be taken for the next reply
+                dev->config_state.mpsse_purge_needed = true;
+                break;
+            }
+            remaining_bytes -= size;
+            dev->ctx.transferred += size;
         }
-        ctx.read_count_bits = 0;
-        ctx.read_count = 0;
-        ctx.transferred = 0;
+        if (remaining_bytes == 0)
+            ftdi_latency_record(dev->ctx.transferred);
+        for (int i = 0; i < dev->ctx.read_queue_count; i++)
+        {
+            struct mpsse_read_op *op = &dev->ctx.read_queue[i];
+            bit_copy(op->in, op->in_offset, dev->ctx.read_buffer, op->read_offset, op->bit_count);
+        }
+        dev->ctx.read_queue_count = 0;
+        dev->ctx.read_count = 0;
+        dev->ctx.transferred = 0;
         return;
 }       
 
 void ftdi_mpsse_flush()
 {
-      if (ctx.write_count == 0)
+      struct ftdi_device *dev = ftdi_dev();
+      if (dev->ctx.write_transfer == NULL && dev->ctx.read_count == 0)
           return;
-      if (ctx.read_count)
+      if (dev->ctx.read_count)
+      {
+          ftdi_latency_timer(CHANNEL_A, ftdi_latency_mode_timer(dev->latency_mode[CHANNEL_A - 1]));
+          // Send Immediate, so the reply does not wait for the latency timer
           ftdi_buffer_write_byte(0x87);
+      }
+      dev->read_submit_time = esp_timer_get_time();
       ftdi_write_transfer();
-      if (ctx.read_count)
+      if (dev->ctx.read_count)
           ftdi_read_transfer();
       return;
 }  
   
-void ftdi_mpsse_clock_data_out(uint8_t* out, uint16_t out_offset, uint16_t length, uint8_t mode)
+void ftdi_mpsse_clock_data_out(uint8_t* out, uint32_t out_offset, uint32_t length, uint8_t mode)
 {
         ftdi_mpsse_clock_data(out, out_offset, NULL, 0, length, mode);  
         return;
 }
         
-void ftdi_mpsse_clock_data_in(uint8_t* in_, uint16_t in_offset, uint16_t length, uint8_t mode)
+void ftdi_mpsse_clock_data_in(uint8_t* in_, uint32_t in_offset, uint32_t length, uint8_t mode)
 {
         ftdi_mpsse_clock_data(NULL, 0, in_, in_offset, length, mode); 
         return;
 }
 
-void ftdi_mpsse_clock_data(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint16_t in_offset, uint16_t length, uint8_t mode)
+void ftdi_mpsse_clock_data(uint8_t* out, uint32_t out_offset, uint8_t* in_, uint32_t in_offset, uint32_t length, uint8_t mode)
 {
         uint8_t _mode = mode;
-        uint16_t _length = length;
-        uint16_t _out_offset = out_offset;
-        uint16_t _in_offset = in_offset;
-        uint8_t cond1, cond2, cond3;
-        cond1 = (out || ((out == NULL) && (in_ == NULL))); 
-        cond2 = cond1 ? 4 : 3;
-        if (cond1)
+        uint32_t _length = length;
+        uint32_t _out_offset = out_offset;
+        uint32_t _in_offset = in_offset;
+        if (out || (in_ == NULL))
             _mode |= 0x10;
         if (in_)
             _mode |= 0x20;
         while (_length > 0)
 	{
-            cond3 = (_length < 8) ? 1 : 0;
-            if (((ftdi_buffer_write_space() + cond3) < cond2) || (in_ && (ftdi_buffer_read_space() < 1)))
+            if (in_ && (ftdi_buffer_read_space() < 1))
                 ftdi_mpsse_flush();
             if (_length < 8)
 	    {
@@ -540,18 +856,16 @@ void ftdi_mpsse_clock_data(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint
                 if (out)
                     _out_offset += ftdi_buffer_write(out, _out_offset, _length);
                 if (in_)
-                    _in_offset += ftdi_buffer_add_read(_length);
+                    _in_offset += ftdi_buffer_add_read(in_, _in_offset, _length, 8 - _length);
                 if ((out == 0) && (in_ == 0))
                     ftdi_buffer_write_byte(0x00);
                 _length = 0;
             }
             else
 	    {
-                uint16_t this_bytes = (uint16_t)(_length/8);
-                if (this_bytes > MAX_PACKET_SIZE)
-                    this_bytes = MAX_PACKET_SIZE;
-                if ((cond1) && ((this_bytes + 3) > ftdi_buffer_write_space()))
-                    this_bytes = ftdi_buffer_write_space() - 3;
+                uint32_t this_bytes = _length/8;
+                if (this_bytes > MPSSE_MAX_CLOCK_BYTES)
+                    this_bytes = MPSSE_MAX_CLOCK_BYTES;
                 if (in_ && (this_bytes > ftdi_buffer_read_space()))
                     this_bytes = ftdi_buffer_read_space();
                 if (this_bytes > 0){
@@ -561,7 +875,7 @@ void ftdi_mpsse_clock_data(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint
                     if (out)
                         _out_offset += ftdi_buffer_write(out, _out_offset, this_bytes * 8);
                     if (in_)
-                        _in_offset += ftdi_buffer_add_read(this_bytes * 8);
+                        _in_offset += ftdi_buffer_add_read(in_, _in_offset, this_bytes * 8, 0);
                     if ((out == 0) && (in_ == 0))
 		    {
                         for (int n = 0; n < this_bytes; n++)
@@ -573,26 +887,26 @@ void ftdi_mpsse_clock_data(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint
         }
 }
 
-void ftdi_mpsse_clock_tms_cs_out(uint8_t* out, uint16_t out_offset, uint16_t length, uint8_t tdi, uint8_t mode)
+void ftdi_mpsse_clock_tms_cs_out(uint8_t* out, uint32_t out_offset, uint32_t length, uint8_t tdi, uint8_t mode)
 {
         ftdi_mpsse_clock_tms_cs(out, out_offset, NULL, 0, length, tdi, mode);
         return;
 }
 
-void ftdi_mpsse_clock_tms_cs(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint16_t in_offset, uint16_t length, uint8_t tdi, uint8_t mode)
+void ftdi_mpsse_clock_tms_cs(uint8_t* out, uint32_t out_offset, uint8_t* in_, uint32_t in_offset, uint32_t length, uint8_t tdi, uint8_t mode)
 {
         uint8_t _mode = mode;
-        uint16_t _length = length;
-        uint16_t _out_offset = out_offset;
-        uint16_t _in_offset = in_offset;
+        uint32_t _length = length;
+        uint32_t _out_offset = out_offset;
+        uint32_t _in_offset = in_offset;
         _mode |= 0x42;
         if (in_)
             _mode |= 0x20;
         while (_length > 0)
 	{
-            if ((ftdi_buffer_write_space() < 3) || (in_ && (ftdi_buffer_read_space() < 1)))
+            if (in_ && (ftdi_buffer_read_space() < 1))
                 ftdi_mpsse_flush();
-            uint16_t this_bits = _length;
+            uint32_t this_bits = _length;
             if (this_bits > 7)
                 this_bits = 7;
             if (this_bits > 0)
@@ -604,7 +918,7 @@ void ftdi_mpsse_clock_tms_cs(uint8_t* out, uint16_t out_offset, uint8_t* in_, ui
                 _out_offset += this_bits;
                 ftdi_buffer_write_byte(data | ( tdi ? 0x80 :  0x00));
                 if (in_)
-                    _in_offset += ftdi_buffer_add_read(this_bits);
+                    _in_offset += ftdi_buffer_add_read(in_, _in_offset, this_bits, 8 - this_bits);
                 _length -= this_bits ;
            }
         }
@@ -619,9 +933,10 @@ void ftdi_control(uint8_t bmRequestType, uint8_t bmRequest, uint16_t wValue, uin
 
 void ftdi_uart_configure(uint8_t data_size, uint32_t baud_rate, flow_control_t flowcontrol, uint32_t ftdi_clock_freq)
 {
-      FTDI_BASECLOCK = ftdi_clock_freq;
+      struct ftdi_device *dev = ftdi_dev();
+      dev->uart_base_clock = ftdi_clock_freq;
       uint8_t divfrac[8] = {0, 3, 2, 4, 1, 5, 6, 7 };
-      int divisor3 = DIV_ROUND_CLOSEST(8 * FTDI_BASECLOCK, 10 * baud_rate);
+      int divisor3 = DIV_ROUND_CLOSEST(8 * dev->uart_base_clock, 10 * baud_rate);
       uint32_t divisor = divisor3 >> 3;
       divisor |= divfrac[divisor3 & 0x7] << 14;
       if (divisor == 1)
@@ -629,10 +944,20 @@ void ftdi_uart_configure(uint8_t data_size, uint32_t baud_rate, flow_control_t f
       else if (divisor == 0x4001)
           divisor = 1;
       uint32_t FTDI_BAUD_DIVISOR = divisor;
+      ftdi_state_check();
+      if (dev->config_state.uart_valid && (dev->config_state.uart_data_size == data_size) && (dev->config_state.uart_baud_rate == baud_rate) && \
+          (dev->config_state.uart_flow == flowcontrol) && (dev->config_state.uart_clock == ftdi_clock_freq))
+          return;
       ftdi_control(FTDI_SIO_RESET_REQUEST_TYPE, FTDI_SIO_RESET, FTDI_SIO_RESET_PURGE_RX | FTDI_SIO_RESET_PURGE_TX, ((0x00) << 8) | CHANNEL_B, 0);
       ftdi_control(FTDI_SIO_SET_DATA_REQUEST_TYPE, FTDI_SIO_SET_DATA, data_size | FTDI_SIO_SET_DATA_STOP_BITS_1 | FTDI_SIO_SET_DATA_PARITY_NONE, ((0x00) << 8) | CHANNEL_B, 0);
       ftdi_control(FTDI_SIO_SET_BAUDRATE_REQUEST_TYPE, FTDI_SET_BAUD_RATE, FTDI_BAUD_DIVISOR, ((0x02) << 8) | CHANNEL_B, 0);
       ftdi_control(FTDI_SIO_SET_FLOW_CTRL_REQUEST_TYPE, FTDI_SIO_SET_FLOW_CTRL, ((XOFF) << 8) | XON, (flowcontrol << 8) | CHANNEL_B, 0);  
+      ftdi_latency_apply(CHANNEL_B);
+      dev->config_state.uart_valid = true;
+      dev->config_state.uart_data_size = data_size;
+      dev->config_state.uart_baud_rate = baud_rate;
+      dev->config_state.uart_flow = flowcontrol;
+      dev->config_state.uart_clock = ftdi_clock_freq;
       return;
 }
 
@@ -643,30 +968,45 @@ void ftdi_uart_write(uint8_t* msg, uint16_t len)
         return;
 }
         
+// buf must hold at least FTDI_READ_CHUNK_SIZE bytes
 uint16_t ftdi_uart_read(uint8_t* buf)
 {
-      uint16_t recv = 0;
-      uint8_t ibuf[256];
-      recv = arty_receive_data(ibuf, 1, uart_ep_rd);
-      // ADDBACK Arty->RcvData(uart_ep_rd, &recv, ibuf);
-       
-      for (int i =0; i < recv; i++){buf[i] = ibuf[i];}
-       return recv;
+      return arty_receive_data(buf, FTDI_READ_CHUNK_SIZE, uart_ep_rd);
+}
+
+// Channel B data is gathered continuously into the board's receive fifo;
+// these read it in place rather than copying it out chunk by chunk
+uint32_t ftdi_uart_peek(const uint8_t** data, uint32_t timeout_ms)
+{
+      return arty_receive_peek(data, timeout_ms, uart_ep_rd);
+}
+
+void ftdi_uart_consume(uint32_t len)
+{
+      arty_receive_consume(len, uart_ep_rd);
+}
+
+void ftdi_uart_get_stats(struct arty_receive_stats* stats)
+{
+      arty_receive_get_stats(uart_ep_rd, stats);
+}
+
+void ftdi_uart_reset_stats()
+{
+      arty_receive_reset_stats(uart_ep_rd);
 }
 
 void ftdi_mpsse_write(uint8_t* msg, uint16_t len)
 {
+        // Anything already queued has to reach the chip first
+        ftdi_write_transfer();
 	arty_transfer_data(msg, len, mpsse_ep_wr);
         // ADDBACK Arty->SndData(mpsse_ep_wr, len, msg);
         return;
 }
         
+// buf must hold at least FTDI_READ_CHUNK_SIZE bytes
 uint16_t ftdi_mpsse_read(uint8_t* buf)
 {
-      uint16_t recv = 0;
-      uint8_t ibuf[256];
-      recv = arty_receive_data(ibuf, 256, mpsse_ep_rd);
-       // ADDBACK Arty->RcvData(mpsse_ep_rd, &recv, ibuf);
-      for (int i =0; i < recv; i++){buf[i] = ibuf[i];}
-      return recv;
+      return arty_receive_data(buf, FTDI_READ_CHUNK_SIZE, mpsse_ep_rd);
 }
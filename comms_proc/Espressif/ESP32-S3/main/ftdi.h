@@ -1,4 +1,6 @@
 #pragma once
+#include <stdbool.h>
+#include "usb/usb_host.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -6,11 +8,26 @@ extern "C" {
 
 #define MAX_PACKET_SIZE 64 //512
 #define PACKET_SIZE 32 //256
+#define MPSSE_READ_BUFFER_SIZE 4096
+#define MPSSE_READ_QUEUE_SIZE 256
+#define MPSSE_MAX_CLOCK_BYTES 65536
+#define FTDI_READ_CHUNK_SIZE 256
+#define FTDI_MPSSE_BASE_CLOCK 60000000
+#define FTDI_MPSSE_DIV5_BASE_CLOCK 12000000
+#define FTDI_TCK_DEFAULT_FREQUENCY 10000000
+#define FTDI_UART_BASE_CLOCK 120000000
 #define DIV_ROUND_UP(m, n)  ((uint32_t)(((m) + (n) - 1) / (n)))
 #define FT2232H_MPSSE_READ_EP 1
 #define FT2232H_MPSSE_WRITE_EP 2
 #define FT2232H_UART_READ_EP 3
 #define FT2232H_UART_WRITE_EP 4
+#define FTDI_CHANNEL_A 1
+#define FTDI_CHANNEL_B 2
+// Latency timer in ms: how long the FT2232H holds a short IN packet back
+#define FTDI_LATENCY_INTERACTIVE_MS 1
+#define FTDI_LATENCY_BULK_MS 255
+// Shortest TMS-low run ftdi_shift_vectors() sends as a data shift
+#define FTDI_SHIFT_MIN_DATA_BITS 8
 
 typedef enum flow_control {
 	NONE = 0x0,
@@ -19,6 +36,24 @@ typedef enum flow_control {
 	XON_XOFF = 0x4
 } flow_control_t;
   
+// Interactive suits short replies such as status polls; bulk lets long
+// read-backs fill whole packets
+typedef enum ftdi_latency_mode {
+	FTDI_LATENCY_INTERACTIVE = 0,
+	FTDI_LATENCY_BULK = 1,
+	FTDI_LATENCY_MODES = 2
+} ftdi_latency_mode_t;
+
+// MPSSE reads completed under one latency mode, timed from the submit of
+// the transfer that requested them to the arrival of the last byte
+struct ftdi_latency_stats {
+	uint32_t reads;
+	uint32_t bytes;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t total_us;
+};
+
 typedef enum tap_state {
 	TAP_INVALID = -1,
 	TAP_DREXIT2 = 0x0,
@@ -41,13 +76,15 @@ typedef enum tap_state {
 
 typedef enum jtag_command_type {
 	JTAG_SCAN         = 1,
-	JTAG_STATEMOVE    = 2
+	JTAG_STATEMOVE    = 2,
+	JTAG_RUNTEST      = 3
 } jtag_command_type_t;
 
+// For JTAG_RUNTEST num_bits is the number of TCK cycles spent in IDLE
 struct jtag_command {
   jtag_command_type_t type;
 	uint8_t ir_scan;
-	uint16_t num_bits;
+	uint32_t num_bits;
 	uint8_t *out_buffer;
 	uint8_t *in_buffer;
 	tap_state_t end_state;
@@ -60,48 +97,109 @@ enum ftdi_chip_type {
 	TYPE_FT232H,
 };
 
+// A pending read-back: once the flush completes, bit_count bits starting at
+// read_offset (in bits) of read_buffer are copied to in at in_offset
+struct mpsse_read_op {
+	uint8_t *in;
+	uint32_t in_offset;
+	uint32_t read_offset;
+	uint32_t bit_count;
+};
+
+// Commands are written straight into the data buffer of a pooled USB
+// transfer; it is submitted when it fills up or when the caller needs
+// read-back data
 struct mpsse_ctx {
 	enum ftdi_chip_type type;
-	uint8_t write_buffer[MAX_PACKET_SIZE];
-	uint16_t write_count;
-	uint16_t write_count_bits;
-	uint8_t read_buffer[MAX_PACKET_SIZE];
-	uint16_t read_count;
-	uint16_t read_count_bits;
-	uint16_t transferred;
+	usb_transfer_t *write_transfer;
+	uint32_t write_count;
+	uint8_t read_buffer[MPSSE_READ_BUFFER_SIZE];
+	uint32_t read_count;
+	struct mpsse_read_op read_queue[MPSSE_READ_QUEUE_SIZE];
+	uint16_t read_queue_count;
+	uint32_t transferred;
 };
 
+// Configuration last sent to the FT2232H. It only holds for dev, the handle
+// it was sent to, and is dropped when that device goes away, so reopening a
+// channel costs no control transfers unless the device re-enumerated.
+struct ftdi_config_state {
+	usb_device_handle_t dev;
+	bool mpsse_mode;
+	bool mpsse_setup;
+	bool mpsse_purge_needed;
+	bool uart_valid;
+	uint8_t uart_data_size;
+	uint32_t uart_baud_rate;
+	flow_control_t uart_flow;
+	uint32_t uart_clock;
+	// Indexed by channel - 1; 0 when not set yet
+	uint8_t latency_timer[2];
+};
+
+// Per-board state of this driver; the functions below act on the board the
+// calling task has selected with arty_select_device()
+struct ftdi_device {
+	struct mpsse_ctx ctx;
+	tap_state_t current_state;
+	tap_state_t target_state;
+	uint32_t tck_frequency;
+	// Clock divisor and prescaler giving tck_frequency, sent by ftdi_mpsse_open()
+	uint16_t tck_divisor;
+	bool tck_div5;
+	uint32_t uart_base_clock;
+	struct ftdi_config_state config_state;
+	ftdi_latency_mode_t latency_mode[2];
+	struct ftdi_latency_stats latency_stats[FTDI_LATENCY_MODES];
+	int64_t read_submit_time;
+};
+
+struct arty_receive_stats;
+
 void ftdi_init(void);
+void ftdi_state_invalidate(int device);
 uint8_t tap_move_ndx(tap_state_t astate);
 uint8_t tap_get_state_enum(tap_state_t state);
 int DIV_ROUND_CLOSEST(uint32_t x, uint32_t divisor);
 uint8_t tap_get_tms_path(tap_state_t start, tap_state_t end);
 uint8_t tap_get_tms_path_len(tap_state_t start, tap_state_t end);
 tap_state_t tap_state_transition(tap_state_t cur_state, uint8_t tms);
-void bit_copy(uint8_t* dst, uint16_t dst_start, uint8_t* src, uint16_t src_start, uint16_t bit_count);
+void bit_copy(uint8_t* dst, uint32_t dst_start, uint8_t* src, uint32_t src_start, uint32_t bit_count);
 
 void ftdi_control(uint8_t bmRequestType, uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint8_t packet);
 void ftdi_uart_configure(uint8_t data_size, uint32_t baud_rate, flow_control_t flowcontrol, uint32_t ftdi_clock_freq);
 void ftdi_uart_write(uint8_t* msg, uint16_t len);
 uint16_t ftdi_uart_read(uint8_t* buf);
+uint32_t ftdi_uart_peek(const uint8_t** data, uint32_t timeout_ms);
+void ftdi_uart_consume(uint32_t len);
+void ftdi_uart_get_stats(struct arty_receive_stats* stats);
+void ftdi_uart_reset_stats();
 void ftdi_mpsse_write(uint8_t* msg, uint16_t len);
 uint16_t ftdi_mpsse_read(uint8_t* buf);
 // MPSSE
+void ftdi_set_latency_mode(uint8_t channel, ftdi_latency_mode_t mode);
+ftdi_latency_mode_t ftdi_get_latency_mode(uint8_t channel);
+void ftdi_latency_idle(void);
+void ftdi_get_latency_stats(ftdi_latency_mode_t mode, struct ftdi_latency_stats *stats);
+void ftdi_reset_latency_stats(void);
+void ftdi_mpsse_mode();
+void ftdi_mpsse_setup_lost();
 void ftdi_mpsse_open();
 void ftdi_mpsse_purge();
-uint16_t ftdi_buffer_write_space();
-uint16_t ftdi_buffer_read_space();
+uint32_t ftdi_mpsse_set_frequency(uint32_t frequency);
+uint32_t ftdi_mpsse_get_frequency();
+uint32_t ftdi_buffer_read_space();
 void ftdi_buffer_write_byte(uint8_t data);
-uint16_t ftdi_buffer_write(uint8_t* out, uint16_t out_offset, uint16_t bit_count);
-uint16_t ftdi_buffer_add_read(uint16_t bit_count);
+uint32_t ftdi_buffer_write(uint8_t* out, uint32_t out_offset, uint32_t bit_count);
+uint32_t ftdi_buffer_add_read(uint8_t* in_, uint32_t in_offset, uint32_t bit_count, uint32_t offset);
 void ftdi_write_transfer();
 void ftdi_read_transfer();
 void ftdi_mpsse_flush();
-void ftdi_mpsse_clock_data_out(uint8_t* out, uint16_t out_offset, uint16_t length, uint8_t mode);
-void ftdi_mpsse_clock_data_in(uint8_t* in_, uint16_t in_offset, uint16_t length, uint8_t mode);
-void ftdi_mpsse_clock_data(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint16_t in_offset, uint16_t length, uint8_t mode);
-void ftdi_mpsse_clock_tms_cs(uint8_t* out, uint16_t out_offset, uint8_t* in_, uint16_t in_offset, uint16_t length, uint8_t tdi, uint8_t mode);
-void ftdi_mpsse_clock_tms_cs_out(uint8_t* out, uint16_t out_offset, uint16_t length, uint8_t tdi, uint8_t mode);   
+void ftdi_mpsse_clock_data_out(uint8_t* out, uint32_t out_offset, uint32_t length, uint8_t mode);
+void ftdi_mpsse_clock_data_in(uint8_t* in_, uint32_t in_offset, uint32_t length, uint8_t mode);
+void ftdi_mpsse_clock_data(uint8_t* out, uint32_t out_offset, uint8_t* in_, uint32_t in_offset, uint32_t length, uint8_t mode);
+void ftdi_mpsse_clock_tms_cs(uint8_t* out, uint32_t out_offset, uint8_t* in_, uint32_t in_offset, uint32_t length, uint8_t tdi, uint8_t mode);
+void ftdi_mpsse_clock_tms_cs_out(uint8_t* out, uint32_t out_offset, uint32_t length, uint8_t tdi, uint8_t mode);   
 // FTDI
 tap_state_t ftdi_tap_get_state();
 void ftdi_tap_set_state(tap_state_t state);
@@ -111,7 +209,9 @@ void ftdi_move_to_state(tap_state_t goal_state);
 void ftdi_end_state(tap_state_t state);
 void ftdi_execute_statemove(struct jtag_command cmd);
 void ftdi_execute_scan(struct jtag_command cmd);
+void ftdi_execute_runtest(struct jtag_command cmd);
 void ftdi_execute_command(struct jtag_command cmd);
+void ftdi_shift_vectors(uint32_t num_bits, uint8_t* tms, uint8_t* tdi, uint8_t* tdo);
 
 #ifdef __cplusplus
 }
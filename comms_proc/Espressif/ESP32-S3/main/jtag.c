@@ -1,24 +1,194 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 #include <esp_log.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "arty_driver.h"
 #include "jtag.h"
+#include "bitstream.h"
+#include "softcore_image.h"
 
-#define FILE_BUFFER_SIZE 2048
 #define ADDRESS_MAX 
 
-void jtag_statemove(tap_state_t state)
+// Queued commands keep their own copy of the outgoing bits in the queue's data
+// pool, so callers may pass stack buffers. Read-back lands in the same pool and
+// is scattered to the callers' in_value buffers once the MPSSE stream is
+// flushed. Each board gets its own queue the first time a task drives it.
+static struct jtag_queue *jtag_queues[ARTY_MAX_DEVICES];
+
+static struct jtag_queue *jtag_queue_get()
+{
+  int device = arty_current_device();
+  if (jtag_queues[device] == NULL)
+  {
+    jtag_queues[device] = calloc(1, sizeof(struct jtag_queue));
+    if (jtag_queues[device] == NULL)
+    {
+      ESP_LOGE("JTAG", "No memory for the queue of board %d", device);
+      abort();
+    }
+  }
+  return jtag_queues[device];
+}
+
+static void jtag_queue_issue()
+{
+  struct jtag_queue *q = jtag_queue_get();
+  for (int i = 0; i < q->count; i++)
+    ftdi_execute_command(q->commands[i]);
+  q->count = 0;
+}
+
+void jtag_execute_queue()
+{
+  struct jtag_queue *q = jtag_queue_get();
+  jtag_queue_issue();
+  ftdi_mpsse_flush();
+  for (int i = 0; i < q->in_count; i++)
+  {
+    struct jtag_queue_in_field *field = &q->in[i];
+    bit_copy(field->in_value, 0, field->data, field->data_offset, field->num_bits);
+  }
+  q->in_count = 0;
+  q->data_count = 0;
+}
+
+// Makes room for one more command. Without pending read-back the commands
+// only need to be handed to the MPSSE layer, which sends them as its buffer
+// fills; otherwise the whole queue has to complete first.
+static void jtag_queue_reserve(uint32_t data_bytes, uint16_t in_fields)
+{
+  struct jtag_queue *q = jtag_queue_get();
+  if ((q->count < JTAG_QUEUE_SIZE) && (q->data_count + data_bytes <= JTAG_QUEUE_DATA_SIZE) && \
+      (q->in_count + in_fields <= JTAG_QUEUE_IN_FIELDS))
+    return;
+  if (q->in_count)
+    jtag_execute_queue();
+  else
+  {
+    jtag_queue_issue();
+    q->data_count = 0;
+  }
+}
+
+static void jtag_add_scan(uint8_t ir_scan, int num_fields, const struct scan_field *fields, tap_state_t state)
 {
+  struct jtag_queue *q = jtag_queue_get();
+  uint32_t num_bits = 0;
+  uint16_t in_fields = 0;
+  for (int i = 0; i < num_fields; i++)
+  {
+    num_bits += fields[i].num_bits;
+    if (fields[i].in_value)
+      in_fields++;
+  }
+  if (num_bits == 0)
+    return;
+  uint32_t bytes = DIV_ROUND_UP(num_bits, 8);
+  uint32_t data_bytes = in_fields ? 2 * bytes : bytes;
   struct jtag_command cmd;
-  cmd.type = JTAG_STATEMOVE; 
+  cmd.type = JTAG_SCAN;
+  cmd.ir_scan = ir_scan;
+  cmd.num_bits = num_bits;
+  cmd.end_state = state;
+  if ((data_bytes > JTAG_QUEUE_DATA_SIZE) || (in_fields > JTAG_QUEUE_IN_FIELDS))
+  {
+    // Too big to stage; a single field can still go out straight from the
+    // caller's buffers while they are known to be valid
+    if (num_fields != 1)
+    {
+      ESP_LOGE("JTAG", "Scan of %" PRIu32 " bits in %d fields does not fit the queue", num_bits, num_fields);
+      return;
+    }
+    jtag_execute_queue();
+    cmd.out_buffer = (uint8_t*)fields[0].out_value;
+    cmd.in_buffer = fields[0].in_value;
+    ftdi_execute_command(cmd);
+    ftdi_mpsse_flush();
+    return;
+  }
+  jtag_queue_reserve(data_bytes, in_fields);
+  cmd.out_buffer = &q->data[q->data_count];
+  q->data_count += bytes;
+  memset(cmd.out_buffer, 0, bytes);
+  cmd.in_buffer = NULL;
+  if (in_fields)
+  {
+    cmd.in_buffer = &q->data[q->data_count];
+    q->data_count += bytes;
+  }
+  uint32_t offset = 0;
+  for (int i = 0; i < num_fields; i++)
+  {
+    if (fields[i].out_value)
+      bit_copy(cmd.out_buffer, offset, (uint8_t*)fields[i].out_value, 0, fields[i].num_bits);
+    if (fields[i].in_value)
+    {
+      struct jtag_queue_in_field *field = &q->in[q->in_count++];
+      field->in_value = fields[i].in_value;
+      field->data = cmd.in_buffer;
+      field->data_offset = offset;
+      field->num_bits = fields[i].num_bits;
+    }
+    offset += fields[i].num_bits;
+  }
+  q->commands[q->count++] = cmd;
+}
+
+void jtag_add_ir_scan(const struct scan_field *field, tap_state_t state)
+{
+  jtag_add_scan(1, 1, field, state);
+}
+
+void jtag_add_ir_scan_fields(int num_fields, const struct scan_field *fields, tap_state_t state)
+{
+  jtag_add_scan(1, num_fields, fields, state);
+}
+
+void jtag_add_dr_scan(int num_fields, const struct scan_field *fields, tap_state_t state)
+{
+  jtag_add_scan(0, num_fields, fields, state);
+}
+
+void jtag_add_statemove(tap_state_t state)
+{
+  struct jtag_queue *q = jtag_queue_get();
+  jtag_queue_reserve(0, 0);
+  struct jtag_command cmd;
+  cmd.type = JTAG_STATEMOVE;
   cmd.end_state = state;
   cmd.in_buffer = NULL;
   cmd.ir_scan = 0;
+  cmd.num_bits = 0;
   cmd.out_buffer = NULL;
-  ftdi_execute_command(cmd); 
+  q->commands[q->count++] = cmd;
+}
+
+void jtag_add_runtest(uint32_t num_cycles, tap_state_t state)
+{
+  struct jtag_queue *q = jtag_queue_get();
+  jtag_queue_reserve(0, 0);
+  struct jtag_command cmd;
+  cmd.type = JTAG_RUNTEST;
+  cmd.end_state = state;
+  cmd.in_buffer = NULL;
+  cmd.ir_scan = 0;
+  cmd.num_bits = num_cycles;
+  cmd.out_buffer = NULL;
+  q->commands[q->count++] = cmd;
+}
+
+void jtag_statemove(tap_state_t state)
+{
+  jtag_add_statemove(state);
 }
 
 void jtag_reset()
@@ -30,164 +200,297 @@ void jtag_idle()
 {
   jtag_statemove(TAP_IDLE);
 }
+
+static void jtag_irscan_end(uint16_t num_bits, uint8_t val, tap_state_t state)
+{
+  struct scan_field field = {num_bits, &val, NULL};
+  jtag_add_ir_scan(&field, state);
+}
+
+static void jtag_drscan_end(const uint8_t* wbuf, uint8_t* rbuf, uint32_t num_bits, tap_state_t state)
+{
+  struct scan_field field = {num_bits, wbuf, rbuf};
+  jtag_add_dr_scan(1, &field, state);
+}
  
 void jtag_irscan_bits(uint16_t num_bits, uint8_t val)
 {
-  uint8_t _val = val;
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 1;
-  cmd.num_bits = num_bits;
-  cmd.out_buffer = &_val;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_IDLE;
-  ftdi_execute_command(cmd);
+  jtag_irscan_end(num_bits, val, TAP_IDLE);
 }
 
 void jtag_irscan_bits_reset(uint16_t num_bits, uint8_t val)
 {
-  uint8_t _val = val;
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 1;
-  cmd.num_bits = num_bits;
-  cmd.out_buffer = &_val;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_RESET;
-  ftdi_execute_command(cmd);
+  jtag_irscan_end(num_bits, val, TAP_RESET);
 }
 
 void jtag_irscan_bits_irpause(uint16_t num_bits, uint8_t val)
 {
-  uint8_t _val = val;
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 1;
-  cmd.num_bits = num_bits;
-  cmd.out_buffer = &_val;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_IRPAUSE;
-  ftdi_execute_command(cmd);
+  jtag_irscan_end(num_bits, val, TAP_IRPAUSE);
 }
       
 void jtag_irscan_bits_hold(uint16_t num_bits, uint8_t val)
 {
-  uint8_t _val = val;
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 1;
-  cmd.num_bits = num_bits;
-  cmd.out_buffer = &_val;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_IRSHIFT;
-  ftdi_execute_command(cmd);
+  jtag_irscan_end(num_bits, val, TAP_IRSHIFT);
 }
 
 void jtag_drscan_bits(uint16_t num_bits, uint8_t val)
 {
-  uint8_t _val = val;
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 0;
-  cmd.num_bits = num_bits;
-  cmd.out_buffer = &_val;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_IDLE;
-  ftdi_execute_command(cmd);
+  jtag_drscan_end(&val, NULL, num_bits, TAP_IDLE);
 }
 
 void jtag_drscan_bytes(uint8_t* wbuf, uint16_t len)
 {
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 0;
-  cmd.num_bits = len*8;
-  cmd.out_buffer = wbuf;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_DRPAUSE;
-  ftdi_execute_command(cmd);
+  jtag_drscan_end(wbuf, NULL, len*8, TAP_DRPAUSE);
 }
         
 void jtag_drscan_bytes_hold(uint8_t* wbuf, uint16_t len)
 {
-  struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
-  cmd.ir_scan = 0;
-  cmd.num_bits = len*8;
-  cmd.out_buffer = wbuf;
-  cmd.in_buffer = NULL;
-  cmd.end_state = TAP_DRSHIFT;
-  ftdi_execute_command(cmd);
+  jtag_drscan_end(wbuf, NULL, len*8, TAP_DRSHIFT);
 }
 
 void jtag_drscan_bytes_read(uint8_t* wbuf, uint8_t* rbuf, uint16_t len)
+{
+  jtag_drscan_end(wbuf, rbuf, len*8, TAP_DRPAUSE);
+  jtag_execute_queue();
+}
+
+static uint32_t jtag_read_idcode()
+{
+  uint8_t buf[4] = {0,0,0,0};
+  struct scan_field field = {32, NULL, buf};
+  // Test-Logic-Reset selects IDCODE, so no IR scan is needed
+  jtag_add_statemove(TAP_RESET);
+  jtag_add_dr_scan(1, &field, TAP_IDLE);
+  jtag_execute_queue();
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static bool jtag_bypass_check()
+{
+  static const uint8_t pattern[9] = {0xA5, 0x5A, 0xC3, 0x3C, 0x96, 0x69, 0x0F, 0xF0, 0x00};
+  uint8_t bypass = JTAG_IR_BYPASS;
+  uint8_t buf[9] = {0};
+  uint8_t shifted[8] = {0};
+  struct scan_field ir = {JTAG_IR_LENGTH, &bypass, NULL};
+  struct scan_field dr = {65, pattern, buf};
+  jtag_add_ir_scan(&ir, TAP_IDLE);
+  jtag_add_dr_scan(1, &dr, TAP_IDLE);
+  jtag_execute_queue();
+  // The one-bit bypass register delays TDI by a single clock
+  bit_copy(shifted, 0, buf, 1, 64);
+  return memcmp(shifted, pattern, 8) == 0;
+}
+
+// Reads IDCODE at a safe rate, then steps TCK up through the divisor values
+// until IDCODE or a BYPASS loop-through no longer read back reliably. TCK is
+// left at, and the function returns, the last rate that passed, or 0 if the
+// chain does not respond even at the reference rate.
+uint32_t jtag_calibrate_tck()
+{
+  ftdi_mpsse_open();
+  ftdi_mpsse_set_frequency(JTAG_CALIBRATE_REF_FREQUENCY);
+  uint32_t idcode = jtag_read_idcode();
+  if ((idcode == 0) || (idcode == 0xFFFFFFFF) || !jtag_bypass_check())
+  {
+    ESP_LOGE("JTAG", "No usable JTAG chain at %d Hz (IDCODE %08" PRIX32 ")", JTAG_CALIBRATE_REF_FREQUENCY, idcode);
+    return 0;
+  }
+  uint32_t best = ftdi_mpsse_get_frequency();
+  for (int divisor = FTDI_MPSSE_BASE_CLOCK / 2 / JTAG_CALIBRATE_REF_FREQUENCY - 1; divisor >= 0; divisor--)
+  {
+    uint32_t frequency = ftdi_mpsse_set_frequency(FTDI_MPSSE_BASE_CLOCK / 2 / (divisor + 1));
+    bool pass = true;
+    for (int i = 0; pass && (i < JTAG_CALIBRATE_PASSES); i++)
+      pass = (jtag_read_idcode() == idcode) && jtag_bypass_check();
+    if (!pass)
+      break;
+    best = frequency;
+  }
+  ftdi_mpsse_set_frequency(best);
+  jtag_reset();
+  jtag_execute_queue();
+  ESP_LOGI("JTAG", "IDCODE %08" PRIX32 ", TCK calibrated to %" PRIu32 " Hz", idcode, best);
+  return best;
+}
+
+// The 7-series IR capture value carries the configuration status: bits 1:0
+// always read 01 and bit 5 is DONE. USERCODE is read in the same pass.
+bool jtag_read_config_state(uint32_t* usercode, bool* done)
+{
+  uint8_t usercode_ir = JTAG_IR_USERCODE;
+  uint8_t ir = 0;
+  uint8_t buf[4] = {0,0,0,0};
+  struct scan_field ir_field = {JTAG_IR_LENGTH, &usercode_ir, &ir};
+  struct scan_field dr_field = {32, NULL, buf};
+  ftdi_mpsse_open();
+  jtag_add_statemove(TAP_RESET);
+  jtag_add_ir_scan(&ir_field, TAP_IDLE);
+  jtag_add_dr_scan(1, &dr_field, TAP_IDLE);
+  jtag_execute_queue();
+  if ((ir & 0x03) != 0x01)
+  {
+    ESP_LOGE("JTAG", "Unexpected IR capture value %02x", ir);
+    return false;
+  }
+  *done = (ir >> 5) & 1;
+  *usercode = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+  return true;
+}
+
+// Configuration data goes out LSB first over JTAG but the bitstream stores
+// each byte MSB first
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+static const uint8_t bit_reverse_table[256] = { R6(0), R6(2), R6(1), R6(3) };
+
+// Shifts a chunk straight into the MPSSE transfers without staging it in the
+// queue; anything queued before it is issued first to keep the ordering
+static void jtag_stream_dr(uint8_t* wbuf, uint32_t num_bits, tap_state_t state)
 {
   struct jtag_command cmd;
-  cmd.type = JTAG_SCAN; 
+  jtag_queue_issue();
+  cmd.type = JTAG_SCAN;
   cmd.ir_scan = 0;
-  cmd.num_bits = len*8;
+  cmd.num_bits = num_bits;
   cmd.out_buffer = wbuf;
-  cmd.in_buffer = rbuf;
-  cmd.end_state = TAP_DRPAUSE;
-  ESP_LOGI("JTAG_AXI_STATUS", "FTDI Command Execution Starting");
+  cmd.in_buffer = NULL;
+  cmd.end_state = state;
   ftdi_execute_command(cmd);
-  ESP_LOGI("JTAG_DRSCAN_BYTES_READ", "FTDI Command Execution Complete");
 }
 
-void jtag_program(char* filename)
+// The reader fills empty buffers from the SD card and bit-reverses them on
+// one core while the writer packs them into USB transfers on the other, so
+// card and bus latency overlap. Buffers circulate through two queues, the
+// same way the USB transfer pool does.
+static void jtag_program_reader_task(void *arg)
 {
-  struct stat st;
+  struct jtag_program_pipe *pipe = (struct jtag_program_pipe *)arg;
+  struct jtag_program_chunk chunk;
+  while (1)
+  {
+    xQueueReceive(pipe->free_queue, &chunk.buf, portMAX_DELAY);
+    chunk.len = bitstream_read(pipe->bs, chunk.buf, JTAG_PROGRAM_CHUNK_SIZE);
+    if (chunk.len == 0)
+    {
+      xQueueSend(pipe->free_queue, &chunk.buf, portMAX_DELAY);
+      break;
+    }
+    for (uint32_t k = 0; k < chunk.len; k++)
+    {
+      chunk.buf[k] = bit_reverse_table[chunk.buf[k]];
+    }
+    xQueueSend(pipe->full_queue, &chunk, portMAX_DELAY);
+  }
+  // An empty chunk marks the end of the file
+  chunk.buf = NULL;
+  chunk.len = 0;
+  xQueueSend(pipe->full_queue, &chunk, portMAX_DELAY);
+  vTaskDelete(NULL);
+}
 
-  if(stat(filename, &st)!=0)
+// One chunk is held back until the next arrives, so that only the very last
+// one takes the TAP out of DR-SHIFT
+static void jtag_program_writer_task(void *arg)
+{
+  struct jtag_program_pipe *pipe = (struct jtag_program_pipe *)arg;
+  arty_select_device(pipe->device);
+  struct jtag_program_chunk chunk;
+  struct jtag_program_chunk held = {NULL, 0};
+  while (1)
   {
-    return;
+    xQueueReceive(pipe->full_queue, &chunk, portMAX_DELAY);
+    if (held.buf)
+    {
+      jtag_stream_dr(held.buf, held.len*8, chunk.buf ? TAP_DRSHIFT : TAP_IDLE);
+      pipe->written += held.len;
+      xQueueSend(pipe->free_queue, &held.buf, portMAX_DELAY);
+    }
+    if (chunk.buf == NULL)
+      break;
+    held = chunk;
   }
+  xSemaphoreGive(pipe->done);
+  vTaskDelete(NULL);
+}
 
-  FILE *f = fopen(filename, "rb");
-  uint32_t filesize = st.st_size;
-  uint32_t bytes_to_read = 0;
-  uint8_t buf[128];
+// Accepts raw, gzip or zip packaged bitstreams; see bitstream_open()
+bool jtag_program(char* filename, struct jtag_program_stats* stats)
+{
+  bitstream_t *bs = bitstream_open(filename);
+  if (bs == NULL)
+  {
+    return false;
+  }
   uint8_t CFG_IN = 0x05;
   uint8_t JPROGRAM = 0x0B;
   uint8_t JSTART = 0x0C;
-  uint16_t i = 0;
-  uint16_t j = 0;
-  uint16_t k = 0;
-  uint8_t filebuf[FILE_BUFFER_SIZE];
+  // On the heap so neither the task stacks nor every board need to hold them
+  uint8_t *program_bufs = malloc(JTAG_PROGRAM_BUFFER_COUNT * JTAG_PROGRAM_CHUNK_SIZE);
+  if (program_bufs == NULL)
+  {
+    bitstream_close(bs);
+    return false;
+  }
+  struct jtag_program_pipe pipe;
+  pipe.bs = bs;
+  pipe.written = 0;
+  pipe.device = arty_current_device();
+  pipe.free_queue = xQueueCreate(JTAG_PROGRAM_BUFFER_COUNT, sizeof(uint8_t *));
+  pipe.full_queue = xQueueCreate(JTAG_PROGRAM_BUFFER_COUNT + 1, sizeof(struct jtag_program_chunk));
+  pipe.done = xSemaphoreCreateBinary();
+  for (int i = 0; i < JTAG_PROGRAM_BUFFER_COUNT; i++)
+  {
+    uint8_t *buf = program_bufs + i * JTAG_PROGRAM_CHUNK_SIZE;
+    xQueueSend(pipe.free_queue, &buf, 0);
+  }
 
+  int64_t start = esp_timer_get_time();
+  // Nothing is read back while the bitstream streams out, so channel A need
+  // not return status-only packets every millisecond
+  ftdi_latency_mode_t latency = ftdi_get_latency_mode(FTDI_CHANNEL_A);
+  ftdi_set_latency_mode(FTDI_CHANNEL_A, FTDI_LATENCY_BULK);
   ftdi_mpsse_open();	
   jtag_reset();
   jtag_idle();
   jtag_irscan_bits_reset(6, JPROGRAM);
   jtag_irscan_bits_irpause(6, CFG_IN);	
 
-  while(filesize > 0)
-  {
-    bytes_to_read = (filesize >= FILE_BUFFER_SIZE)?(FILE_BUFFER_SIZE):filesize;
-    j = fread(&filebuf, sizeof(uint8_t), bytes_to_read, f);
-    filesize -= j;     
-    i  = 0;
+  UBaseType_t priority = uxTaskPriorityGet(NULL);
+  xTaskCreatePinnedToCore(jtag_program_reader_task, "jtag_rd", 4096, &pipe, priority, NULL, JTAG_PROGRAM_READER_CORE);
+  xTaskCreatePinnedToCore(jtag_program_writer_task, "jtag_wr", 4096, &pipe, priority, NULL, JTAG_PROGRAM_WRITER_CORE);
+  xSemaphoreTake(pipe.done, portMAX_DELAY);
 
-    for (k = 0; k < j; k++)
-    {
-      uint8_t byte = filebuf[k];
-      byte =  (((byte>>0)&1)<<7) | (((byte>>1)&1)<<6) | (((byte>>2)&1)<<5) | (((byte>>3)&1)<<4) | (((byte>>4)&1)<<3) | (((byte>>5)&1)<<2) | (((byte>>6)&1)<<1) | (((byte>>7)&1)<<0);
-      buf[i] = byte;
-      i++;
-      if (i == 32)
-      {
-        jtag_drscan_bytes_hold(buf,32);
-        i = 0;
-      }
-    }
-    if (i > 0)
-    {
-      jtag_drscan_bytes_hold(buf,i);
-    }
+  // A truncated or corrupt file must not be started; the TAP goes back to
+  // reset and the FPGA stays cleared by JPROGRAM
+  bool complete = bitstream_complete(bs);
+  if (complete)
+  {
+    jtag_irscan_bits(6, JSTART);
+    // UG470: at least 2000 TCK cycles in RUN-TEST/IDLE for the startup sequence
+    jtag_add_runtest(2000, TAP_IDLE);
+    jtag_reset();
+  }
+  else
+  {
+    ESP_LOGE("JTAG", "Bitstream %s ended early after %" PRIu32 " bytes", filename, pipe.written);
   }
-  jtag_irscan_bits(6, JSTART);
-  jtag_reset();
   jtag_reset();
+  jtag_execute_queue();
+  arty_transfer_wait_idle();
+  ftdi_set_latency_mode(FTDI_CHANNEL_A, latency);
+  bitstream_close(bs);
+  vQueueDelete(pipe.free_queue);
+  vQueueDelete(pipe.full_queue);
+  vSemaphoreDelete(pipe.done);
+  free(program_bufs);
+  if (stats)
+  {
+    stats->bytes = pipe.written;
+    stats->time_us = esp_timer_get_time() - start;
+    stats->retries = 0;
+  }
+  return complete;
 }  
   
 void jtag_axi_write(uint32_t address, uint32_t data)
@@ -211,6 +514,8 @@ void jtag_control_write(uint32_t control_0_31, uint32_t control_32_63, uint32_t
       jtag_irscan_bits(6,0x23);
       jtag_drscan_bytes(buf,13);
       jtag_idle();
+      // The control word gates the UART loader, so it has to be applied now
+      jtag_execute_queue();
 }
 
 void jtag_axi_write_noirscan(uint32_t address, uint32_t data)
@@ -225,63 +530,105 @@ void jtag_axi_write_noirscan(uint32_t address, uint32_t data)
 
 uint32_t jtag_axi_status()
 {
-      ESP_LOGI("JTAG_AXI_STATUS", "IR Scan starting");
-      jtag_irscan_bits(6,0x23);
-      ESP_LOGI("JTAG_AXI_STATUS", "IR Scan complete");
-      uint8_t buf[13] = {0,0,0,0,0,0,0,0,0,0,0,0,16};
+      jtag_irscan_bits(JTAG_IR_LENGTH, JTAG_USER_IR);
+      uint8_t buf[13] = {0,0,0,0,0,0,0,0,0,0,0,0,JTAG_LOAD_JTAG_READ_DATA_CMD};
       uint8_t buf2[13] = {0,0,0,0,0,0,0,0,0,0,0,0,0};
-      ESP_LOGI("JTAG_AXI_STATUS", "DR Scan starting");
       jtag_drscan_bytes(buf, 13);
-      ESP_LOGI("JTAG_AXI_STATUS", "DR Scan complete");
       jtag_idle();
-      ESP_LOGI("JTAG_AXI_STATUS", "DR Scan bytes starting");
       jtag_drscan_bytes_read(buf2, buf2, 13);
-      ESP_LOGI("JTAG_AXI_STATUS", "DR Scan bytes complete");
       jtag_idle();
       return (((buf2[5] & 0xff) << 8) | (buf2[4] & 0xff));
 }
-      
-uint32_t jtag_axi_read(uint32_t address)
+
+static void jtag_axi_pack(uint8_t* word, uint32_t bits_0_31, uint32_t bits_32_63, uint32_t bits_64_95, uint8_t cmd)
 {
-      uint8_t buf_0[13] = 	{(uint8_t)(address&255),(uint8_t)((address>>8)&255),(uint8_t)((address>>16)&255), \
-	      			(uint8_t)((address>>24)&255),0,0,0,0,0,0,0,0,1};
-      uint8_t buf_1[13] = {0,0,0,0,0,0,0,0,0,0,0,0,4};
-      uint8_t buf_2[13] = {0,0,0,0,0,0,0,0,0,0,0,0,16};
-      uint8_t buf_3[13] = {0,0,0,0,0,0,0,0,0,0,0,0,0};
-      jtag_irscan_bits(6,0x23);
-      jtag_drscan_bytes(buf_0, 13);
-      jtag_idle();
-      uint32_t status = 0;
-      while (!((status >> 2) & 1)){
-	  ESP_LOGI("JTAG_AXI_READ", "Waiting for status");
-          status = jtag_axi_status();
+      for (int i = 0; i < 4; i++)
+      {
+        word[i] = (bits_0_31 >> (8*i)) & 255;
+        word[4+i] = (bits_32_63 >> (8*i)) & 255;
+        word[8+i] = (bits_64_95 >> (8*i)) & 255;
       }
-      ESP_LOGI("JTAG_AXI_READ", "Status reached");
-      jtag_drscan_bytes(buf_1, 13);
-      jtag_idle();
-      jtag_drscan_bytes(buf_2, 13);
-      jtag_idle();
-      jtag_drscan_bytes_read(buf_3, buf_3, 13);
-      jtag_idle();
-      uint32_t data = buf_3[0] + (buf_3[1] << 8) + (buf_3[2] << 16) + (buf_3[3] << 24);
-
-      return (data);
+      word[12] = cmd;
 }
 
-bool isHex(uint32_t c)
+// Reads n consecutive words starting at address with one IR scan. The bridge
+// auto-increments the address, and each scan loads the result of the read
+// issued by the scan before it, which is then shifted out by the next one,
+// so the read-back trails the commands by two scans. Only the 48 captured
+// bits holding data and status are kept. Returns false if any word came back
+// without the valid flag or with an error.
+bool jtag_axi_read_burst(uint32_t address, uint32_t n, uint32_t* buf)
 {
-  if (((48 <= c) && (c <= 57)) || ((65 <= c) && (c <= 70)))
-    return true;
-  else
-    return false;
+      // One buffer per board, so boards can be driven concurrently
+      static uint8_t board_captured[ARTY_MAX_DEVICES][JTAG_AXI_BURST_WORDS][6];
+      uint8_t (*captured)[6] = board_captured[arty_current_device()];
+      uint32_t chunk;
+      bool ok = true;
+      jtag_irscan_bits(JTAG_IR_LENGTH, JTAG_USER_IR);
+      for (uint32_t done = 0; done < n; done += chunk)
+      {
+        chunk = ((n - done) > JTAG_AXI_BURST_WORDS) ? JTAG_AXI_BURST_WORDS : (n - done);
+        for (uint32_t i = 0; i < chunk + 2; i++)
+        {
+          uint8_t word[13];
+          uint8_t cmd = 0;
+          if (i == 0)
+            cmd = JTAG_AXI_READ_ADDRESS_CMD;
+          else if (i < chunk)
+            cmd = JTAG_AXI_READ_DATA_CMD | JTAG_LOAD_JTAG_READ_DATA_CMD | JTAG_AXI_READ_ADDRESS_CMD | JTAG_AXI_AUTO_INCREMENT_CMD;
+          else if (i == chunk)
+            cmd = JTAG_AXI_READ_DATA_CMD | JTAG_LOAD_JTAG_READ_DATA_CMD;
+          jtag_axi_pack(word, (i == 0) ? address + 4*done : 0, 0, 0, cmd);
+          struct scan_field fields[2] = {{48, word, (i >= 2) ? captured[i-2] : NULL}, {56, &word[6], NULL}};
+          jtag_add_dr_scan(2, fields, TAP_IDLE);
+          jtag_add_runtest(JTAG_AXI_IDLE_CYCLES, TAP_IDLE);
+        }
+        jtag_execute_queue();
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+          uint16_t status = captured[i][4] | (captured[i][5] << 8);
+          if (!(status & JTAG_AXI_STATUS_READ_VALID) || (status & JTAG_AXI_STATUS_ERROR))
+            ok = false;
+          buf[done + i] = captured[i][0] | (captured[i][1] << 8) | (captured[i][2] << 16) | ((uint32_t)captured[i][3] << 24);
+        }
+      }
+      if (!ok)
+        ESP_LOGE("JTAG", "AXI burst read of %" PRIu32 " words at %08" PRIX32 " failed", n, address);
+      return ok;
 }
 
-uint32_t hex2dec(uint32_t c)
+// Writes n consecutive words starting at address with one IR scan; only the
+// first scan carries the address. The bridge status is checked once at the end.
+bool jtag_axi_write_burst(uint32_t address, uint32_t n, const uint32_t* buf)
+{
+      if (n == 0)
+        return true;
+      jtag_irscan_bits(JTAG_IR_LENGTH, JTAG_USER_IR);
+      for (uint32_t i = 0; i < n; i++)
+      {
+        uint8_t word[13];
+        uint8_t cmd = JTAG_AXI_WRITE_ADDRESS_CMD | JTAG_AXI_WRITE_DATA_CMD;
+        if (i)
+          cmd |= JTAG_AXI_AUTO_INCREMENT_CMD;
+        jtag_axi_pack(word, 0, i ? 0 : address, buf[i], cmd);
+        struct scan_field field = {104, word, NULL};
+        jtag_add_dr_scan(1, &field, TAP_IDLE);
+        jtag_add_runtest(JTAG_AXI_IDLE_CYCLES, TAP_IDLE);
+      }
+      uint32_t status = jtag_axi_status();
+      if (status & JTAG_AXI_STATUS_ERROR)
+      {
+        ESP_LOGE("JTAG", "AXI burst write of %" PRIu32 " words at %08" PRIX32 " failed, status %04" PRIX32, n, address, status);
+        return false;
+      }
+      return true;
+}
+      
+uint32_t jtag_axi_read(uint32_t address)
 {
-  if ((48 <= c) && (c <= 57))
-    return c-48;
-  else 
-    return c-55;
+      uint32_t data = 0;
+      jtag_axi_read_burst(address, 1, &data);
+      return (data);
 }
 
 void jtag_uart_tx_test()
@@ -322,194 +669,275 @@ void jtag_uart_loopback_test()
   //ESP_LOGI("JTAG","Loopback received bytes %" PRIu16, recv);
 }
 
-void jtag_program_softcore(char* filename)
+// Sends n bytes of words as one progloader_axi burst frame and waits for its
+// answer. The loader writes every word before it checks the CRC, so after a
+// NAK, or no answer at all, the whole frame goes out again.
+static bool jtag_softcore_frame(uint32_t address, const uint8_t* words, uint32_t n, uint32_t baud_rate, struct jtag_program_stats* stats)
 {
-  struct stat st;
-
-  if(stat(filename, &st)!=0)
+  uint32_t timeout_ms = ((n + JTAG_SOFTCORE_FRAME_OVERHEAD) * 10 * 1000) / baud_rate + JTAG_SOFTCORE_ACK_TIMEOUT_MS;
+  const uint8_t *reply;
+  uint32_t avail;
+  for (int attempt = 0; attempt < JTAG_SOFTCORE_FRAME_RETRIES; attempt++)
   {
-    return;
+    // A late answer to an earlier attempt must not count for this one
+    while ((avail = ftdi_uart_peek(&reply, 0)) > 0)
+      ftdi_uart_consume(avail);
+    usb_transfer_t *xfer = arty_transfer_get();
+    uint8_t *frame = xfer->data_buffer;
+    uint32_t count = n / 4;
+    frame[0] = JTAG_SOFTCORE_SYNC;
+    frame[1] = address & 255;
+    frame[2] = (address >> 8) & 255;
+    frame[3] = (address >> 16) & 255;
+    frame[4] = (address >> 24) & 255;
+    frame[5] = count & 255;
+    frame[6] = (count >> 8) & 255;
+    memcpy(frame + 7, words, n);
+    uint32_t crc = esp_rom_crc32_le(0, frame + 1, 6 + n);
+    frame[7 + n] = crc & 255;
+    frame[8 + n] = (crc >> 8) & 255;
+    frame[9 + n] = (crc >> 16) & 255;
+    frame[10 + n] = (crc >> 24) & 255;
+    arty_transfer_submit(xfer, n + JTAG_SOFTCORE_FRAME_OVERHEAD, FT2232H_UART_WRITE_EP);
+
+    uint8_t answer = 0;
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    int64_t now;
+    while ((answer == 0) && ((now = esp_timer_get_time()) < deadline))
+    {
+      avail = ftdi_uart_peek(&reply, (deadline - now) / 1000 + 1);
+      uint32_t used = 0;
+      while ((answer == 0) && (used < avail))
+      {
+        if ((reply[used] == JTAG_SOFTCORE_ACK) || (reply[used] == JTAG_SOFTCORE_NAK))
+          answer = reply[used];
+        used++;
+      }
+      ftdi_uart_consume(used);
+    }
+    if (answer == JTAG_SOFTCORE_ACK)
+      return true;
+    stats->retries++;
+    ESP_LOGW("JTAG", "Frame at %08" PRIX32 " %s, sending it again", address, answer ? "NAKed" : "not answered");
   }
-  FILE *f = fopen(filename, "r");
+  ESP_LOGE("JTAG", "Frame at %08" PRIX32 " failed %d times", address, JTAG_SOFTCORE_FRAME_RETRIES);
+  return false;
+}
 
-  if(f == NULL)
+// Streams a softcore image to progloader_axi over channel B. The legacy
+// protocol sends address/data tuples packed into full-size bulk transfers
+// and relies on the FTDI to pace the link: it NAKs the bulk endpoint while
+// its TX buffer is full and holds off on CTS or a received XOFF, depending on
+// flow. With burst set the loader must be built with BURST_PROTOCOL = 1 and
+// its utx must reach the board's UART TX; the image then goes out in
+// acknowledged frames of JTAG_SOFTCORE_FRAME_WORDS words.
+bool jtag_program_softcore(char* filename, uint32_t baud_rate, flow_control_t flow, bool burst, struct jtag_program_stats* stats)
+{
+  static uint8_t board_words[ARTY_MAX_DEVICES][ARTY_TRANSFER_SIZE / 2];
+  uint8_t *words = board_words[arty_current_device()];
+  // A frame has to fit in one bulk transfer
+  uint32_t read_size = burst ? JTAG_SOFTCORE_FRAME_WORDS * 4 : sizeof(board_words[0]);
+  memset(stats, 0, sizeof(*stats));
+  softcore_image_t *img = softcore_image_open(filename);
+  if (img == NULL)
   {
-    return;
+    ESP_LOGE("JTAG", "Cannot open %s", filename);
+    return false;
   }
-  uint32_t address = 0;
-  uint32_t data = 0;
-  uint32_t counter = 0;
-  int byte_counter = 0;
-  int half_byte_counter = 0;
-  bool update_address = false;
-  size_t ret = 0;
-  uint8_t byte = 0;
-  ret = fread(&byte, sizeof(uint8_t), 1, f); 
-
-  while(ret == 1)
+  int64_t start = esp_timer_get_time();
+  ftdi_latency_mode_t latency = ftdi_get_latency_mode(FTDI_CHANNEL_B);
+  // Burst frames wait for a one-byte answer, which must not sit in the FTDI
+  ftdi_set_latency_mode(FTDI_CHANNEL_B, burst ? FTDI_LATENCY_INTERACTIVE : FTDI_LATENCY_BULK);
+  ftdi_uart_configure(8, baud_rate, flow, FTDI_UART_BASE_CLOCK);
+  bool ok = true;
+  struct softcore_segment seg;
+  while (ok && softcore_image_next_segment(img, &seg))
   {
-    if (byte == 64)
-    {
-      update_address = true;
-      address = 0;
-    }
-    else if (update_address && !isHex(byte))
+    uint32_t address = seg.address;
+    uint32_t n;
+    while (ok && (n = softcore_image_read(img, words, read_size) & ~3u) > 0)
     {
-      update_address = false;
-      half_byte_counter = 0;
-    }
-    if (isHex(byte))
-    {
-      if (update_address)
+      if (burst)
       {
-        byte = hex2dec(byte);
-        address = address + (byte << (28 - (4*half_byte_counter)));
-        half_byte_counter++;
+        ok = jtag_softcore_frame(address, words, n, baud_rate, stats);
+        address += n;
+        if (ok)
+          stats->bytes += n;
+        continue;
       }
-      else
+      usb_transfer_t *xfer = arty_transfer_get();
+      uint8_t *tuple = xfer->data_buffer;
+      for (uint32_t i = 0; i < n; i += 4, tuple += 8, address += 4)
       {
-        byte = hex2dec(byte);
-        if (byte_counter == 0 && half_byte_counter==0)
-	{
-          data = byte << 4;
-          half_byte_counter = 1;
-        }
-        else
-	{
-          uint32_t actual_byte = byte;
-          if (half_byte_counter == 0)
-	  {
-            actual_byte = actual_byte << 4;
-          }
-          for (int i=0;i<byte_counter;i++){
-            actual_byte = actual_byte << 8;
-          }
-          data = data + actual_byte;
-          byte_counter+= half_byte_counter;
-          half_byte_counter = half_byte_counter ? 0 : 1;
-          if (byte_counter == 4)
-	  {
-            byte_counter = 0;
-            uint8_t x1 = address&255;
-            uint8_t x2 = (address>>8)&255;
-            uint8_t x3 = (address>>16)&255;
-            uint8_t x4 = (address>>24)&255;
-            uint8_t x5 = data&255;
-            uint8_t x6 = (data>>8)&255;
-            uint8_t x7 = (data>>16)&255;
-            uint8_t x8 = (data>>24)&255;
-            ftdi_uart_write(&x1,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x2,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x3,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x4,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x5,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x6,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x7,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            ftdi_uart_write(&x8,1);
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            address+=4;
-            counter++;
-            if (counter == 2445)
-            {
-	      fclose(f);
-              return;
-            }
-          }
-        }
+        tuple[0] = address & 255;
+        tuple[1] = (address >> 8) & 255;
+        tuple[2] = (address >> 16) & 255;
+        tuple[3] = (address >> 24) & 255;
+        memcpy(tuple + 4, words + i, 4);
       }
+      arty_transfer_submit(xfer, 2*n, FT2232H_UART_WRITE_EP);
+      stats->bytes += n;
+    }
+    if (!softcore_image_segment_ok(img))
+    {
+      ESP_LOGE("JTAG", "Segment at %08" PRIX32 " of %s is corrupt", seg.address, filename);
+      ok = false;
     }
-    ret = fread(&byte, sizeof(uint8_t), 1, f); 
   }
-  fclose(f);
+  softcore_image_close(img);
+  arty_transfer_wait_idle();
+  // The FTDI may still be shifting out its TX buffer; in burst mode the last
+  // ACK shows it is empty
+  if (!burst)
+    vTaskDelay(pdMS_TO_TICKS((JTAG_SOFTCORE_FTDI_TX_BUFFER * 10 * 1000) / baud_rate) + 1);
+  ftdi_set_latency_mode(FTDI_CHANNEL_B, latency);
+  stats->time_us = esp_timer_get_time() - start;
+  return ok && (stats->bytes > 0);
 }
 
-void jtag_verify_softcore(char* filename)
+// Writes a softcore image straight into memory through the JTAG to AXI master
+// of jtag_chip_manager (AXI_MASTER = 1), one auto-incrementing write burst per
+// JTAG_AXI_BURST_WORDS, leaving channel B free for the application UART.
+bool jtag_load_softcore(char* filename, struct jtag_program_stats* stats)
 {
-  struct stat st;
-  if(stat(filename, &st)!=0)
+  static uint32_t board_words[ARTY_MAX_DEVICES][JTAG_AXI_BURST_WORDS];
+  uint32_t *words = board_words[arty_current_device()];
+  memset(stats, 0, sizeof(*stats));
+  softcore_image_t *img = softcore_image_open(filename);
+  if (img == NULL)
   {
-    ESP_LOGI("JTAG_VERIFY_SOFTCORE","Stat failed");
-    return;
+    ESP_LOGE("JTAG", "Cannot open %s", filename);
+    return false;
   }
-  FILE *f = fopen(filename, "r");
-  if(f == NULL)
+  int64_t start = esp_timer_get_time();
+  bool ok = true;
+  struct softcore_segment seg;
+  while (ok && softcore_image_next_segment(img, &seg))
   {
-    ESP_LOGI("JTAG_VERIFY_SOFTCORE","fopen Failed");
-    return;
+    uint32_t address = seg.address;
+    uint32_t n;
+    while (ok && (n = softcore_image_read(img, (uint8_t*)words, sizeof(board_words[0])) & ~3u) > 0)
+    {
+      ok = jtag_axi_write_burst(address, n / 4, words);
+      address += n;
+      stats->bytes += n;
+    }
+    if (ok && !softcore_image_segment_ok(img))
+    {
+      ESP_LOGE("JTAG", "Segment at %08" PRIX32 " of %s is corrupt", seg.address, filename);
+      ok = false;
+    }
   }
-  uint32_t address = 0;
-  uint32_t data = 0;
-  int byte_counter = 0;
-  int half_byte_counter = 0;
-  bool update_address = false;
-  size_t ret = 0;
-  uint8_t byte;  
-  ret = fread(&byte, sizeof(uint8_t), 1, f); 
-  
-  while(ret == 1)
-  {  
-    if (byte == 64)
+  softcore_image_close(img);
+  jtag_execute_queue();
+  stats->time_us = esp_timer_get_time() - start;
+  return ok && (stats->bytes > 0);
+}
+
+// Has the crc32_axi engine at base hash length bytes from address and
+// returns the result in crc. The start address, length and start bit are
+// consecutive registers, so the whole request is one write burst. The first
+// two read back as written, which tells a wrong base apart from a mismatch.
+bool jtag_crc32_range(uint32_t base, uint32_t address, uint32_t length, uint32_t* crc)
+{
+  if ((address | length) & 3)
+  {
+    ESP_LOGE("JTAG", "CRC of %" PRIu32 " bytes at %08" PRIX32 " is not whole words", length, address);
+    return false;
+  }
+  uint32_t request[3] = {address, length, JTAG_CRC32_START};
+  if (!jtag_axi_write_burst(base + JTAG_CRC32_ADDRESS_REG, 3, request))
+    return false;
+  int64_t start = esp_timer_get_time();
+  uint32_t reply[4] = {0, 0, 0, 0};
+  do
+  {
+    if (!jtag_axi_read_burst(base + JTAG_CRC32_ADDRESS_REG, 4, reply))
+      return false;
+    if ((reply[JTAG_CRC32_ADDRESS_REG / 4] != address) || (reply[JTAG_CRC32_LENGTH_REG / 4] != length))
     {
-      update_address = true;
-      address = 0;
+      ESP_LOGE("JTAG", "No CRC engine at %08" PRIX32, base);
+      return false;
     }
-    else if (update_address && !isHex(byte))
+    if (reply[JTAG_CRC32_STATUS_REG / 4] & JTAG_CRC32_ERROR)
     {
-      update_address = false;
-      half_byte_counter = 0;
+      ESP_LOGE("JTAG", "CRC engine refused %" PRIu32 " bytes at %08" PRIX32, length, address);
+      return false;
     }
-    if (isHex(byte)){
-      if (update_address){
-        byte = hex2dec(byte);
-        address = address + (byte << (28 - (4*half_byte_counter)));
-        half_byte_counter++;
-      }
-      else{
-        byte = hex2dec(byte);
-        if (byte_counter == 0 && half_byte_counter==0){
-          data = byte << 4;
-          half_byte_counter = 1;
-        }
-        else
-	{
-          uint32_t actual_byte = byte;
-          if (half_byte_counter == 0)
-	  {
-            actual_byte = actual_byte << 4;
-          }
-          for (int i=0;i<byte_counter;i++)
-	  {
-            actual_byte = actual_byte << 8;
-          }
-          data = data + actual_byte;
-          byte_counter+= half_byte_counter;
-          half_byte_counter = half_byte_counter ? 0 : 1;
-          if (byte_counter == 4)
-	  {
-            byte_counter = 0;
-            uint32_t rdata = jtag_axi_read(address);
-            // addback formatting, ESP-IDF 5.0+ complains about format specifiers 
-	    ESP_LOGI("JTAG", "%" PRIX32 ": %" PRIX32 " - %" PRIX32,address, data, rdata);
-//	    ESP_LOGI("JTAG", "%08X: %08X - %08X",address, data, rdata); 
-	    vTaskDelay(1 / portTICK_PERIOD_MS);
-            if (address >= 9616)
-	    {
-	      fclose(f);
-              return;
-	    }
-            address+=4;
-          }
-        }
+    if (reply[JTAG_CRC32_STATUS_REG / 4] & JTAG_CRC32_DONE)
+    {
+      *crc = reply[JTAG_CRC32_RESULT_REG / 4];
+      return true;
+    }
+  } while (esp_timer_get_time() - start < JTAG_CRC32_TIMEOUT_US);
+  ESP_LOGE("JTAG", "CRC of %" PRIu32 " bytes at %08" PRIX32 " timed out", length, address);
+  return false;
+}
+
+static void jtag_verify_block(struct jtag_verify_result* result, uint32_t crc_base, uint32_t address, uint32_t length, uint32_t expected)
+{
+  uint32_t actual = 0;
+  result->blocks++;
+  if (jtag_crc32_range(crc_base, address, length, &actual) && (actual == expected))
+    return;
+  ESP_LOGW("JTAG", "Verify mismatch at %08" PRIX32 "+%" PRIu32 ": expected %08" PRIX32 ", got %08" PRIX32, address, length, expected, actual);
+  if (result->bad_blocks == 0)
+    result->first_bad = address;
+  result->bad_blocks++;
+}
+
+// Compares the FPGA memory against a softcore image using the crc32_axi
+// engine at crc_base. With block_size 0 each
+// segment is checked in one CRC request against the CRC stored in the image;
+// otherwise segments are hashed in block_size pieces to narrow down where
+// the memory differs. The engine reads whole words, so block_size has to be
+// a multiple of 4 and a segment that is not counts as a bad block.
+bool jtag_verify_softcore(char* filename, uint32_t crc_base, uint32_t block_size, struct jtag_verify_result* result)
+{
+  static uint8_t board_buf[ARTY_MAX_DEVICES][JTAG_VERIFY_READ_SIZE];
+  uint8_t *buf = board_buf[arty_current_device()];
+  memset(result, 0, sizeof(*result));
+  if (block_size & 3)
+  {
+    ESP_LOGE("JTAG", "Verify block size %" PRIu32 " is not a multiple of 4", block_size);
+    return false;
+  }
+  softcore_image_t *img = softcore_image_open(filename);
+  if (img == NULL)
+  {
+    ESP_LOGE("JTAG", "Cannot open %s", filename);
+    return false;
+  }
+  bool ok = true;
+  struct softcore_segment seg;
+  while (ok && softcore_image_next_segment(img, &seg))
+  {
+    result->segments++;
+    result->bytes += seg.length;
+    if (block_size == 0 || block_size >= seg.length)
+    {
+      jtag_verify_block(result, crc_base, seg.address, seg.length, seg.crc);
+      continue;
+    }
+    for (uint32_t offset = 0; offset < seg.length; offset += block_size)
+    {
+      uint32_t len = (seg.length - offset < block_size) ? seg.length - offset : block_size;
+      uint32_t crc = 0;
+      for (uint32_t done = 0, n; done < len; done += n)
+      {
+        n = softcore_image_read(img, buf, (len - done < JTAG_VERIFY_READ_SIZE) ? len - done : JTAG_VERIFY_READ_SIZE);
+        if (n == 0)
+          break;
+        crc = esp_rom_crc32_le(crc, buf, n);
       }
+      jtag_verify_block(result, crc_base, seg.address + offset, len, crc);
+    }
+    if (!softcore_image_segment_ok(img))
+    {
+      ESP_LOGE("JTAG", "Segment at %08" PRIX32 " of %s is corrupt", seg.address, filename);
+      ok = false;
     }
-    ret = fread(&byte, sizeof(uint8_t), 1, f);     
   }
-  fclose(f);
+  softcore_image_close(img);
+  return ok && (result->blocks > 0) && (result->bad_blocks == 0);
 }
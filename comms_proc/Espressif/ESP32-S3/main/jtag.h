@@ -4,17 +4,158 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "ftdi.h"
+
+#define JTAG_QUEUE_SIZE 640
+#define JTAG_QUEUE_DATA_SIZE 8192
+#define JTAG_QUEUE_IN_FIELDS 256
+#define JTAG_IR_LENGTH 6
+#define JTAG_IR_BYPASS 0x3F
+#define JTAG_IR_USERCODE 0x08
+// USER4, the BSCANE2 chain used by jtag_chip_manager
+#define JTAG_USER_IR 0x23
+
+// Command byte (bits 103:96) of the 104-bit user register word. Read
+// addresses go in bits 31:0, write addresses in 63:32 and write data in 95:64.
+#define JTAG_AXI_READ_ADDRESS_CMD (1 << 0)
+#define JTAG_AXI_WRITE_ADDRESS_CMD (1 << 1)
+#define JTAG_AXI_READ_DATA_CMD (1 << 2)
+#define JTAG_AXI_WRITE_DATA_CMD (1 << 3)
+#define JTAG_LOAD_JTAG_READ_DATA_CMD (1 << 4)
+#define JTAG_CONTROL_WRITE_CMD (1 << 5)
+// Use and advance the bridge's address counter instead of the word's address
+#define JTAG_AXI_AUTO_INCREMENT_CMD (1 << 6)
+
+// Status half-word returned in bits 47:32 of a loaded read word
+#define JTAG_AXI_STATUS_WRITE_BUSY (1 << 0)
+#define JTAG_AXI_STATUS_READ_BUSY (1 << 1)
+#define JTAG_AXI_STATUS_READ_VALID (1 << 2)
+#define JTAG_AXI_STATUS_ERROR (1 << 3)
+
+#define JTAG_AXI_BURST_WORDS 256
+// RUN-TEST/IDLE cycles after every bridge command, giving the AXI side time
+// to complete across the clock crossing before the next capture
+#define JTAG_AXI_IDLE_CYCLES 8
+// crc32_axi register offsets. Its base depends on where the system's
+// address map puts it, so callers pass it in.
+#define JTAG_CRC32_ADDRESS_REG 0x0
+#define JTAG_CRC32_LENGTH_REG 0x4
+#define JTAG_CRC32_STATUS_REG 0x8
+#define JTAG_CRC32_RESULT_REG 0xC
+#define JTAG_CRC32_START (1 << 0)
+#define JTAG_CRC32_DONE (1 << 1)
+// Set instead of DONE for an address or length that is not whole words
+#define JTAG_CRC32_ERROR (1 << 2)
+#define JTAG_CRC32_TIMEOUT_US 1000000
+#define JTAG_SOFTCORE_BAUD_RATE 921600
+#define JTAG_SOFTCORE_FLOW_CONTROL XON_XOFF
+// Channel B transmit FIFO of the FT2232H
+#define JTAG_SOFTCORE_FTDI_TX_BUFFER 4096
+// progloader_axi frames with BURST_PROTOCOL = 1: sync byte, address (4),
+// word count (2), words, CRC-32 (4), answered with ACK or NAK
+#define JTAG_SOFTCORE_SYNC 0xA5
+#define JTAG_SOFTCORE_ACK 0x06
+#define JTAG_SOFTCORE_NAK 0x15
+#define JTAG_SOFTCORE_FRAME_OVERHEAD 11
+#define JTAG_SOFTCORE_FRAME_WORDS 256
+#define JTAG_SOFTCORE_FRAME_RETRIES 8
+// Allowed on top of the frame's time on the wire
+#define JTAG_SOFTCORE_ACK_TIMEOUT_MS 50
+#define JTAG_VERIFY_READ_SIZE 1024
+#define JTAG_CALIBRATE_REF_FREQUENCY 1000000
+#define JTAG_CALIBRATE_PASSES 8
+#define JTAG_PROGRAM_CHUNK_SIZE 16384
+#define JTAG_PROGRAM_BUFFER_COUNT 3
+#define JTAG_PROGRAM_READER_CORE 0
+#define JTAG_PROGRAM_WRITER_CORE 1
+
+struct jtag_program_chunk {
+	uint8_t *buf;
+	uint32_t len;
+};
+
+// Shared between jtag_program() and its reader and writer tasks
+struct jtag_program_pipe {
+	struct bitstream *bs;
+	uint32_t written;
+	QueueHandle_t free_queue;
+	QueueHandle_t full_queue;
+	SemaphoreHandle_t done;
+	// Board the writer drives, see arty_select_device()
+	int device;
+};
+
+struct jtag_program_stats {
+	uint32_t bytes;
+	int64_t time_us;
+	// Frames sent again after a NAK or no answer, burst loads only
+	uint32_t retries;
+};
+
+struct jtag_verify_result {
+	uint32_t bytes;
+	uint32_t segments;
+	uint32_t blocks;
+	uint32_t bad_blocks;
+	uint32_t first_bad;
+};
+
+// One field of a scan. out_value may be NULL to shift zeros; in_value, if
+// set, must stay valid until jtag_execute_queue() has returned.
+struct scan_field {
+	uint32_t num_bits;
+	const uint8_t *out_value;
+	uint8_t *in_value;
+};
+
+// Read-back bits of a queued scan waiting to be copied to the caller
+struct jtag_queue_in_field {
+	uint8_t *in_value;
+	uint8_t *data;
+	uint32_t data_offset;
+	uint32_t num_bits;
+};
+
+struct jtag_queue {
+	struct jtag_command commands[JTAG_QUEUE_SIZE];
+	uint16_t count;
+	uint8_t data[JTAG_QUEUE_DATA_SIZE];
+	uint32_t data_count;
+	struct jtag_queue_in_field in[JTAG_QUEUE_IN_FIELDS];
+	uint16_t in_count;
+};
+
+// Queue API: commands are only recorded until jtag_execute_queue(), which
+// sends them as a single MPSSE stream and fills in all read-back buffers.
+// The helpers below queue as well, except those returning read-back data.
+void jtag_add_ir_scan(const struct scan_field *field, tap_state_t state);
+void jtag_add_ir_scan_fields(int num_fields, const struct scan_field *fields, tap_state_t state);
+void jtag_add_dr_scan(int num_fields, const struct scan_field *fields, tap_state_t state);
+void jtag_add_statemove(tap_state_t state);
+void jtag_add_runtest(uint32_t num_cycles, tap_state_t state);
+void jtag_execute_queue();
+
 void jtag_uart_tx_test();
 void jtag_uart_loopback_test();
 uint32_t jtag_axi_read(uint32_t address);
+bool jtag_axi_read_burst(uint32_t address, uint32_t n, uint32_t* buf);
+bool jtag_axi_write_burst(uint32_t address, uint32_t n, const uint32_t* buf);
 uint32_t jtag_axi_status();
 void jtag_axi_write_noirscan(uint32_t address, uint32_t data);
 void jtag_control_write(uint32_t control_0_31, uint32_t control_32_63, uint32_t control_64_95);
 void jtag_axi_write(uint32_t address, uint32_t data);
-void jtag_program(char* filename);
-void jtag_program_softcore(char* filename);
-void jtag_verify_softcore(char* filename);
+bool jtag_program(char* filename, struct jtag_program_stats* stats);
+uint32_t jtag_calibrate_tck();
+bool jtag_read_config_state(uint32_t* usercode, bool* done);
+bool jtag_program_softcore(char* filename, uint32_t baud_rate, flow_control_t flow, bool burst, struct jtag_program_stats* stats);
+bool jtag_load_softcore(char* filename, struct jtag_program_stats* stats);
+bool jtag_crc32_range(uint32_t base, uint32_t address, uint32_t length, uint32_t* crc);
+bool jtag_verify_softcore(char* filename, uint32_t crc_base, uint32_t block_size, struct jtag_verify_result* result);
 void jtag_drscan_bytes(uint8_t* wbuf, uint16_t len);
 void jtag_drscan_bytes_hold(uint8_t* wbuf, uint16_t len);
 void jtag_drscan_bytes_read(uint8_t* wbuf, uint8_t* rbuf, uint16_t len);
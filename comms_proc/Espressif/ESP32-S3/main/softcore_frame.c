@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "frozen.h"
+#include <mqtt_client.h>
+#include "appmqtt.h"
+#include "appstate.h"
+#include "softcore_frame.h"
+
+static const char *TAG = "softcore_frame";
+
+static uint16_t softcore_frame_crc16(uint16_t crc, const uint8_t *data, int len)
+{
+  static const uint16_t table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+  };
+  for (int i = 0; i < len; i++)
+  {
+    crc = (crc << 4) ^ table[((crc >> 12) ^ (data[i] >> 4)) & 0x0f];
+    crc = (crc << 4) ^ table[((crc >> 12) ^ data[i]) & 0x0f];
+  }
+  return crc;
+}
+
+// Undoes the XOR with the delimiter and the COBS encoding in place, which
+// works because the decoded data never runs ahead of the encoded data.
+// Returns the decoded length, -1 if the encoding is broken.
+static int softcore_frame_decode(uint8_t *buf, int len)
+{
+  int in = 0;
+  int out = 0;
+  while (in < len)
+  {
+    uint8_t code = buf[in++] ^ SOFTCORE_FRAME_DELIMITER;
+    if ((code == 0) || (in + code - 1 > len))
+      return -1;
+    for (int i = 1; i < code; i++)
+      buf[out++] = buf[in++] ^ SOFTCORE_FRAME_DELIMITER;
+    if ((code < 0xFF) && (in < len))
+      buf[out++] = 0;
+  }
+  return out;
+}
+
+static void softcore_frame_publish(struct softcore_frame_decoder *d, const char *topic, char *data, int len)
+{
+  char *outTopic = NULL;
+  int topicLength = d->board ? asprintf(&outTopic, "/%s/%s/%s", getHostname(), d->board, topic) :
+                               asprintf(&outTopic, "/%s/%s", getHostname(), topic);
+  if (topicLength <= 0)
+    return;
+  if (len < 0)
+    appmqtt_send_msg(outTopic, data);
+  else
+    appmqtt_send_msg_n(outTopic, data, len);
+  free(outTopic);
+}
+
+// The payload is published straight from the decoded frame
+static void softcore_frame_binary(struct softcore_frame_decoder *d, uint8_t *frame, int len)
+{
+  int n = softcore_frame_decode(frame, len);
+  if ((n < SOFTCORE_FRAME_OVERHEAD) || (n != SOFTCORE_FRAME_OVERHEAD + (frame[1] | (frame[2] << 8))))
+  {
+    d->stats.malformed++;
+    return;
+  }
+  if (softcore_frame_crc16(0xFFFF, frame, n - 2) != (frame[n - 2] | (frame[n - 1] << 8)))
+  {
+    d->stats.crcErrors++;
+    return;
+  }
+  uint8_t topicId = frame[0];
+  uint8_t *payload = frame + 3;
+  int payloadLength = n - SOFTCORE_FRAME_OVERHEAD;
+  d->stats.binaryFrames++;
+  d->stats.payloadBytes += payloadLength;
+  if (topicId == SOFTCORE_FRAME_TOPIC_REGISTER)
+  {
+    if ((payloadLength > 1) && (payload[0] != SOFTCORE_FRAME_TOPIC_REGISTER))
+    {
+      free(d->topics[payload[0]]);
+      d->topics[payload[0]] = strndup((char *)payload + 1, payloadLength - 1);
+    }
+    return;
+  }
+  if (!isMQTTConnected())
+    return;
+  char number[4];
+  const char *topic = d->topics[topicId];
+  if (topic == NULL)
+  {
+    snprintf(number, sizeof(number), "%u", topicId);
+    topic = number;
+  }
+  softcore_frame_publish(d, topic, (char *)payload, payloadLength);
+}
+
+static void softcore_frame_json(struct softcore_frame_decoder *d, uint8_t *data, int len)
+{
+  char *line = (char *)data;
+  char *message = NULL;
+  char *topic = NULL;
+
+  // Keep printable characters and the terminating 0x0D, as before
+  int lineLength = 0;
+  for (int i = 0; i < len; i++)
+  {
+    unsigned char c = data[i];
+    if ((c == SOFTCORE_FRAME_DELIMITER) || ((c >= 32) && (c <= 126)))
+      line[lineLength++] = c;
+  }
+  line[lineLength] = '\0';
+  if (json_scanf(line, lineLength, "{topic: %Q, message: %Q}", &topic, &message) == 2)
+  {
+    if (message != NULL)
+      d->stats.payloadBytes += strlen(message);
+    if ((topic != NULL) && isMQTTConnected())
+      softcore_frame_publish(d, topic, message, -1);
+  }
+  else
+  {
+    d->stats.malformed++;
+    ESP_LOGI(TAG, "Received 0x0D but JSON malformed");
+  }
+  free(message);
+  free(topic);
+}
+
+// Messages starting with SOFTCORE_FRAME_MARKER are binary, anything else is
+// a JSON line
+void softcore_frame_process(struct softcore_frame_decoder *d, uint8_t *msg, int len)
+{
+  int start = 0;
+  d->stats.frames++;
+  // Line endings printed as "\n\r" leave the '\n' in front of the next message
+  while ((start < len) && ((msg[start] == '\n') || (msg[start] == 0)))
+    start++;
+  if ((start < len) && (msg[start] == SOFTCORE_FRAME_MARKER))
+    softcore_frame_binary(d, msg + start + 1, len - start - 2);
+  else
+    softcore_frame_json(d, msg + start, len - start);
+}
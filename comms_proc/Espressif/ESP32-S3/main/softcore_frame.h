@@ -0,0 +1,48 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Messages from the softcore, see the examples' utils.h. Each ends in
+// SOFTCORE_FRAME_DELIMITER and is either a JSON line
+//   {"topic": "<TOPIC>", "message": "<MESSAGE>"}
+// or a binary frame from frame_send():
+//   SOFTCORE_FRAME_MARKER, COBS(topic id, u16 length, payload, CRC16) ^ delimiter
+#define SOFTCORE_FRAME_DELIMITER 0x0D
+#define SOFTCORE_FRAME_MARKER 0x01
+// Topic id, 16-bit length and CRC16 around the payload
+#define SOFTCORE_FRAME_OVERHEAD 5
+#define SOFTCORE_FRAME_TOPIC_REGISTER 0
+#define SOFTCORE_FRAME_TOPICS 256
+
+struct softcore_frame_stats {
+  // Messages handed to softcore_frame_process(), valid or not
+  uint32_t frames;
+  uint32_t binaryFrames;
+  // Message or payload bytes carried by valid messages, for goodput
+  uint64_t payloadBytes;
+  uint32_t malformed;
+  uint32_t crcErrors;
+};
+
+// One source of messages: the comms UART, or channel B of one board
+struct softcore_frame_decoder {
+  // Serial of the board whose channel B this is; NULL for the comms UART
+  const char *board;
+  // Names given to topic ids with SOFTCORE_FRAME_TOPIC_REGISTER frames
+  char *topics[SOFTCORE_FRAME_TOPICS];
+  struct softcore_frame_stats stats;
+};
+
+// Publishes one message, delimiter included, to /BOARDNAME/<TOPIC>, or to
+// /BOARDNAME/<serial>/<TOPIC> for channel B. The message is decoded in
+// place, and msg must have room for one byte more than len.
+void softcore_frame_process(struct softcore_frame_decoder *d, uint8_t *msg, int len);
+
+#ifdef __cplusplus
+}
+#endif
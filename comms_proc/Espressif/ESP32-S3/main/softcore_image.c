@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include "esp_rom_crc.h"
+#include "softcore_image.h"
+
+static const char *TAG = "softcore_image";
+
+struct softcore_image {
+  FILE *f;
+  uint16_t segments_left;
+  uint32_t bytes_left;
+  uint32_t crc;
+  struct softcore_segment seg;
+};
+
+static uint32_t le32(const uint8_t *b)
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+softcore_image_t *softcore_image_open(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+  uint8_t hdr[8];
+  if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || le32(hdr) != SOFTCORE_IMAGE_MAGIC || \
+      (hdr[4] | (hdr[5] << 8)) != SOFTCORE_IMAGE_VERSION)
+  {
+    ESP_LOGE(TAG, "%s is not a softcore image", filename);
+    fclose(f);
+    return NULL;
+  }
+  softcore_image_t *img = calloc(1, sizeof(softcore_image_t));
+  if (img == NULL)
+  {
+    fclose(f);
+    return NULL;
+  }
+  img->f = f;
+  img->segments_left = hdr[6] | (hdr[7] << 8);
+  return img;
+}
+
+bool softcore_image_next_segment(softcore_image_t *img, struct softcore_segment *seg)
+{
+  if (img->bytes_left && fseek(img->f, img->bytes_left, SEEK_CUR) != 0)
+    return false;
+  img->bytes_left = 0;
+  if (img->segments_left == 0)
+    return false;
+  uint8_t hdr[12];
+  if (fread(hdr, 1, sizeof(hdr), img->f) != sizeof(hdr))
+  {
+    ESP_LOGE(TAG, "Truncated segment header");
+    return false;
+  }
+  img->segments_left--;
+  img->seg.address = le32(hdr);
+  img->seg.length = le32(hdr + 4);
+  img->seg.crc = le32(hdr + 8);
+  img->bytes_left = img->seg.length;
+  img->crc = 0;
+  *seg = img->seg;
+  return true;
+}
+
+uint32_t softcore_image_read(softcore_image_t *img, uint8_t *buf, uint32_t len)
+{
+  if (len > img->bytes_left)
+    len = img->bytes_left;
+  uint32_t n = fread(buf, 1, len, img->f);
+  img->bytes_left -= n;
+  img->crc = esp_rom_crc32_le(img->crc, buf, n);
+  if (n < len)
+  {
+    ESP_LOGE(TAG, "Truncated segment at %08" PRIX32, img->seg.address);
+    img->bytes_left = 0;
+    img->crc = ~img->seg.crc;
+  }
+  return n;
+}
+
+bool softcore_image_segment_ok(softcore_image_t *img)
+{
+  return (img->bytes_left == 0) && (img->crc == img->seg.crc);
+}
+
+void softcore_image_close(softcore_image_t *img)
+{
+  if (img == NULL)
+    return;
+  fclose(img->f);
+  free(img);
+}
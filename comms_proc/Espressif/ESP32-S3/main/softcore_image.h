@@ -0,0 +1,37 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Image produced by firmware_image.py from the softcore's verilog hex file:
+// an 8-byte header ("SCIM", u16 version, u16 segment count), then for each
+// segment a 12-byte header (load address, length, CRC-32 of the payload)
+// followed by the payload. Everything is little-endian.
+#define SOFTCORE_IMAGE_MAGIC 0x4D494353
+#define SOFTCORE_IMAGE_VERSION 1
+
+struct softcore_segment {
+	uint32_t address;
+	uint32_t length;
+	uint32_t crc;
+};
+
+typedef struct softcore_image softcore_image_t;
+
+softcore_image_t *softcore_image_open(const char *filename);
+// Moves to the next segment, skipping whatever is left of the current one
+bool softcore_image_next_segment(softcore_image_t *img, struct softcore_segment *seg);
+// Reads payload of the current segment; returns 0 at its end
+uint32_t softcore_image_read(softcore_image_t *img, uint8_t *buf, uint32_t len);
+// True once the current segment has been read in full and matched its CRC
+bool softcore_image_segment_ok(softcore_image_t *img);
+void softcore_image_close(softcore_image_t *img);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,949 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "jtag.h"
+#include "svf.h"
+
+// Serial Vector Format and Xilinx's binary XSVF. Vectors are recorded as
+// file offsets while a statement is parsed and decoded only when shifted.
+// Both formats give a vector MSB first, so it is read from its end to get
+// the bits in shift order.
+
+#define XCOMPLETE    0x00
+#define XTDOMASK     0x01
+#define XSIR         0x02
+#define XSDR         0x03
+#define XRUNTEST     0x04
+#define XREPEAT      0x07
+#define XSDRSIZE     0x08
+#define XSDRTDO      0x09
+#define XSETSDRMASKS 0x0a
+#define XSDRINC      0x0b
+#define XSDRB        0x0c
+#define XSDRC        0x0d
+#define XSDRE        0x0e
+#define XSDRTDOB     0x0f
+#define XSDRTDOC     0x10
+#define XSDRTDOE     0x11
+#define XSTATE       0x12
+#define XENDIR       0x13
+#define XENDDR       0x14
+#define XSIR2        0x15
+#define XCOMMENT     0x16
+#define XWAIT        0x17
+
+#define SVF_TOK_WORD  0
+#define SVF_TOK_HEX   1
+#define SVF_TOK_END   2
+#define SVF_TOK_EOF   3
+#define SVF_TOK_ERROR 4
+
+static const char *TAG = "svf";
+
+// In XSVF order, so an XSTATE argument indexes it directly
+static const struct {
+  const char *name;
+  tap_state_t state;
+} svf_states[] = {
+  {"RESET", TAP_RESET},
+  {"IDLE", TAP_IDLE},
+  {"DRSELECT", TAP_DRSELECT},
+  {"DRCAPTURE", TAP_DRCAPTURE},
+  {"DRSHIFT", TAP_DRSHIFT},
+  {"DREXIT1", TAP_DREXIT1},
+  {"DRPAUSE", TAP_DRPAUSE},
+  {"DREXIT2", TAP_DREXIT2},
+  {"DRUPDATE", TAP_DRUPDATE},
+  {"IRSELECT", TAP_IRSELECT},
+  {"IRCAPTURE", TAP_IRCAPTURE},
+  {"IRSHIFT", TAP_IRSHIFT},
+  {"IREXIT1", TAP_IREXIT1},
+  {"IRPAUSE", TAP_IRPAUSE},
+  {"IREXIT2", TAP_IREXIT2},
+  {"IRUPDATE", TAP_IRUPDATE},
+};
+
+// Where a vector sits in the file: hex digits between parentheses, or raw
+// bytes for XSVF. start is -1 while the vector is not given.
+struct svf_vector {
+  long start;
+  long end;
+  bool binary;
+};
+
+struct svf_reader {
+  FILE *f;
+  long start;
+  long pos;
+  bool binary;
+  // Given once the vector is used up, so a missing MASK compares all bits
+  uint8_t fill;
+  uint8_t buf[SVF_READ_SIZE];
+  uint32_t avail;
+};
+
+// TDI and MASK carry over to the next scan of the same length; TDO applies
+// to a single scan
+struct svf_scan_para {
+  uint32_t len;
+  struct svf_vector tdi;
+  struct svf_vector tdo;
+  struct svf_vector mask;
+};
+
+// HDR, HIR, TDR and TIR, decoded when they are set
+struct svf_fixed {
+  struct svf_scan_para para;
+  uint8_t tdi[SVF_MAX_FIXED_BITS / 8];
+};
+
+// The captured bytes are followed by the expected and mask bytes
+struct svf_check {
+  uint32_t at;
+  uint32_t num_bits;
+  uint8_t *captured;
+};
+
+struct svf_player {
+  FILE *f;
+  struct svf_result *result;
+  uint32_t line;
+  // SVF line or XSVF command number being executed
+  uint32_t at;
+  char tok[SVF_TOKEN_SIZE];
+  struct svf_vector hex;
+  struct svf_scan_para sdr;
+  struct svf_scan_para sir;
+  struct svf_fixed hdr;
+  struct svf_fixed hir;
+  struct svf_fixed tdr;
+  struct svf_fixed tir;
+  tap_state_t enddr;
+  tap_state_t endir;
+  tap_state_t run_state;
+  tap_state_t run_end_state;
+  // XSVF only
+  uint32_t xsdr_size;
+  uint32_t runtest_us;
+  uint8_t repeat;
+  struct svf_reader tdi_reader;
+  struct svf_reader tdo_reader;
+  struct svf_reader mask_reader;
+  uint8_t chunk[SVF_CHUNK_BITS / 8];
+  struct svf_check checks[SVF_MAX_CHECKS];
+  uint32_t check_count;
+  uint8_t arena[SVF_CHECK_ARENA_SIZE];
+  uint32_t arena_used;
+  // TCK before playback, put back afterwards since FREQUENCY may change it
+  uint32_t tck;
+};
+
+static bool svf_stable(tap_state_t state)
+{
+  return state == TAP_RESET || state == TAP_IDLE || state == TAP_DRPAUSE || state == TAP_IRPAUSE;
+}
+
+static tap_state_t svf_state(const char *name)
+{
+  for (int i = 0; i < sizeof(svf_states) / sizeof(svf_states[0]); i++)
+    if (strcmp(svf_states[i].name, name) == 0)
+      return svf_states[i].state;
+  return TAP_INVALID;
+}
+
+static void svf_reader_open(struct svf_reader *r, FILE *f, const struct svf_vector *v, uint8_t fill)
+{
+  r->f = f;
+  r->avail = 0;
+  r->binary = v->binary;
+  if (v->start < 0)
+  {
+    r->start = r->pos = 0;
+    r->fill = fill;
+  }
+  else
+  {
+    r->start = v->start;
+    r->pos = v->end;
+    r->fill = 0;
+  }
+}
+
+// Next byte towards the start of the vector, -1 once it is used up
+static int svf_reader_getc(struct svf_reader *r)
+{
+  if (r->avail == 0)
+  {
+    uint32_t n = r->pos - r->start < SVF_READ_SIZE ? r->pos - r->start : SVF_READ_SIZE;
+    if (n == 0)
+      return -1;
+    r->pos -= n;
+    if (fseek(r->f, r->pos, SEEK_SET) != 0 || fread(r->buf, 1, n, r->f) != n)
+    {
+      ESP_LOGE(TAG, "Read of vector data at %ld failed", r->pos);
+      r->pos = r->start;
+      return -1;
+    }
+    r->avail = n;
+  }
+  return r->buf[--r->avail];
+}
+
+static uint8_t svf_reader_nibble(struct svf_reader *r)
+{
+  int c;
+  while ((c = svf_reader_getc(r)) >= 0)
+  {
+    if (isdigit(c))
+      return c - '0';
+    if (isxdigit(c))
+      return toupper(c) - 'A' + 10;
+  }
+  return r->fill & 0x0f;
+}
+
+// Decodes the next num_bits of the vector into dst, LSB first. Only the
+// last call for a vector may ask for a number of bits not divisible by 8.
+static void svf_reader_read(struct svf_reader *r, uint8_t *dst, uint32_t num_bits)
+{
+  for (uint32_t i = 0; i < num_bits; i += 8)
+  {
+    uint8_t b;
+    if (r->binary)
+    {
+      int c = svf_reader_getc(r);
+      b = c < 0 ? r->fill : c;
+    }
+    else
+    {
+      b = svf_reader_nibble(r);
+      if (num_bits - i > 4)
+        b |= svf_reader_nibble(r) << 4;
+    }
+    dst[i / 8] = b;
+  }
+  if (num_bits % 8)
+    dst[num_bits / 8] &= (1 << (num_bits % 8)) - 1;
+}
+
+// Runs every scan queued so far and compares the captures taken since the
+// last flush. All mismatches are counted; false if there was any.
+static bool svf_check_flush(struct svf_player *p)
+{
+  bool ok = true;
+  jtag_execute_queue();
+  for (uint32_t i = 0; i < p->check_count; i++)
+  {
+    struct svf_check *check = &p->checks[i];
+    uint32_t nbytes = DIV_ROUND_UP(check->num_bits, 8);
+    const uint8_t *captured = check->captured;
+    const uint8_t *expected = captured + nbytes;
+    const uint8_t *mask = expected + nbytes;
+    uint32_t j = 0;
+    while (j < nbytes && ((captured[j] ^ expected[j]) & mask[j]) == 0)
+      j++;
+    p->result->checks++;
+    if (j < nbytes)
+    {
+      if (p->result->failed_checks++ == 0)
+        p->result->fail_at = check->at;
+      ESP_LOGE(TAG, "TDO mismatch at %" PRIu32 ", byte %" PRIu32 ": got %02x, expected %02x mask %02x",
+               check->at, j, captured[j], expected[j], mask[j]);
+      ok = false;
+    }
+  }
+  p->check_count = 0;
+  p->arena_used = 0;
+  return ok;
+}
+
+// Room for the capture of a num_bits scan and what it is compared with;
+// NULL if making room meant a flush that found a mismatch
+static uint8_t *svf_check_add(struct svf_player *p, uint32_t num_bits)
+{
+  uint32_t size = 3 * DIV_ROUND_UP(num_bits, 8);
+  if (p->check_count == SVF_MAX_CHECKS || p->arena_used + size > SVF_CHECK_ARENA_SIZE)
+  {
+    if (!svf_check_flush(p))
+      return NULL;
+  }
+  struct svf_check *check = &p->checks[p->check_count++];
+  check->at = p->at;
+  check->num_bits = num_bits;
+  check->captured = &p->arena[p->arena_used];
+  p->arena_used += size;
+  return check->captured;
+}
+
+static void svf_fail(struct svf_player *p)
+{
+  if (p->result->fail_at == 0)
+    p->result->fail_at = p->at;
+}
+
+// Shifts a whole SDR or SIR with its header and trailer, SVF_CHUNK_BITS at
+// a time. A scan with TDO queues its checks rather than waiting for them.
+static bool svf_scan(struct svf_player *p, bool ir, const struct svf_scan_para *para, tap_state_t end)
+{
+  const struct svf_fixed *head = ir ? &p->hir : &p->hdr;
+  const struct svf_fixed *trail = ir ? &p->tir : &p->tdr;
+  tap_state_t shift = ir ? TAP_IRSHIFT : TAP_DRSHIFT;
+  bool compare = para->tdo.start >= 0;
+  long resume = ftell(p->f);
+  bool ok = true;
+
+  svf_reader_open(&p->tdi_reader, p->f, &para->tdi, 0);
+  if (compare)
+  {
+    svf_reader_open(&p->tdo_reader, p->f, &para->tdo, 0);
+    svf_reader_open(&p->mask_reader, p->f, &para->mask, 0xff);
+  }
+  uint32_t done = 0;
+  do
+  {
+    uint32_t n = para->len - done < SVF_CHUNK_BITS ? para->len - done : SVF_CHUNK_BITS;
+    bool last = done + n == para->len;
+    struct scan_field fields[3];
+    int num_fields = 0;
+    if (done == 0 && head->para.len)
+      fields[num_fields++] = (struct scan_field){head->para.len, head->tdi, NULL};
+    svf_reader_read(&p->tdi_reader, p->chunk, n);
+    uint8_t *captured = NULL;
+    if (compare && n)
+    {
+      captured = svf_check_add(p, n);
+      if (captured == NULL)
+      {
+        ok = false;
+        break;
+      }
+      uint32_t nbytes = DIV_ROUND_UP(n, 8);
+      svf_reader_read(&p->tdo_reader, captured + nbytes, n);
+      svf_reader_read(&p->mask_reader, captured + 2 * nbytes, n);
+    }
+    fields[num_fields++] = (struct scan_field){n, p->chunk, captured};
+    if (last && trail->para.len)
+      fields[num_fields++] = (struct scan_field){trail->para.len, trail->tdi, NULL};
+    if (ir)
+      jtag_add_ir_scan_fields(num_fields, fields, last ? end : shift);
+    else
+      jtag_add_dr_scan(num_fields, fields, last ? end : shift);
+    p->result->bits += n;
+    done += n;
+  } while (done < para->len);
+  fseek(p->f, resume, SEEK_SET);
+  return ok;
+}
+
+// Clocks cycles TCK in IDLE, then waits there until at least us have passed
+static bool svf_idle(struct svf_player *p, uint32_t cycles, uint64_t us, tap_state_t end)
+{
+  jtag_add_runtest(cycles, TAP_IDLE);
+  uint64_t clocked_us = (uint64_t)cycles * 1000000 / ftdi_mpsse_get_frequency();
+  if (us > clocked_us)
+  {
+    if (!svf_check_flush(p))
+      return false;
+    vTaskDelay(pdMS_TO_TICKS(DIV_ROUND_UP(us - clocked_us, 1000)) + 1);
+  }
+  jtag_add_statemove(end);
+  return true;
+}
+
+// Waits in a state other than IDLE, where TCK cannot run without leaving it
+static bool svf_wait_in(struct svf_player *p, tap_state_t state, uint64_t us, tap_state_t end)
+{
+  jtag_add_statemove(state);
+  if (!svf_check_flush(p))
+    return false;
+  vTaskDelay(pdMS_TO_TICKS(DIV_ROUND_UP(us, 1000)) + 1);
+  jtag_add_statemove(end);
+  return true;
+}
+
+// Characters of the file with comments dropped, counting lines
+static int svf_getc(struct svf_player *p)
+{
+  int c = fgetc(p->f);
+  while (c == '!' || c == '/')
+  {
+    if (c == '/')
+    {
+      int next = fgetc(p->f);
+      if (next != '/')
+      {
+        ungetc(next, p->f);
+        return c;
+      }
+    }
+    while (c != '\n' && c != EOF)
+      c = fgetc(p->f);
+  }
+  if (c == '\n')
+    p->line++;
+  return c;
+}
+
+static int svf_next_token(struct svf_player *p)
+{
+  int c;
+  do
+    c = svf_getc(p);
+  while (c != EOF && isspace(c));
+  if (c == EOF)
+    return SVF_TOK_EOF;
+  if (c == ';')
+    return SVF_TOK_END;
+  if (c == '(')
+  {
+    p->hex.start = ftell(p->f);
+    p->hex.binary = false;
+    while ((c = fgetc(p->f)) != ')')
+    {
+      if (c == '\n')
+        p->line++;
+      else if (c == EOF || !(isxdigit(c) || isspace(c)))
+        return SVF_TOK_ERROR;
+    }
+    p->hex.end = ftell(p->f) - 1;
+    return SVF_TOK_HEX;
+  }
+  int n = 0;
+  while (c != EOF && !isspace(c) && c != ';' && c != '(' && c != ')')
+  {
+    if (n < SVF_TOKEN_SIZE - 1)
+      p->tok[n++] = toupper(c);
+    c = svf_getc(p);
+  }
+  p->tok[n] = 0;
+  // Leave the terminator for the next token, and its line uncounted
+  if (c != EOF)
+  {
+    if (c == '\n')
+      p->line--;
+    ungetc(c, p->f);
+  }
+  return SVF_TOK_WORD;
+}
+
+static bool svf_parse_number(const char *tok, double *val)
+{
+  char *end;
+  *val = strtod(tok, &end);
+  return end != tok && *end == 0 && *val >= 0;
+}
+
+// "length [TDI (..)] [TDO (..)] [MASK (..)] [SMASK (..)] ;"
+static bool svf_parse_scan(struct svf_player *p, struct svf_scan_para *para)
+{
+  double len;
+  if (svf_next_token(p) != SVF_TOK_WORD || !svf_parse_number(p->tok, &len))
+    return false;
+  struct svf_scan_para next = *para;
+  if ((uint32_t)len != para->len)
+  {
+    next.tdi.start = -1;
+    next.mask.start = -1;
+  }
+  next.len = len;
+  next.tdo.start = -1;
+  int t;
+  while ((t = svf_next_token(p)) == SVF_TOK_WORD)
+  {
+    struct svf_vector *v = NULL;
+    if (strcmp(p->tok, "TDI") == 0)
+      v = &next.tdi;
+    else if (strcmp(p->tok, "TDO") == 0)
+      v = &next.tdo;
+    else if (strcmp(p->tok, "MASK") == 0)
+      v = &next.mask;
+    else if (strcmp(p->tok, "SMASK") != 0)
+      return false;
+    if (svf_next_token(p) != SVF_TOK_HEX)
+      return false;
+    if (v)
+      *v = p->hex;
+  }
+  if (t != SVF_TOK_END)
+    return false;
+  if (next.len && next.tdi.start < 0)
+  {
+    ESP_LOGE(TAG, "Line %" PRIu32 ": TDI is required when the length changes", p->at);
+    return false;
+  }
+  *para = next;
+  return true;
+}
+
+static bool svf_parse_fixed(struct svf_player *p, struct svf_fixed *fixed)
+{
+  if (!svf_parse_scan(p, &fixed->para))
+    return false;
+  if (fixed->para.len > SVF_MAX_FIXED_BITS)
+  {
+    ESP_LOGE(TAG, "Line %" PRIu32 ": header or trailer longer than %d bits", p->at, SVF_MAX_FIXED_BITS);
+    return false;
+  }
+  long resume = ftell(p->f);
+  svf_reader_open(&p->tdi_reader, p->f, &fixed->para.tdi, 0);
+  svf_reader_read(&p->tdi_reader, fixed->tdi, fixed->para.len);
+  fseek(p->f, resume, SEEK_SET);
+  return true;
+}
+
+// Reads the words of a statement up to its ';'
+static int svf_parse_words(struct svf_player *p, char words[][SVF_TOKEN_SIZE], int max)
+{
+  int n = 0;
+  int t;
+  while ((t = svf_next_token(p)) == SVF_TOK_WORD)
+  {
+    if (n == max)
+      return -1;
+    strcpy(words[n++], p->tok);
+  }
+  return t == SVF_TOK_END ? n : -1;
+}
+
+static bool svf_parse_end_state(struct svf_player *p, tap_state_t *state)
+{
+  char words[1][SVF_TOKEN_SIZE];
+  if (svf_parse_words(p, words, 1) != 1)
+    return false;
+  tap_state_t s = svf_state(words[0]);
+  if (!svf_stable(s))
+    return false;
+  *state = s;
+  return true;
+}
+
+// [run_state] run_count TCK|SCK [min_time SEC] [MAXIMUM max_time SEC]
+// [ENDSTATE end_state], or the same with min_time SEC in place of the count
+static bool svf_runtest(struct svf_player *p)
+{
+  char words[SVF_MAX_RUNTEST_TOKENS][SVF_TOKEN_SIZE];
+  int n = svf_parse_words(p, words, SVF_MAX_RUNTEST_TOKENS);
+  int i = 0;
+  double val;
+  uint32_t cycles = 0;
+  double min_time = 0;
+  if (n < 2)
+    return false;
+  tap_state_t run_state = svf_state(words[0]);
+  if (run_state != TAP_INVALID)
+  {
+    if (!svf_stable(run_state))
+      return false;
+    p->run_state = p->run_end_state = run_state;
+    i++;
+  }
+  if (i + 1 >= n || !svf_parse_number(words[i], &val))
+    return false;
+  if (strcmp(words[i + 1], "TCK") == 0)
+    cycles = val;
+  else if (strcmp(words[i + 1], "SEC") == 0)
+    min_time = val;
+  else if (strcmp(words[i + 1], "SCK") != 0)
+    return false;
+  i += 2;
+  if (min_time == 0 && i + 1 < n && strcmp(words[i + 1], "SEC") == 0)
+  {
+    if (!svf_parse_number(words[i], &min_time))
+      return false;
+    i += 2;
+  }
+  if (i < n && strcmp(words[i], "MAXIMUM") == 0)
+    i += 3;
+  if (i + 1 < n && strcmp(words[i], "ENDSTATE") == 0)
+  {
+    tap_state_t end = svf_state(words[i + 1]);
+    if (!svf_stable(end))
+      return false;
+    p->run_end_state = end;
+    i += 2;
+  }
+  if (i != n)
+    return false;
+
+  uint64_t us = min_time * 1000000;
+  if (p->run_state == TAP_IDLE)
+    return svf_idle(p, cycles, us, p->run_end_state);
+  // Only IDLE can be clocked in place, so cycles elsewhere become time
+  uint64_t clocked_us = (uint64_t)cycles * 1000000 / ftdi_mpsse_get_frequency();
+  return svf_wait_in(p, p->run_state, us > clocked_us ? us : clocked_us, p->run_end_state);
+}
+
+// Only the final state of a path matters; moves go the shortest way
+static bool svf_state_stmt(struct svf_player *p)
+{
+  char words[SVF_MAX_RUNTEST_TOKENS][SVF_TOKEN_SIZE];
+  int n = svf_parse_words(p, words, SVF_MAX_RUNTEST_TOKENS);
+  if (n < 1)
+    return false;
+  for (int i = 0; i < n; i++)
+    if (svf_state(words[i]) == TAP_INVALID)
+      return false;
+  tap_state_t state = svf_state(words[n - 1]);
+  if (!svf_stable(state))
+    return false;
+  jtag_add_statemove(state);
+  return true;
+}
+
+static bool svf_frequency(struct svf_player *p)
+{
+  char words[2][SVF_TOKEN_SIZE];
+  int n = svf_parse_words(p, words, 2);
+  double hz = FTDI_TCK_DEFAULT_FREQUENCY;
+  if (n < 0 || (n > 0 && (n != 2 || strcmp(words[1], "HZ") != 0 || !svf_parse_number(words[0], &hz))))
+    return false;
+  if (!svf_check_flush(p))
+    return false;
+  uint32_t set = ftdi_mpsse_set_frequency(hz >= 1 ? (uint32_t)hz : 1);
+  ESP_LOGI(TAG, "TCK %" PRIu32 " Hz", set);
+  return true;
+}
+
+static bool svf_statement(struct svf_player *p)
+{
+  char words[2][SVF_TOKEN_SIZE];
+  const char *cmd = p->tok;
+  if (strcmp(cmd, "SDR") == 0)
+    return svf_parse_scan(p, &p->sdr) && svf_scan(p, false, &p->sdr, p->enddr);
+  if (strcmp(cmd, "SIR") == 0)
+    return svf_parse_scan(p, &p->sir) && svf_scan(p, true, &p->sir, p->endir);
+  if (strcmp(cmd, "HDR") == 0)
+    return svf_parse_fixed(p, &p->hdr);
+  if (strcmp(cmd, "HIR") == 0)
+    return svf_parse_fixed(p, &p->hir);
+  if (strcmp(cmd, "TDR") == 0)
+    return svf_parse_fixed(p, &p->tdr);
+  if (strcmp(cmd, "TIR") == 0)
+    return svf_parse_fixed(p, &p->tir);
+  if (strcmp(cmd, "ENDDR") == 0)
+    return svf_parse_end_state(p, &p->enddr);
+  if (strcmp(cmd, "ENDIR") == 0)
+    return svf_parse_end_state(p, &p->endir);
+  if (strcmp(cmd, "RUNTEST") == 0)
+    return svf_runtest(p);
+  if (strcmp(cmd, "STATE") == 0)
+    return svf_state_stmt(p);
+  if (strcmp(cmd, "FREQUENCY") == 0)
+    return svf_frequency(p);
+  if (strcmp(cmd, "TRST") == 0)
+  {
+    // The Arty's JTAG header has no TRST line
+    if (svf_parse_words(p, words, 1) != 1)
+      return false;
+    if (strcmp(words[0], "ABSENT") != 0 && strcmp(words[0], "OFF") != 0 && strcmp(words[0], "Z") != 0)
+      ESP_LOGW(TAG, "Line %" PRIu32 ": TRST %s ignored, there is no TRST pin", p->at, words[0]);
+    return true;
+  }
+  ESP_LOGE(TAG, "Line %" PRIu32 ": %s is not supported", p->at, cmd);
+  return false;
+}
+
+static struct svf_player *svf_player_open(const char *filename, struct svf_result *result)
+{
+  memset(result, 0, sizeof(*result));
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+  {
+    ESP_LOGE(TAG, "Unable to open %s", filename);
+    return NULL;
+  }
+  struct svf_player *p = calloc(1, sizeof(struct svf_player));
+  if (p == NULL)
+  {
+    ESP_LOGE(TAG, "No memory to play %s", filename);
+    fclose(f);
+    return NULL;
+  }
+  p->f = f;
+  p->result = result;
+  p->enddr = p->endir = TAP_IDLE;
+  p->run_state = p->run_end_state = TAP_IDLE;
+  p->sdr.tdi.start = p->sdr.tdo.start = p->sdr.mask.start = -1;
+  p->sir = p->sdr;
+  p->hdr.para = p->hir.para = p->tdr.para = p->tir.para = p->sdr;
+  p->tck = ftdi_mpsse_get_frequency();
+  ftdi_mpsse_open();
+  return p;
+}
+
+// Completes what is still queued, since pending read-back points into the
+// player, and reports the outcome
+static bool svf_player_close(struct svf_player *p, bool ok, int64_t start)
+{
+  bool checked = svf_check_flush(p);
+  ok = ok && checked;
+  if (!ok)
+    svf_fail(p);
+  if (ftdi_mpsse_get_frequency() != p->tck)
+    ftdi_mpsse_set_frequency(p->tck);
+  p->result->time_us = esp_timer_get_time() - start;
+  ESP_LOGI(TAG, "%" PRIu32 " statements, %" PRIu64 " bits, %" PRIu32 "/%" PRIu32 " checks failed in %" PRId64 " us",
+           p->result->statements, p->result->bits, p->result->failed_checks, p->result->checks, p->result->time_us);
+  fclose(p->f);
+  free(p);
+  return ok;
+}
+
+bool svf_play(const char *filename, struct svf_result *result)
+{
+  int64_t start = esp_timer_get_time();
+  struct svf_player *p = svf_player_open(filename, result);
+  if (p == NULL)
+    return false;
+  bool ok = true;
+  while (ok)
+  {
+    int t = svf_next_token(p);
+    if (t == SVF_TOK_EOF)
+      break;
+    p->at = p->line + 1;
+    if (t != SVF_TOK_WORD)
+    {
+      ESP_LOGE(TAG, "Line %" PRIu32 ": syntax error", p->at);
+      ok = false;
+      break;
+    }
+    p->result->statements++;
+    ok = svf_statement(p);
+    if (!ok && p->result->failed_checks == 0)
+      ESP_LOGE(TAG, "Line %" PRIu32 ": %s statement failed", p->at, p->tok);
+  }
+  return svf_player_close(p, ok, start);
+}
+
+static bool xsvf_u8(struct svf_player *p, uint8_t *val)
+{
+  int c = fgetc(p->f);
+  *val = c;
+  return c != EOF;
+}
+
+static bool xsvf_u16(struct svf_player *p, uint32_t *val)
+{
+  uint8_t b[2];
+  if (fread(b, 1, 2, p->f) != 2)
+    return false;
+  *val = (b[0] << 8) | b[1];
+  return true;
+}
+
+static bool xsvf_u32(struct svf_player *p, uint32_t *val)
+{
+  uint8_t b[4];
+  if (fread(b, 1, 4, p->f) != 4)
+    return false;
+  *val = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+  return true;
+}
+
+// Notes where a num_bits vector starts and steps over it
+static bool xsvf_vector(struct svf_player *p, uint32_t num_bits, struct svf_vector *v)
+{
+  v->start = ftell(p->f);
+  v->end = v->start + DIV_ROUND_UP(num_bits, 8);
+  v->binary = true;
+  return fseek(p->f, v->end, SEEK_SET) == 0;
+}
+
+// XRUNTEST wait after a scan: one TCK per microsecond in IDLE, as the
+// Xilinx reference player does, then the rest of the time as a delay
+static bool xsvf_runtest(struct svf_player *p)
+{
+  if (p->runtest_us == 0)
+    return true;
+  return svf_idle(p, p->runtest_us, p->runtest_us, TAP_IDLE);
+}
+
+// XREPEAT > 0: a compared scan is checked straight away and, on a mismatch,
+// shifted again from PAUSE, so the register is never updated with it, with
+// 25% more XRUNTEST time on each attempt
+static bool xsvf_shift_retry(struct svf_player *p, tap_state_t end)
+{
+  struct svf_scan_para *para = &p->sdr;
+  uint32_t nbytes = DIV_ROUND_UP(para->len, 8);
+  uint8_t *captured = p->arena;
+  uint8_t *expected = captured + nbytes;
+  uint8_t *mask = expected + nbytes;
+  if (!svf_check_flush(p))
+    return false;
+  long resume = ftell(p->f);
+  svf_reader_open(&p->tdi_reader, p->f, &para->tdi, 0);
+  svf_reader_open(&p->tdo_reader, p->f, &para->tdo, 0);
+  svf_reader_open(&p->mask_reader, p->f, &para->mask, 0xff);
+  svf_reader_read(&p->tdi_reader, p->chunk, para->len);
+  svf_reader_read(&p->tdo_reader, expected, para->len);
+  svf_reader_read(&p->mask_reader, mask, para->len);
+  fseek(p->f, resume, SEEK_SET);
+
+  uint64_t runtest = p->runtest_us;
+  for (uint32_t attempt = 0; ; attempt++)
+  {
+    struct scan_field field = {para->len, p->chunk, captured};
+    jtag_add_dr_scan(1, &field, TAP_DRPAUSE);
+    jtag_execute_queue();
+    p->result->bits += para->len;
+    uint32_t j = 0;
+    while (j < nbytes && ((captured[j] ^ expected[j]) & mask[j]) == 0)
+      j++;
+    bool match = j == nbytes;
+    if (match || attempt == p->repeat)
+    {
+      p->result->checks++;
+      if (!match)
+      {
+        p->result->failed_checks++;
+        svf_fail(p);
+        ESP_LOGE(TAG, "Command %" PRIu32 ": TDO mismatch after %" PRIu32 " attempts", p->at, attempt + 1);
+      }
+      jtag_add_statemove(end);
+      return match && xsvf_runtest(p);
+    }
+    runtest += runtest / 4;
+    if (runtest && !svf_wait_in(p, TAP_DRPAUSE, runtest, TAP_DRPAUSE))
+      return false;
+  }
+}
+
+static bool xsvf_shift(struct svf_player *p, tap_state_t end)
+{
+  if (p->sdr.tdo.start >= 0 && p->repeat)
+  {
+    if (p->sdr.len <= SVF_CHUNK_BITS)
+      return xsvf_shift_retry(p, end);
+    ESP_LOGW(TAG, "Command %" PRIu32 ": %" PRIu32 " bit scan too long to retry", p->at, p->sdr.len);
+  }
+  return svf_scan(p, false, &p->sdr, end) && xsvf_runtest(p);
+}
+
+static bool xsvf_command(struct svf_player *p, uint8_t cmd, bool *complete)
+{
+  struct svf_scan_para piece;
+  uint32_t len;
+  uint8_t a, b;
+
+  switch (cmd)
+  {
+    case XCOMPLETE:
+      *complete = true;
+      return true;
+    case XTDOMASK:
+      return xsvf_vector(p, p->xsdr_size, &p->sdr.mask);
+    case XSIR:
+    case XSIR2:
+      if (cmd == XSIR)
+      {
+        if (!xsvf_u8(p, &a))
+          return false;
+        len = a;
+      }
+      else if (!xsvf_u16(p, &len))
+        return false;
+      p->sir.len = len;
+      p->sir.tdo.start = -1;
+      return xsvf_vector(p, len, &p->sir.tdi) && svf_scan(p, true, &p->sir, p->endir) && xsvf_runtest(p);
+    case XSDR:
+      p->sdr.len = p->xsdr_size;
+      return xsvf_vector(p, p->xsdr_size, &p->sdr.tdi) && xsvf_shift(p, p->enddr);
+    case XSDRTDO:
+      p->sdr.len = p->xsdr_size;
+      return xsvf_vector(p, p->xsdr_size, &p->sdr.tdi) && xsvf_vector(p, p->xsdr_size, &p->sdr.tdo) &&
+             xsvf_shift(p, p->enddr);
+    case XRUNTEST:
+      return xsvf_u32(p, &p->runtest_us);
+    case XREPEAT:
+      return xsvf_u8(p, &p->repeat);
+    case XSDRSIZE:
+      if (!xsvf_u32(p, &len))
+        return false;
+      if (len != p->xsdr_size)
+        p->sdr.tdo.start = p->sdr.mask.start = -1;
+      p->xsdr_size = len;
+      return true;
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE:
+      // Pieces of one long scan that stays in SHIFT until the last one
+      piece = p->sdr;
+      piece.len = p->xsdr_size;
+      piece.tdo.start = -1;
+      if (!xsvf_vector(p, p->xsdr_size, &piece.tdi))
+        return false;
+      if (cmd >= XSDRTDOB && !xsvf_vector(p, p->xsdr_size, &piece.tdo))
+        return false;
+      return svf_scan(p, false, &piece, (cmd == XSDRE || cmd == XSDRTDOE) ? p->enddr : TAP_DRSHIFT);
+    case XSTATE:
+      if (!xsvf_u8(p, &a) || a >= sizeof(svf_states) / sizeof(svf_states[0]))
+        return false;
+      // Transient states are passed through by the next move anyway
+      if (svf_stable(svf_states[a].state))
+        jtag_add_statemove(svf_states[a].state);
+      return true;
+    case XENDIR:
+      if (!xsvf_u8(p, &a) || a > 1)
+        return false;
+      p->endir = a ? TAP_IRPAUSE : TAP_IDLE;
+      return true;
+    case XENDDR:
+      if (!xsvf_u8(p, &a) || a > 1)
+        return false;
+      p->enddr = a ? TAP_DRPAUSE : TAP_IDLE;
+      return true;
+    case XCOMMENT:
+      while (xsvf_u8(p, &a))
+        if (a == 0)
+          return true;
+      return false;
+    case XWAIT:
+      if (!xsvf_u8(p, &a) || !xsvf_u8(p, &b) || !xsvf_u32(p, &len))
+        return false;
+      if (a >= sizeof(svf_states) / sizeof(svf_states[0]) || b >= sizeof(svf_states) / sizeof(svf_states[0]) ||
+          !svf_stable(svf_states[a].state) || !svf_stable(svf_states[b].state))
+        return false;
+      if (svf_states[a].state == TAP_IDLE)
+        return svf_idle(p, len, len, svf_states[b].state);
+      return svf_wait_in(p, svf_states[a].state, len, svf_states[b].state);
+    default:
+      ESP_LOGE(TAG, "Command %" PRIu32 ": XSVF command 0x%02x is not supported", p->at, cmd);
+      return false;
+  }
+}
+
+bool xsvf_play(const char *filename, struct svf_result *result)
+{
+  int64_t start = esp_timer_get_time();
+  struct svf_player *p = svf_player_open(filename, result);
+  if (p == NULL)
+    return false;
+  bool ok = true;
+  bool complete = false;
+  uint8_t cmd;
+  while (ok && !complete && xsvf_u8(p, &cmd))
+  {
+    p->at = ++p->result->statements;
+    ok = xsvf_command(p, cmd, &complete);
+    if (!ok && p->result->failed_checks == 0)
+      ESP_LOGE(TAG, "Command %" PRIu32 " (0x%02x) failed", p->at, cmd);
+  }
+  return svf_player_close(p, ok, start);
+}
+
+bool svf_is_xsvf(const char *filename)
+{
+  size_t len = strlen(filename);
+  return len >= 5 && strcasecmp(filename + len - 5, ".xsvf") == 0;
+}
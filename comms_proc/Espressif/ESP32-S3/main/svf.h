@@ -0,0 +1,46 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bits shifted per queued scan; longer SDR/SIR vectors are split into
+// pieces that stay in SHIFT between them
+#define SVF_CHUNK_BITS 16384
+// Block size used when reading vector data back from the file
+#define SVF_READ_SIZE 2048
+// Longest HDR/HIR/TDR/TIR pattern, which is held in memory
+#define SVF_MAX_FIXED_BITS 256
+// Captured, expected and mask bytes of TDO checks not compared yet
+#define SVF_CHECK_ARENA_SIZE (4 * 3 * SVF_CHUNK_BITS / 8)
+#define SVF_MAX_CHECKS 256
+#define SVF_TOKEN_SIZE 32
+#define SVF_MAX_RUNTEST_TOKENS 10
+
+struct svf_result {
+  uint32_t statements;
+  uint64_t bits;
+  uint32_t checks;
+  uint32_t failed_checks;
+  // SVF line or XSVF command number of the first failed check or error
+  uint32_t fail_at;
+  int64_t time_us;
+};
+
+// Plays a file on the board the calling task has selected. Vector data is
+// read from the file as it is shifted rather than loaded up front, and TDO
+// checks are compared in batches whenever the JTAG queue is flushed, so
+// neither the file size nor the vector length is bounded by RAM. Playback
+// stops at the first TDO mismatch or statement that cannot be executed.
+// TCK is set back to its rate before playback once the file is done.
+bool svf_play(const char *filename, struct svf_result *result);
+bool xsvf_play(const char *filename, struct svf_result *result);
+// True if the name ends in .xsvf
+bool svf_is_xsvf(const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
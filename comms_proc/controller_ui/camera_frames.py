@@ -0,0 +1,107 @@
+import os
+import sys
+import time
+import struct
+import argparse
+import paho.mqtt.client as mqtt
+
+# Reassembles the camera frames an ESP32 forwards with the CameraStream
+# command and reports how many were lost. Every MQTT message on
+# /BOARDNAME/camera/SERIAL is one chunk of a frame:
+#   frame sequence (u32), frame length (u32), chunk index (u16),
+#   chunk count (u16), format (u8), three reserved bytes, then the data.
+# Sequence numbers count every frame the ESP32 saw, so a gap is a frame it
+# dropped, and a frame with chunks missing was lost on the way here.
+
+CHUNK_HEADER = struct.Struct('<IIHHB3x')
+FORMAT_EXTENSIONS = {1: 'jpg', 2: 'raw'}
+
+class CameraStream:
+    def __init__(self, outdir):
+        self.outdir = outdir
+        self.partial = {}
+        self.last_seq = None
+        self.complete = 0
+        self.incomplete = 0
+        self.missing = 0
+        self.bytes = 0
+
+    def feed(self, topic, payload):
+        if len(payload) < CHUNK_HEADER.size:
+            return
+        seq, length, index, count, fmt = CHUNK_HEADER.unpack_from(payload)
+        # Chunks arrive in order, so a newer frame means older ones are done
+        for old in [s for s in self.partial if s != seq]:
+            del self.partial[old]
+            self.incomplete += 1
+        if seq not in self.partial:
+            if self.last_seq is not None and seq > self.last_seq + 1:
+                self.missing += seq - self.last_seq - 1
+            # A lower number means the ESP32 restarted
+            self.last_seq = seq
+            self.partial[seq] = {}
+        chunks = self.partial[seq]
+        chunks[index] = payload[CHUNK_HEADER.size:]
+        if len(chunks) < count:
+            return
+        del self.partial[seq]
+        frame = b''.join(chunks[i] for i in range(count))
+        if len(frame) != length:
+            self.incomplete += 1
+            return
+        self.complete += 1
+        self.bytes += length
+        if self.outdir:
+            name = '%s_%06d.%s' % (topic.strip('/').replace('/', '_'), seq, FORMAT_EXTENSIONS.get(fmt, 'bin'))
+            with open(os.path.join(self.outdir, name), 'wb') as f:
+                f.write(frame)
+
+    def drop_rate(self):
+        total = self.complete + self.incomplete + self.missing
+        return (self.incomplete + self.missing) / total if total else 0.0
+
+def main():
+    parser = argparse.ArgumentParser(description='Reassemble camera frames forwarded over MQTT')
+    parser.add_argument('--host', default='localhost', help='MQTT broker')
+    parser.add_argument('--port', type=int, default=1883)
+    parser.add_argument('--topic', default='/+/camera/+', help='e.g. /ESP32-XXXXXXXXXXXX/camera/SERIAL')
+    parser.add_argument('--outdir', help='directory to write the frames to')
+    parser.add_argument('--interval', type=float, default=5.0, help='seconds between reports')
+    args = parser.parse_args()
+    if args.outdir:
+        os.makedirs(args.outdir, exist_ok=True)
+
+    streams = {}
+
+    def on_connect(client, userdata, flags, rc):
+        client.subscribe(args.topic)
+
+    def on_message(client, userdata, msg):
+        if msg.topic not in streams:
+            streams[msg.topic] = CameraStream(args.outdir)
+        streams[msg.topic].feed(msg.topic, msg.payload)
+
+    client = mqtt.Client()
+    client.on_connect = on_connect
+    client.on_message = on_message
+    try:
+        client.connect(args.host, args.port, 60)
+    except:
+        print("Unable to connect to the broker")
+        sys.exit(1)
+    client.loop_start()
+    last = time.time()
+    try:
+        while True:
+            time.sleep(args.interval)
+            now = time.time()
+            for topic, s in list(streams.items()):
+                print('%s: %d frames, %d incomplete, %d missing, drop rate %.1f%%, %.1f kB/s' %
+                      (topic, s.complete, s.incomplete, s.missing, 100 * s.drop_rate(), s.bytes / 1000 / (now - last)))
+                s.bytes = 0
+            last = now
+    except KeyboardInterrupt:
+        client.loop_stop()
+
+if __name__ == '__main__':
+    main()
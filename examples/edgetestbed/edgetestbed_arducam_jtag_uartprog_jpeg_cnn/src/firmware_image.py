@@ -0,0 +1,70 @@
+# Softcore firmware image: the loadable contents of an objcopy verilog hex
+# file, pre-parsed so loaders stream it without any text handling.
+#
+#   header:  "SCIM", u16 version, u16 segment count
+#   segment: u32 load address, u32 length in bytes, u32 CRC-32 of the payload,
+#            followed by the payload (little-endian words, length % 4 == 0)
+#
+# All fields are little-endian.
+import struct
+import sys
+import zlib
+
+IMAGE_MAGIC = b'SCIM'
+IMAGE_VERSION = 1
+
+def hex_to_segments(filename):
+    segments = []
+    address = 0
+    data = bytearray()
+    start = 0
+    with open(filename) as file:
+        for line in file:
+            line = line.strip()
+            if not line:
+                continue
+            if line.startswith('@'):
+                address = int(line[1:], 16)
+                if data and address == start + len(data):
+                    continue
+                if data:
+                    segments.append((start, bytes(data)))
+                start = address
+                data = bytearray()
+            else:
+                data.extend(int(x, 16) for x in line.split())
+    if data:
+        segments.append((start, bytes(data)))
+    return [(start, data + bytes(-len(data) % 4)) for start, data in segments]
+
+def write_image(filename, segments):
+    with open(filename, 'wb') as file:
+        file.write(IMAGE_MAGIC + struct.pack('<HH', IMAGE_VERSION, len(segments)))
+        for start, data in segments:
+            file.write(struct.pack('<III', start, len(data), zlib.crc32(data)))
+            file.write(data)
+
+def read_image(filename):
+    with open(filename, 'rb') as file:
+        blob = file.read()
+    if blob[0:4] != IMAGE_MAGIC:
+        raise ValueError(filename + ' is not a firmware image')
+    version, count = struct.unpack_from('<HH', blob, 4)
+    if version != IMAGE_VERSION:
+        raise ValueError('unsupported firmware image version %d' % version)
+    segments = []
+    offset = 8
+    for _ in range(count):
+        start, length, crc = struct.unpack_from('<III', blob, offset)
+        offset += 12
+        data = blob[offset:offset + length]
+        offset += length
+        if len(data) != length or zlib.crc32(data) != crc:
+            raise ValueError('corrupt segment at 0x%08x in %s' % (start, filename))
+        segments.append((start, data))
+    return segments
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit('usage: firmware_image.py <firmware.hex> <firmware.img>')
+    write_image(sys.argv[2], hex_to_segments(sys.argv[1]))
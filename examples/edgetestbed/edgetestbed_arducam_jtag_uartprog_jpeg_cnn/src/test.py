@@ -2,7 +2,7 @@ from jtag import JTAG
 from utils import *
 
 bin_file = './edgetestbed_arducam_jtag_uartprog_jpeg_cnn/edgetestbed_arducam_jtag_uartprog_jpeg_cnn.runs/impl_1/top.bin'
-firmware = 'cpu_firmware.hex'
+firmware = 'cpu_firmware.img'
 image_file = 'out.jpeg'
 print("Initializing FTDI connection")
 jtag_ = JTAG(0x0403, 0x6010)
@@ -233,37 +233,19 @@ class MPSSE:
         return (int(math.ceil(int_1/int_2)))  
         
     def bit_copy(self,dst, dst_start, src, src_start, bit_count):
-        db = dst_start / 8
-        sb = src_start / 8
-        dq = dst_start % 8
-        sq = src_start % 8
-        lb = bit_count / 8
-        lq = bit_count % 8
-        for i in range(int(db)):
-            dst.append(0)
-        if (sq == 0) and (lq == 0) and (dq == 0):
-            for i in range(int(lb)):
-                dst.append(src[int(sb)+i])
+        # Shift/mask the whole span as one integer instead of bit by bit
+        sb = src_start // 8
+        if (src_start % 8 == 0) and (dst_start % 8 == 0) and (bit_count % 8 == 0) and (len(dst) == dst_start // 8):
+            dst.extend(src[sb:sb + bit_count // 8])
             return dst
-        idx = int(sb)
-        odx = 0
-        dst.append(0)
-        for i in range(bit_count):
-            if (((src[idx] >> (sq&7)) & 1) == 1):
-                dst[odx] |= 1 << (dq&7)
-            else:
-                dst[odx] &= ~(1 << (dq&7))
-            sq += 1
-            if (sq == 7):
-                sq = 0
-                idx += 1
-            dq += 1
-            if (dq == 7):
-                dq = 0
-                odx += 1
-                dst.append(0)
-        if dq == 0:
-            dst = dst[:-1]
+        value = int.from_bytes(bytes(src[sb:self.DIV_ROUND_UP(src_start + bit_count, 8)]), "little")
+        value = (value >> (src_start % 8)) & ((1 << bit_count) - 1)
+        nbytes = self.DIV_ROUND_UP(dst_start + bit_count, 8)
+        dst.extend([0] * (nbytes - len(dst)))
+        mask = ((1 << bit_count) - 1) << dst_start
+        cur = int.from_bytes(bytes(dst[:nbytes]), "little")
+        cur = (cur & ~mask) | (value << dst_start)
+        dst[:nbytes] = list(cur.to_bytes(nbytes, "little"))
         return dst
         
     def buffer_write(self, out, out_offset, bit_count):
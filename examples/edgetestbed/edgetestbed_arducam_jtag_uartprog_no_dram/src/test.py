@@ -4,7 +4,7 @@ from utils import *
 import plotext as plt
 
 bin_file = './edgetestbed_arducam_jtag_uartprog_no_dram/edgetestbed_arducam_jtag_uartprog_no_dram.runs/impl_1/top.bin'
-firmware = 'cpu_firmware.hex'
+firmware = 'cpu_firmware.img'
 image_file = 'out.jpeg'
 
 print("Initializing FTDI connection")
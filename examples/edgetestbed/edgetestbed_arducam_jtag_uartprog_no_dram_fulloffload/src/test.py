@@ -4,7 +4,7 @@ from utils import *
 import plotext as plt
 
 bin_file = './edgetestbed_arducam_jtag_uartprog_no_dram_fulloffload/edgetestbed_arducam_jtag_uartprog_no_dram_fulloffload.runs/impl_1/top.bin'
-firmware = 'cpu_firmware.hex'
+firmware = 'cpu_firmware.img'
 image_file = 'out.jpeg'
 
 
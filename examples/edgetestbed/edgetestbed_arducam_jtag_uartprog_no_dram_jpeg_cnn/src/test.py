@@ -3,7 +3,7 @@ import time
 from utils import *
 
 bin_file = './edgetestbed_arducam_jtag_uartprog_no_dram_jpeg_cnn/edgetestbed_arducam_jtag_uartprog_no_dram_jpeg_cnn.runs/impl_1/top.bin'
-firmware = 'cpu_firmware.hex'
+firmware = 'cpu_firmware.img'
 image_file = 'out.jpeg'
 print("Initializing FTDI connection")
 jtag_ = JTAG(0x0403, 0x6010)
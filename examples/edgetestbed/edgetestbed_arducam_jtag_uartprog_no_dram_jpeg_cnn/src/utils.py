@@ -1,6 +1,8 @@
 from jtag import JTAG
 import json
 import time
+import struct
+from firmware_image import read_image
 import numpy as np
 from PIL import Image
 
@@ -10,44 +12,13 @@ def program_softcore(jtag_, filename):
     time.sleep(0.1)
     jtag_.control_write({"0_31": 2, "32_63": 0, "64_95": 0})
     time.sleep(0.1)
-    program = []
-    address = []
-    counter = 0;
-    with open(filename) as file:
-        for line in file:
-            if "@" in line: 
-                counter = int(line.split('@')[1],16)
-            else:
-                nl_rm_line =  line.split('\n')[0];  
-                nl_rm_line =  nl_rm_line.split(' ');   
-                if len(nl_rm_line) == 0: continue
-                words = int(len(nl_rm_line)/4)
-                for i in range(words):
-                    program.append(nl_rm_line[4*i+3] + nl_rm_line[4*i+2] + nl_rm_line[4*i+1] + nl_rm_line[4*i])
-                    address.append(counter)
-                    counter = counter + 4;       
-    for i in range(len(program)):
-        x = address[i]
-        x1 = [(x&255)]
-        x2 = [((x>>8)&255)]
-        x3 = [((x>>16)&255)]
-        x4 = [((x>>24)&255)]
-        jtag_.ftdi_.dev.uart_write(x1)
-        jtag_.ftdi_.dev.uart_write(x2)
-        jtag_.ftdi_.dev.uart_write(x3)
-        jtag_.ftdi_.dev.uart_write(x4)
-        x = int(program[i],16)
-        x1 = [(x&255)]
-        x2 = [((x>>8)&255)]
-        x3 = [((x>>16)&255)]
-        x4 = [((x>>24)&255)]
-        jtag_.ftdi_.dev.uart_write(x1)
-        jtag_.ftdi_.dev.uart_write(x2)
-        jtag_.ftdi_.dev.uart_write(x3)
-        jtag_.ftdi_.dev.uart_write(x4)
-        time.sleep(0.001)
+    for start, data in read_image(filename):
+        stream = bytearray()
+        for offset in range(0, len(data), 4):
+            stream += struct.pack('<I', start + offset) + data[offset:offset + 4]
+        jtag_.ftdi_.dev.uart_write(stream, timeout=5000)
     time.sleep(0.1)
-    jtag_.control_write({"0_31": 0, "32_63": 0, "64_95": 0}) 
+    jtag_.control_write({"0_31": 0, "32_63": 0, "64_95": 0})
 
  
 def capture_RAW_image(jtag_):
@@ -191,4 +162,63 @@ def write_jpeg_image(img, filename):
 
 def write_numpy_image(img, filename):
     im = Image.fromarray(img)
-    im.save(filename)
\ No newline at end of file
+    im.save(filename)
+
+# Binary frames from the softcore (see frame_send() in utils.h):
+#   FRAME_MARKER, COBS(topic id, length (LE), payload, CRC16 (LE)) ^ 0x0D,
+#   FRAME_DELIMITER
+FRAME_MARKER = 0x01
+FRAME_DELIMITER = 0x0D
+FRAME_TOPIC_REGISTER = 0
+
+def crc16_ccitt(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+# Splits the UART stream into frames and text lines. feed() takes what
+# uart_read(is_str=0) returns and yields (topic, payload) for every frame,
+# with topic the registered name or the id, and (None, text) for lines.
+class FrameDecoder:
+    def __init__(self):
+        self.buf = bytearray()
+        self.topics = {}
+        self.crc_errors = 0
+
+    def feed(self, data):
+        self.buf += bytes(x & 0xFF for x in data)
+        while True:
+            end = self.buf.find(FRAME_DELIMITER)
+            if end < 0:
+                return
+            frame = bytes(self.buf[:end]).lstrip(b'\n\0')
+            del self.buf[:end + 1]
+            if not frame or frame[0] != FRAME_MARKER:
+                yield None, frame.decode('ascii', 'replace')
+                continue
+            raw = cobs_decode(bytes(b ^ FRAME_DELIMITER for b in frame[1:]))
+            if raw is None or len(raw) < 5 or len(raw) != 5 + (raw[1] | (raw[2] << 8)) or \
+               crc16_ccitt(raw[:-2]) != (raw[-2] | (raw[-1] << 8)):
+                self.crc_errors += 1
+                continue
+            topic_id, payload = raw[0], raw[3:-2]
+            if topic_id == FRAME_TOPIC_REGISTER and payload:
+                self.topics[payload[0]] = payload[1:].decode('ascii', 'replace')
+                continue
+            yield self.topics.get(topic_id, topic_id), payload
@@ -3,7 +3,7 @@ import time
 from utils import *
 
 bin_file = './edgetestbed_jtag_uartprog_no_dram/edgetestbed_jtag_uartprog_no_dram.runs/impl_1/top.bin'
-firmware = 'cpu_firmware.hex'
+firmware = 'cpu_firmware.img'
 
 
 print("Initializing FTDI connection")
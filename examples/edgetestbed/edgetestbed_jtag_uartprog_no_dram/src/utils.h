@@ -132,4 +132,92 @@ void putchar(int c){
 void puts(char* c){
     prints(c);
 }
+
+// Binary frames, far cheaper than formatting JSON. They go out through
+// debug like everything printed, i.e. FT2232H channel B, where the ESP32
+// picks them up while CameraStream runs in its "messages" format:
+//   FRAME_MARKER, COBS(topic id, length (LE), payload, CRC16 (LE)) ^ 0x0D,
+//   FRAME_DELIMITER
+// COBS removes every 0x00 from the frame and the XOR turns that into "no
+// 0x0D", so the delimiter shared with text lines only ever ends a frame.
+// The CRC is CRC-16/CCITT-FALSE over id, length and payload.
+#define FRAME_MARKER 0x01
+#define FRAME_DELIMITER 0x0D
+#define FRAME_MAX_PAYLOAD 1000
+// Payload of a frame on this id: the id being named, then its topic name
+#define FRAME_TOPIC_REGISTER 0
+
+const unsigned short frame_crc_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+// Nibble table: no multiply or divide, which rv32i lacks
+unsigned short frame_crc16(unsigned short crc, const uint8_t* data, int len){
+    for (int i = 0; i < len; i = i+1){
+        crc = (crc << 4) ^ frame_crc_table[((crc >> 12) ^ (data[i] >> 4)) & 0x0f];
+        crc = (crc << 4) ^ frame_crc_table[((crc >> 12) ^ data[i]) & 0x0f];
+    }
+    return crc;
+}
+
+// Streaming COBS encoder; a block is held back until its length is known
+struct frame_encoder {
+    uint8_t block[254];
+    int count;
+};
+
+void frame_block_flush(struct frame_encoder* enc){
+    debug = (enc->count + 1) ^ FRAME_DELIMITER;
+    for (int i = 0; i < enc->count; i = i+1)
+        debug = enc->block[i] ^ FRAME_DELIMITER;
+    enc->count = 0;
+}
+
+void frame_put(struct frame_encoder* enc, const uint8_t* data, int len){
+    for (int i = 0; i < len; i = i+1){
+        if (data[i] == 0){
+            frame_block_flush(enc);
+            continue;
+        }
+        enc->block[enc->count] = data[i];
+        enc->count = enc->count + 1;
+        if (enc->count == 254)
+            frame_block_flush(enc);
+    }
+}
+
+void frame_send(uint8_t topic_id, const uint8_t* payload, int len){
+    static struct frame_encoder enc;
+    uint8_t header[3];
+    uint8_t trailer[2];
+    if (len > FRAME_MAX_PAYLOAD)
+        return;
+    header[0] = topic_id;
+    header[1] = len & 0xff;
+    header[2] = len >> 8;
+    unsigned short crc = frame_crc16(0xffff, header, 3);
+    crc = frame_crc16(crc, payload, len);
+    trailer[0] = crc & 0xff;
+    trailer[1] = crc >> 8;
+    enc.count = 0;
+    debug = FRAME_MARKER;
+    frame_put(&enc, header, 3);
+    frame_put(&enc, payload, len);
+    frame_put(&enc, trailer, 2);
+    frame_block_flush(&enc);
+    debug = FRAME_DELIMITER;
+}
+
+// Names topic_id; the comms processor publishes its frames under the name
+void frame_register_topic(uint8_t topic_id, char* name){
+    uint8_t payload[64];
+    int len = 1;
+    payload[0] = topic_id;
+    while ((name[len-1] != 0) && (len < 64)){
+        payload[len] = name[len-1];
+        len = len+1;
+    }
+    frame_send(FRAME_TOPIC_REGISTER, payload, len);
+}
 #endif
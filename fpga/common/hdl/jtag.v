@@ -1,13 +1,40 @@
 module jtag_chip_manager(
-clk,rst,control
+clk,rst,control,
+m_axi_araddr,m_axi_arvalid,m_axi_arready,
+m_axi_rdata,m_axi_rvalid,m_axi_rready,
+m_axi_awaddr,m_axi_awvalid,m_axi_awready,
+m_axi_wdata,m_axi_wstrb,m_axi_wvalid,m_axi_wready,
+m_b_ready,m_b_valid,m_b_response
 );
 
 parameter JTAG_USER_REG_ID = 4;
+// 1 adds the JTAG to AXI master on m; 0 leaves m idle and TDO at 0
+parameter AXI_MASTER = 0;
+parameter MEM_ADDR_SIZE = 32;
+parameter DATA_WIDTH = 32;
+parameter CLOCK_CROSSING_FIFO_DEPTH = 8;
 
 input 				clk;
 input 				rst;
 output reg [95:0] control;
 
+output [MEM_ADDR_SIZE-1:0]            m_axi_araddr;
+output                        m_axi_arvalid;
+input                            m_axi_arready;
+input         [DATA_WIDTH-1:0]            m_axi_rdata;
+input                            m_axi_rvalid;
+output                            m_axi_rready;
+output [MEM_ADDR_SIZE-1:0]            m_axi_awaddr;
+output                        m_axi_awvalid;
+input                            m_axi_awready;
+output [DATA_WIDTH-1:0]            m_axi_wdata;
+output [(DATA_WIDTH>>3)-1:0]            m_axi_wstrb;
+output                        m_axi_wvalid;
+input                            m_axi_wready;
+output                        m_b_ready;
+input                            m_b_valid;
+input         [1:0]                    m_b_response;
+
 wire tap_reset;
 wire tap_idle;
 wire tap_capture;
@@ -24,20 +51,409 @@ initial control = 0;
 initial jtag_write_data = 0;
 assign cmd = jtag_write_data[103:96];
 assign control_trigger = cmd[5];
-assign bscan_tdo = 0;
 
-jtag_phy #(.JTAG_USER_REG_ID(JTAG_USER_REG_ID)) 
+jtag_phy #(.JTAG_USER_REG_ID(JTAG_USER_REG_ID))
 jphy(.tap_reset(tap_reset),.tap_idle(tap_idle),.tap_capture(tap_capture),.tap_update(tap_update),.bscan_tck(bscan_tck),.bscan_tdi(bscan_tdi),.bscan_tdo(bscan_tdo),.data_valid(data_valid));
 
-always @(posedge tap_idle) begin
-control <= control_trigger ? jtag_write_data[95:0] : control;
-end
-
+// A word takes effect on UPDATE-DR, which is also where the AXI master picks
+// it up, and is cleared there so scans of other instructions act as no-ops
 always @(posedge bscan_tck) begin
-    if (tap_idle) begin
+    if (tap_reset) begin
+        jtag_write_data <= 0;
+    end else if (tap_update) begin
+        control <= control_trigger ? jtag_write_data[95:0] : control;
         jtag_write_data <= 0;
 	end else if (data_valid) begin
 		jtag_write_data <= {bscan_tdi, jtag_write_data[103:1]};
 	end
 end
-endmodule
\ No newline at end of file
+
+generate
+if (AXI_MASTER) begin
+    jtag_axi_master #(.MEM_ADDR_SIZE(MEM_ADDR_SIZE), .DATA_WIDTH(DATA_WIDTH), .CLOCK_CROSSING_FIFO_DEPTH(CLOCK_CROSSING_FIFO_DEPTH))
+    master(.tck(bscan_tck),.tap_capture(tap_capture),.tap_shift(data_valid),.tap_update(tap_update),.command(jtag_write_data),.tdo(bscan_tdo),
+        .clk(clk),
+        .m_axi_araddr(m_axi_araddr),.m_axi_arvalid(m_axi_arvalid),.m_axi_arready(m_axi_arready),
+        .m_axi_rdata(m_axi_rdata),.m_axi_rvalid(m_axi_rvalid),.m_axi_rready(m_axi_rready),
+        .m_axi_awaddr(m_axi_awaddr),.m_axi_awvalid(m_axi_awvalid),.m_axi_awready(m_axi_awready),
+        .m_axi_wdata(m_axi_wdata),.m_axi_wstrb(m_axi_wstrb),.m_axi_wvalid(m_axi_wvalid),.m_axi_wready(m_axi_wready),
+        .m_b_ready(m_b_ready),.m_b_valid(m_b_valid),.m_b_response(m_b_response));
+end else begin
+    assign bscan_tdo = 0;
+    assign m_axi_araddr = 0;
+    assign m_axi_arvalid = 0;
+    assign m_axi_rready = 0;
+    assign m_axi_awaddr = 0;
+    assign m_axi_awvalid = 0;
+    assign m_axi_wdata = 0;
+    assign m_axi_wstrb = 0;
+    assign m_axi_wvalid = 0;
+    assign m_b_ready = 1'b1;
+end
+endgenerate
+endmodule
+
+
+
+// Executes the AXI commands of the 104-bit user register word. Read addresses
+// are in bits 31:0, write addresses in 63:32, write data in 95:64 and the
+// command in 103:96:
+//   [0] READ_ADDRESS    issue a read
+//   [1] WRITE_ADDRESS   issue a write (either write bit does)
+//   [3] WRITE_DATA
+//   [2] READ_DATA       take the result of the last read
+//   [4] LOAD_JTAG_READ_DATA  capture {status, read data} in the next scan
+//   [6] AUTO_INCREMENT  use the address after the previous read or write
+// The read data is in bits 31:0 of the capture and the status in 47:32:
+// {command FIFO not drained, read in flight, read data valid, error}, from bit
+// 0 up. The error bit covers write responses and commands lost to a full FIFO
+// and is cleared by the load that reports it.
+// Commands cross to clk through a FIFO of CLOCK_CROSSING_FIFO_DEPTH entries (a
+// power of two) and run in order, one AXI transaction at a time; only one read
+// may be in flight. Write responses are not waited for, since most systems
+// tie b_valid off. Nothing is reset: the FIFO pointers live in two clock
+// domains, and rst is usually driven from the control word itself.
+module jtag_axi_master(
+tck,tap_capture,tap_shift,tap_update,command,tdo,
+clk,
+m_axi_araddr,m_axi_arvalid,m_axi_arready,
+m_axi_rdata,m_axi_rvalid,m_axi_rready,
+m_axi_awaddr,m_axi_awvalid,m_axi_awready,
+m_axi_wdata,m_axi_wstrb,m_axi_wvalid,m_axi_wready,
+m_b_ready,m_b_valid,m_b_response
+);
+
+parameter MEM_ADDR_SIZE = 32;
+parameter DATA_WIDTH = 32;
+parameter CLOCK_CROSSING_FIFO_DEPTH = 8;
+
+localparam PTR_WIDTH = $clog2(CLOCK_CROSSING_FIFO_DEPTH);
+localparam S_IDLE = 3'd0;
+localparam S_WRITE = 3'd1;
+localparam S_READ_ADDRESS = 3'd2;
+localparam S_READ_DATA = 3'd3;
+
+input                 tck;
+input                 tap_capture;
+input                 tap_shift;
+input                 tap_update;
+input [103:0]         command;
+output                tdo;
+input                 clk;
+
+output reg [MEM_ADDR_SIZE-1:0]        m_axi_araddr;
+output reg                        m_axi_arvalid;
+input                            m_axi_arready;
+input         [DATA_WIDTH-1:0]            m_axi_rdata;
+input                            m_axi_rvalid;
+output reg                            m_axi_rready;
+output reg [MEM_ADDR_SIZE-1:0]            m_axi_awaddr;
+output reg                        m_axi_awvalid;
+input                            m_axi_awready;
+output reg [DATA_WIDTH-1:0]            m_axi_wdata;
+output [(DATA_WIDTH>>3)-1:0]            m_axi_wstrb;
+output reg                        m_axi_wvalid;
+input                            m_axi_wready;
+output                        m_b_ready;
+input                            m_b_valid;
+input         [1:0]                    m_b_response;
+
+function [PTR_WIDTH:0] gray2bin;
+    input [PTR_WIDTH:0] g;
+    integer i;
+    begin
+        gray2bin[PTR_WIDTH] = g[PTR_WIDTH];
+        for (i = PTR_WIDTH - 1; i >= 0; i = i - 1)
+            gray2bin[i] = gray2bin[i + 1] ^ g[i];
+    end
+endfunction
+
+// {read, write, read address, write address, write data}
+reg [97:0] fifo [0:CLOCK_CROSSING_FIFO_DEPTH-1];
+
+// TCK domain
+reg [PTR_WIDTH:0] wptr;
+reg [PTR_WIDTH:0] rptr_gray_tck [0:1];
+reg [31:0] read_next;
+reg [31:0] write_next;
+reg read_request;
+reg read_outstanding;
+reg [1:0] read_ack_tck;
+reg [1:0] error_tck;
+reg error_seen;
+reg error;
+reg [31:0] read_data;
+reg read_valid;
+reg [47:0] capture_word;
+reg [47:0] tdo_shift;
+
+// clk domain
+reg [PTR_WIDTH:0] rptr;
+reg [PTR_WIDTH:0] wptr_gray_clk [0:1];
+reg [2:0] state;
+reg [DATA_WIDTH-1:0] read_result;
+reg read_ack;
+reg error_toggle;
+
+integer k;
+initial begin
+    wptr = 0; rptr = 0;
+    for (k = 0; k < 2; k = k + 1) begin
+        rptr_gray_tck[k] = 0;
+        wptr_gray_clk[k] = 0;
+    end
+    read_next = 0; write_next = 0;
+    read_request = 0; read_outstanding = 0; read_ack_tck = 0;
+    error_tck = 0; error_seen = 0; error = 0;
+    read_data = 0; read_valid = 0;
+    capture_word = 0; tdo_shift = 0;
+    state = S_IDLE; read_result = 0; read_ack = 0; error_toggle = 0;
+    m_axi_araddr = 0; m_axi_arvalid = 0; m_axi_rready = 0;
+    m_axi_awaddr = 0; m_axi_awvalid = 0; m_axi_wdata = 0; m_axi_wvalid = 0;
+end
+
+wire [7:0] cmd = command[103:96];
+wire read_cmd = cmd[0];
+wire write_cmd = cmd[1] | cmd[3];
+wire auto_increment = cmd[6];
+wire [31:0] read_address = auto_increment ? read_next : command[31:0];
+wire [31:0] write_address = auto_increment ? write_next : command[63:32];
+wire [PTR_WIDTH:0] wptr_gray = wptr ^ (wptr >> 1);
+wire [PTR_WIDTH:0] fifo_used = wptr - gray2bin(rptr_gray_tck[1]);
+wire fifo_full = fifo_used == CLOCK_CROSSING_FIFO_DEPTH;
+wire fifo_pending = wptr_gray != rptr_gray_tck[1];
+wire read_busy = read_request != read_ack_tck[1];
+wire result_valid = read_outstanding && !read_busy;
+wire [31:0] data_now = cmd[2] ? read_result : read_data;
+wire valid_now = cmd[2] ? result_valid : read_valid;
+wire error_now = error || (error_tck[1] != error_seen);
+wire [15:0] status = {12'd0, error_now, valid_now, read_busy, fifo_pending};
+
+assign tdo = tdo_shift[0];
+
+always @(posedge tck) begin
+    rptr_gray_tck[0] <= rptr ^ (rptr >> 1);
+    rptr_gray_tck[1] <= rptr_gray_tck[0];
+    read_ack_tck <= {read_ack_tck[0], read_ack};
+    error_tck <= {error_tck[0], error_toggle};
+    if (tap_capture)
+        tdo_shift <= capture_word;
+    else if (tap_shift)
+        tdo_shift <= {1'b0, tdo_shift[47:1]};
+
+    error_seen <= error_tck[1];
+    if (error_tck[1] != error_seen)
+        error <= 1'b1;
+    if (tap_update) begin
+        if (cmd[2]) begin
+            read_data <= read_result;
+            read_valid <= result_valid;
+            read_outstanding <= 0;
+        end
+        if (cmd[4]) begin
+            capture_word <= {status, data_now};
+            error <= 0;
+        end
+        if ((read_cmd || write_cmd) && fifo_full) begin
+            error <= 1'b1;
+        end else if (read_cmd || write_cmd) begin
+            fifo[wptr[PTR_WIDTH-1:0]] <= {read_cmd, write_cmd, read_address, write_address, command[95:64]};
+            wptr <= wptr + 1'b1;
+            if (read_cmd) begin
+                read_request <= ~read_request;
+                read_outstanding <= 1'b1;
+                read_next <= read_address + 4;
+            end
+            if (write_cmd)
+                write_next <= write_address + 4;
+        end
+    end
+end
+
+wire [97:0] entry = fifo[rptr[PTR_WIDTH-1:0]];
+wire aw_done = !m_axi_awvalid || m_axi_awready;
+wire w_done = !m_axi_wvalid || m_axi_wready;
+
+assign m_axi_wstrb = {(DATA_WIDTH>>3){1'b1}};
+assign m_b_ready = 1'b1;
+
+always @(posedge clk) begin
+    wptr_gray_clk[0] <= wptr_gray;
+    wptr_gray_clk[1] <= wptr_gray_clk[0];
+    if (m_b_valid && (m_b_response != 2'b00))
+        error_toggle <= ~error_toggle;
+    case (state)
+        S_IDLE: begin
+            if ((rptr ^ (rptr >> 1)) != wptr_gray_clk[1]) begin
+                if (entry[96]) begin
+                    m_axi_awaddr <= entry[63:32];
+                    m_axi_wdata <= entry[31:0];
+                    m_axi_awvalid <= 1'b1;
+                    m_axi_wvalid <= 1'b1;
+                    state <= S_WRITE;
+                end else if (entry[97]) begin
+                    m_axi_araddr <= entry[95:64];
+                    m_axi_arvalid <= 1'b1;
+                    state <= S_READ_ADDRESS;
+                end else begin
+                    rptr <= rptr + 1'b1;
+                end
+            end
+        end
+        S_WRITE: begin
+            if (m_axi_awready)
+                m_axi_awvalid <= 0;
+            if (m_axi_wready)
+                m_axi_wvalid <= 0;
+            if (aw_done && w_done) begin
+                if (entry[97]) begin
+                    m_axi_araddr <= entry[95:64];
+                    m_axi_arvalid <= 1'b1;
+                    state <= S_READ_ADDRESS;
+                end else begin
+                    rptr <= rptr + 1'b1;
+                    state <= S_IDLE;
+                end
+            end
+        end
+        S_READ_ADDRESS: begin
+            if (m_axi_arready) begin
+                m_axi_arvalid <= 0;
+                m_axi_rready <= 1'b1;
+                state <= S_READ_DATA;
+            end
+        end
+        S_READ_DATA: begin
+            if (m_axi_rvalid) begin
+                m_axi_rready <= 0;
+                read_result <= m_axi_rdata;
+                read_ack <= ~read_ack;
+                rptr <= rptr + 1'b1;
+                state <= S_IDLE;
+            end
+        end
+    endcase
+end
+endmodule
+
+
+
+// Drives jtag_axi_master the way the ESP32 host does: a burst write, a burst
+// read of the same words trailing by two scans, and a status load, checking
+// the TDO read-back against a behavioural memory.
+module tb_jtag_axi_master;
+
+localparam WORDS = 16;
+localparam BASE = 32'h00000200;
+
+reg clk;
+reg tck;
+reg tap_capture;
+reg tap_shift;
+reg tap_update;
+reg [103:0] command;
+wire tdo;
+wire [31:0] araddr;
+wire arvalid;
+wire rready;
+wire [31:0] awaddr;
+wire awvalid;
+wire [31:0] wdata;
+wire [3:0] wstrb;
+wire wvalid;
+wire b_ready;
+reg [31:0] rdata;
+reg rvalid;
+reg [31:0] memory [0:1023];
+reg [47:0] captured;
+integer i;
+integer errors;
+
+jtag_axi_master dut(.tck(tck),.tap_capture(tap_capture),.tap_shift(tap_shift),.tap_update(tap_update),.command(command),.tdo(tdo),
+    .clk(clk),
+    .m_axi_araddr(araddr),.m_axi_arvalid(arvalid),.m_axi_arready(1'b1),
+    .m_axi_rdata(rdata),.m_axi_rvalid(rvalid),.m_axi_rready(rready),
+    .m_axi_awaddr(awaddr),.m_axi_awvalid(awvalid),.m_axi_awready(1'b1),
+    .m_axi_wdata(wdata),.m_axi_wstrb(wstrb),.m_axi_wvalid(wvalid),.m_axi_wready(1'b1),
+    .m_b_ready(b_ready),.m_b_valid(1'b1),.m_b_response(2'b00));
+
+always #5 clk = ~clk;
+
+always @(posedge clk) begin
+    if (awvalid && wvalid)
+        memory[awaddr[11:2]] <= wdata;
+    if (arvalid) begin
+        rdata <= memory[araddr[11:2]];
+        rvalid <= 1'b1;
+    end else if (rready && rvalid) begin
+        rvalid <= 0;
+    end
+end
+
+task tck_cycle;
+    begin
+        #40 tck = 1;
+        #40 tck = 0;
+    end
+endtask
+
+// One DR scan ending in RUN-TEST/IDLE: capture, 104 shifts, update, idle
+task scan;
+    input [103:0] word;
+    integer b;
+    begin
+        tap_capture = 1; tck_cycle; tap_capture = 0;
+        tap_shift = 1;
+        for (b = 0; b < 104; b = b + 1) begin
+            if (b < 48)
+                captured[b] = tdo;
+            tck_cycle;
+        end
+        tap_shift = 0;
+        command = word;
+        tap_update = 1; tck_cycle; tap_update = 0;
+        command = 0;
+        for (b = 0; b < 8; b = b + 1)
+            tck_cycle;
+    end
+endtask
+
+initial begin
+    clk = 0; tck = 0;
+    tap_capture = 0; tap_shift = 0; tap_update = 0; command = 0;
+    rvalid = 0; rdata = 0;
+    errors = 0;
+
+    for (i = 0; i < WORDS; i = i + 1)
+        scan({(i ? 8'h4A : 8'h0A), i * 32'h01010101 + 32'h5A, BASE, 32'd0});
+    for (i = 0; i < WORDS; i = i + 1)
+        if (memory[(BASE >> 2) + i] !== i * 32'h01010101 + 32'h5A) begin
+            $display("write %0d: %h", i, memory[(BASE >> 2) + i]);
+            errors = errors + 1;
+        end
+
+    for (i = 0; i < WORDS + 2; i = i + 1) begin
+        if (i == 0)
+            scan({8'h01, 64'd0, BASE});
+        else if (i < WORDS)
+            scan({8'h55, 96'd0});
+        else if (i == WORDS)
+            scan({8'h14, 96'd0});
+        else
+            scan(104'd0);
+        if ((i >= 2) && ((captured[31:0] !== (i - 2) * 32'h01010101 + 32'h5A) || (captured[47:32] !== 16'h0004))) begin
+            $display("read %0d: %h", i - 2, captured);
+            errors = errors + 1;
+        end
+    end
+
+    scan({8'h10, 96'd0});
+    scan(104'd0);
+    if (captured[35] || captured[33]) begin
+        $display("status %h", captured[47:32]);
+        errors = errors + 1;
+    end
+    $display("tb_jtag_axi_master %s", errors ? "FAIL" : "PASS");
+    $finish;
+end
+endmodule
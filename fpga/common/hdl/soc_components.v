@@ -200,7 +200,499 @@ endmodule
 
 
 
+// Loads the softcore memory from the UART. With BURST_PROTOCOL = 0 every word
+// arrives as its own 8-byte address/data tuple (progloader_legacy_axi). With
+// BURST_PROTOCOL = 1 the host sends frames (progloader_burst_axi):
+//   0xA5, base address (4), word count (2), count words, CRC-32 (4)
+// all little-endian, the CRC covering address, count and payload. Each frame
+// is answered on utx with 0x06 if the CRC matched or 0x15 if it did not.
 module progloader_axi(
+clk,rst,urx,utx,reprogram,busy,
+a_axi_araddr,a_axi_arvalid,a_axi_arready,
+a_axi_rdata, a_axi_rready, a_axi_rvalid,
+a_axi_awaddr,a_axi_awvalid,a_axi_awready,
+a_axi_wdata,a_axi_wstrb,a_axi_wvalid,a_axi_wready,
+a_b_ready,a_b_valid,a_b_response
+);
+
+parameter MEM_ADDR_SIZE = 32;
+parameter DATA_WIDTH = 32;
+parameter SIMULATION = 0;
+parameter CLKS_PER_BIT = 83;
+parameter BURST_PROTOCOL = 0;
+
+input                 clk;
+input                 rst;
+input                 urx;
+output                utx;
+input                 reprogram;
+
+output                busy;
+
+output         [MEM_ADDR_SIZE-1:0]            a_axi_awaddr;
+output                        a_axi_awvalid;
+input                            a_axi_awready;
+output         [DATA_WIDTH-1:0]            a_axi_wdata;
+output       [(DATA_WIDTH>>3)-1:0]            a_axi_wstrb;
+output                        a_axi_wvalid;
+input                            a_axi_wready;
+output         [MEM_ADDR_SIZE-1:0]        a_axi_araddr;
+output                        a_axi_arvalid;
+input                            a_axi_arready;
+input         [DATA_WIDTH-1:0]            a_axi_rdata;
+input                            a_axi_rvalid;
+output                            a_axi_rready;
+
+output                        a_b_ready;
+input                            a_b_valid;
+input         [1:0]                    a_b_response;
+
+generate
+if (BURST_PROTOCOL) begin
+    progloader_burst_axi #(.MEM_ADDR_SIZE(MEM_ADDR_SIZE), .DATA_WIDTH(DATA_WIDTH), .CLKS_PER_BIT(CLKS_PER_BIT))
+    core(.clk(clk),.rst(rst),.urx(urx),.utx(utx),.reprogram(reprogram),.busy(busy),
+        .a_axi_araddr(a_axi_araddr),.a_axi_arvalid(a_axi_arvalid),.a_axi_arready(a_axi_arready),
+        .a_axi_rdata(a_axi_rdata),.a_axi_rready(a_axi_rready),.a_axi_rvalid(a_axi_rvalid),
+        .a_axi_awaddr(a_axi_awaddr),.a_axi_awvalid(a_axi_awvalid),.a_axi_awready(a_axi_awready),
+        .a_axi_wdata(a_axi_wdata),.a_axi_wstrb(a_axi_wstrb),.a_axi_wvalid(a_axi_wvalid),.a_axi_wready(a_axi_wready),
+        .a_b_ready(a_b_ready),.a_b_valid(a_b_valid),.a_b_response(a_b_response));
+end else begin
+    assign utx = 1'b1;
+    progloader_legacy_axi #(.MEM_ADDR_SIZE(MEM_ADDR_SIZE), .DATA_WIDTH(DATA_WIDTH), .SIMULATION(SIMULATION), .CLKS_PER_BIT(CLKS_PER_BIT))
+    core(.clk(clk),.rst(rst),.urx(urx),.reprogram(reprogram),.busy(busy),
+        .a_axi_araddr(a_axi_araddr),.a_axi_arvalid(a_axi_arvalid),.a_axi_arready(a_axi_arready),
+        .a_axi_rdata(a_axi_rdata),.a_axi_rready(a_axi_rready),.a_axi_rvalid(a_axi_rvalid),
+        .a_axi_awaddr(a_axi_awaddr),.a_axi_awvalid(a_axi_awvalid),.a_axi_awready(a_axi_awready),
+        .a_axi_wdata(a_axi_wdata),.a_axi_wstrb(a_axi_wstrb),.a_axi_wvalid(a_axi_wvalid),.a_axi_wready(a_axi_wready),
+        .a_b_ready(a_b_ready),.a_b_valid(a_b_valid),.a_b_response(a_b_response));
+end
+endgenerate
+endmodule
+
+
+
+module progloader_burst_axi(
+clk,rst,urx,utx,reprogram,busy,
+a_axi_araddr,a_axi_arvalid,a_axi_arready,
+a_axi_rdata, a_axi_rready, a_axi_rvalid,
+a_axi_awaddr,a_axi_awvalid,a_axi_awready,
+a_axi_wdata,a_axi_wstrb,a_axi_wvalid,a_axi_wready,
+a_b_ready,a_b_valid,a_b_response
+);
+
+parameter MEM_ADDR_SIZE = 32;
+parameter DATA_WIDTH = 32;
+parameter CLKS_PER_BIT = 83;
+
+localparam SYNC_BYTE = 8'hA5;
+localparam ACK_BYTE = 8'h06;
+// S_DATA/S_WRITE write each word as it arrives, before the CRC is checked.
+// A NAKed frame has therefore already changed memory and must be sent again
+// until it is ACKed; with a corrupted address or count the words may even
+// have landed outside the frame's range.
+localparam NAK_BYTE = 8'h15;
+
+localparam S_SYNC = 3'd0;
+localparam S_ADDRESS = 3'd1;
+localparam S_COUNT = 3'd2;
+localparam S_DATA = 3'd3;
+localparam S_WRITE = 3'd4;
+localparam S_CRC = 3'd5;
+
+input                 clk;
+input                 rst;
+input                 urx;
+output                utx;
+input                 reprogram;
+
+output                busy;
+
+output    reg     [MEM_ADDR_SIZE-1:0]            a_axi_awaddr;
+output    reg                        a_axi_awvalid;
+input                            a_axi_awready;
+output    reg     [DATA_WIDTH-1:0]            a_axi_wdata;
+output       [(DATA_WIDTH>>3)-1:0]            a_axi_wstrb;
+output    reg                        a_axi_wvalid;
+input                            a_axi_wready;
+output         [MEM_ADDR_SIZE-1:0]        a_axi_araddr;
+output                        a_axi_arvalid;
+input                            a_axi_arready;
+input         [DATA_WIDTH-1:0]            a_axi_rdata;
+input                            a_axi_rvalid;
+output                            a_axi_rready;
+
+output                        a_b_ready;
+input                            a_b_valid;
+input         [1:0]                    a_b_response;
+
+reg [2:0] state;
+reg [1:0] byte_index;
+reg [15:0] count;
+reg [31:0] shift;
+reg [31:0] crc;
+reg rx_pending;
+reg [7:0] rx_hold;
+reg tx_dv;
+reg [7:0] tx_byte;
+wire rx_dv;
+wire [7:0] rx_byte;
+wire [31:0] word = {rx_hold, shift[31:8]};
+// A byte that arrives during an AXI write waits in rx_hold
+wire take = rx_pending && (state != S_WRITE);
+wire aw_done = !a_axi_awvalid || a_axi_awready;
+wire w_done = !a_axi_wvalid || a_axi_wready;
+
+assign a_axi_wstrb = {(DATA_WIDTH>>3){1'b1}};
+assign a_axi_araddr = 0;
+assign a_axi_arvalid = 0;
+assign a_axi_rready = 0;
+assign a_b_ready = 1'b1;
+assign busy = (state != S_SYNC);
+
+function [31:0] crc32_byte;
+    input [31:0] crc_in;
+    input [7:0] data;
+    integer i;
+    reg [31:0] c;
+    begin
+        c = crc_in;
+        for (i = 0; i < 8; i = i + 1)
+            c = (c[0] ^ data[i]) ? ((c >> 1) ^ 32'hEDB88320) : (c >> 1);
+        crc32_byte = c;
+    end
+endfunction
+
+uart_rx  #(.CLKS_PER_BIT(CLKS_PER_BIT)) rx(.i_Clock(clk),.i_Rx_Serial(urx),.o_Rx_DV(rx_dv),.o_Rx_Byte(rx_byte));
+uart_tx  #(.CLKS_PER_BIT(CLKS_PER_BIT)) tx(.i_Clock(clk),.i_Tx_DV(tx_dv),.i_Tx_Byte(tx_byte),.o_Tx_Active(),.o_Tx_Serial(utx),.o_Tx_Done());
+
+always @(posedge clk) begin
+    if (rst || !reprogram) begin
+        rx_pending <= 0;
+        rx_hold <= 0;
+    end else if (rx_dv) begin
+        rx_pending <= 1'b1;
+        rx_hold <= rx_byte;
+    end else if (take) begin
+        rx_pending <= 0;
+    end
+end
+
+always @(posedge clk) begin
+    if (rst || !reprogram) begin
+        state <= S_SYNC;
+        byte_index <= 0;
+        count <= 0;
+        shift <= 0;
+        crc <= 0;
+        tx_dv <= 0;
+        tx_byte <= 0;
+        a_axi_awaddr <= 0;
+        a_axi_awvalid <= 0;
+        a_axi_wdata <= 0;
+        a_axi_wvalid <= 0;
+    end else begin
+        tx_dv <= 0;
+        if (take) begin
+            shift <= word;
+            byte_index <= byte_index + 2'd1;
+            if ((state != S_SYNC) && (state != S_CRC))
+                crc <= crc32_byte(crc, rx_hold);
+        end
+        case (state)
+            S_SYNC: begin
+                if (take && (rx_hold == SYNC_BYTE)) begin
+                    crc <= 32'hFFFFFFFF;
+                    byte_index <= 0;
+                    state <= S_ADDRESS;
+                end
+            end
+            S_ADDRESS: begin
+                if (take && (byte_index == 2'd3)) begin
+                    a_axi_awaddr <= word;
+                    byte_index <= 0;
+                    state <= S_COUNT;
+                end
+            end
+            S_COUNT: begin
+                if (take && (byte_index == 2'd1)) begin
+                    count <= word[31:16];
+                    byte_index <= 0;
+                    state <= (word[31:16] == 0) ? S_CRC : S_DATA;
+                end
+            end
+            S_DATA: begin
+                if (take && (byte_index == 2'd3)) begin
+                    a_axi_wdata <= word;
+                    a_axi_awvalid <= 1'b1;
+                    a_axi_wvalid <= 1'b1;
+                    state <= S_WRITE;
+                end
+            end
+            S_WRITE: begin
+                if (a_axi_awready)
+                    a_axi_awvalid <= 0;
+                if (a_axi_wready)
+                    a_axi_wvalid <= 0;
+                if (aw_done && w_done) begin
+                    a_axi_awaddr <= a_axi_awaddr + 4;
+                    count <= count - 16'd1;
+                    state <= (count == 16'd1) ? S_CRC : S_DATA;
+                end
+            end
+            S_CRC: begin
+                if (take && (byte_index == 2'd3)) begin
+                    tx_byte <= (word == ~crc) ? ACK_BYTE : NAK_BYTE;
+                    tx_dv <= 1'b1;
+                    state <= S_SYNC;
+                end
+            end
+        endcase
+    end
+end
+endmodule
+
+
+
+// Feeds the same words to a burst and a legacy loader over their UARTs,
+// checks what lands in memory and the burst loader's ACK/NAK replies, and
+// reports the bytes sent on the wire per loaded word for each protocol.
+module tb_progloader_axi;
+
+localparam CLKS_PER_BIT = 8;
+localparam WORDS = 64;
+localparam BASE = 32'h00000100;
+
+reg clk;
+reg rst;
+reg reprogram;
+reg burst_rx;
+reg legacy_rx;
+wire burst_tx;
+wire [31:0] burst_awaddr;
+wire [31:0] burst_wdata;
+wire burst_awvalid;
+wire burst_wvalid;
+wire [31:0] legacy_awaddr;
+wire [31:0] legacy_wdata;
+wire legacy_awvalid;
+wire legacy_wvalid;
+reg [31:0] burst_mem [0:1023];
+reg [31:0] legacy_mem [0:1023];
+reg [31:0] image [0:WORDS-1];
+reg [7:0] reply;
+reg [31:0] crc;
+integer burst_bytes;
+integer legacy_bytes;
+integer errors;
+integer i;
+
+always #5 clk = ~clk;
+
+function [31:0] crc32_byte;
+    input [31:0] crc_in;
+    input [7:0] data;
+    integer k;
+    reg [31:0] c;
+    begin
+        c = crc_in;
+        for (k = 0; k < 8; k = k + 1)
+            c = (c[0] ^ data[k]) ? ((c >> 1) ^ 32'hEDB88320) : (c >> 1);
+        crc32_byte = c;
+    end
+endfunction
+
+task send_burst_byte(input [7:0] b);
+    integer k;
+    begin
+        burst_rx = 0;
+        repeat (CLKS_PER_BIT) @(posedge clk);
+        for (k = 0; k < 8; k = k + 1) begin
+            burst_rx = b[k];
+            repeat (CLKS_PER_BIT) @(posedge clk);
+        end
+        burst_rx = 1;
+        repeat (CLKS_PER_BIT) @(posedge clk);
+        burst_bytes = burst_bytes + 1;
+    end
+endtask
+
+task send_legacy_byte(input [7:0] b);
+    integer k;
+    begin
+        legacy_rx = 0;
+        repeat (CLKS_PER_BIT) @(posedge clk);
+        for (k = 0; k < 8; k = k + 1) begin
+            legacy_rx = b[k];
+            repeat (CLKS_PER_BIT) @(posedge clk);
+        end
+        legacy_rx = 1;
+        repeat (CLKS_PER_BIT) @(posedge clk);
+        legacy_bytes = legacy_bytes + 1;
+    end
+endtask
+
+task send_burst_hashed(input [7:0] b);
+    begin
+        crc = crc32_byte(crc, b);
+        send_burst_byte(b);
+    end
+endtask
+
+task receive_reply;
+    integer k;
+    begin
+        @(negedge burst_tx);
+        repeat (CLKS_PER_BIT + CLKS_PER_BIT/2) @(posedge clk);
+        for (k = 0; k < 8; k = k + 1) begin
+            reply[k] = burst_tx;
+            repeat (CLKS_PER_BIT) @(posedge clk);
+        end
+    end
+endtask
+
+task send_frame(input corrupt);
+    begin
+        crc = 32'hFFFFFFFF;
+        send_burst_byte(8'hA5);
+        for (i = 0; i < 4; i = i + 1)
+            send_burst_hashed(BASE >> (8*i));
+        send_burst_hashed(WORDS & 8'hFF);
+        send_burst_hashed(WORDS >> 8);
+        for (i = 0; i < 4*WORDS; i = i + 1)
+            send_burst_hashed(image[i/4] >> (8*(i%4)));
+        crc = ~crc ^ (corrupt ? 32'h1 : 32'h0);
+        fork
+            receive_reply;
+            for (i = 0; i < 4; i = i + 1)
+                send_burst_byte(crc >> (8*i));
+        join
+    end
+endtask
+
+initial begin
+    clk = 0;
+    rst = 1;
+    reprogram = 0;
+    burst_rx = 1;
+    legacy_rx = 1;
+    burst_bytes = 0;
+    legacy_bytes = 0;
+    errors = 0;
+    for (i = 0; i < WORDS; i = i + 1)
+        image[i] = {i[7:0] ^ 8'h5A, i[7:0], 8'hC3, ~i[7:0]};
+    #100;
+    rst = 0;
+    reprogram = 1;
+    #100;
+
+    send_frame(0);
+    if (reply != 8'h06) begin
+        $display("FAIL: burst frame answered %02x instead of ACK", reply);
+        errors = errors + 1;
+    end
+    for (i = 0; i < WORDS; i = i + 1) begin
+        if (burst_mem[(BASE >> 2) + i] !== image[i]) begin
+            $display("FAIL: burst word %0d is %08x, expected %08x", i, burst_mem[(BASE >> 2) + i], image[i]);
+            errors = errors + 1;
+        end
+    end
+    $display("burst:  %0d bytes for %0d words", burst_bytes, WORDS);
+
+    burst_bytes = 0;
+    send_frame(1);
+    if (reply != 8'h15) begin
+        $display("FAIL: corrupted frame answered %02x instead of NAK", reply);
+        errors = errors + 1;
+    end
+
+    for (i = 0; i < WORDS; i = i + 1) begin
+        send_legacy_byte((BASE + 4*i) >> 0);
+        send_legacy_byte((BASE + 4*i) >> 8);
+        send_legacy_byte((BASE + 4*i) >> 16);
+        send_legacy_byte((BASE + 4*i) >> 24);
+        send_legacy_byte(image[i] >> 0);
+        send_legacy_byte(image[i] >> 8);
+        send_legacy_byte(image[i] >> 16);
+        send_legacy_byte(image[i] >> 24);
+    end
+    repeat (10*CLKS_PER_BIT) @(posedge clk);
+    for (i = 0; i < WORDS; i = i + 1) begin
+        if (legacy_mem[(BASE >> 2) + i] !== image[i]) begin
+            $display("FAIL: legacy word %0d is %08x, expected %08x", i, legacy_mem[(BASE >> 2) + i], image[i]);
+            errors = errors + 1;
+        end
+    end
+    $display("legacy: %0d bytes for %0d words", legacy_bytes, WORDS);
+    if (errors == 0)
+        $display("PASS");
+    $finish;
+end
+
+always @(posedge clk) begin
+    if (burst_awvalid && burst_wvalid)
+        burst_mem[burst_awaddr >> 2] <= burst_wdata;
+    if (legacy_awvalid && legacy_wvalid)
+        legacy_mem[legacy_awaddr >> 2] <= legacy_wdata;
+end
+
+progloader_axi
+#(.MEM_ADDR_SIZE(32), .DATA_WIDTH(32), .CLKS_PER_BIT(CLKS_PER_BIT), .BURST_PROTOCOL(1))
+uut_burst(
+    .clk(clk),
+    .rst(rst),
+    .urx(burst_rx),
+    .utx(burst_tx),
+    .reprogram(reprogram),
+    .busy(),
+    .a_axi_araddr(),
+    .a_axi_arvalid(),
+    .a_axi_arready(1'b0),
+    .a_axi_rdata(32'd0),
+    .a_axi_rready(),
+    .a_axi_rvalid(1'b0),
+    .a_axi_awaddr(burst_awaddr),
+    .a_axi_awvalid(burst_awvalid),
+    .a_axi_awready(1'b1),
+    .a_axi_wdata(burst_wdata),
+    .a_axi_wstrb(),
+    .a_axi_wvalid(burst_wvalid),
+    .a_axi_wready(1'b1),
+    .a_b_ready(),
+    .a_b_valid(1'b1),
+    .a_b_response(2'd0)
+    );
+
+progloader_axi
+#(.MEM_ADDR_SIZE(32), .DATA_WIDTH(32), .CLKS_PER_BIT(CLKS_PER_BIT), .BURST_PROTOCOL(0))
+uut_legacy(
+    .clk(clk),
+    .rst(rst),
+    .urx(legacy_rx),
+    .utx(),
+    .reprogram(reprogram),
+    .busy(),
+    .a_axi_araddr(),
+    .a_axi_arvalid(),
+    .a_axi_arready(1'b0),
+    .a_axi_rdata(32'd0),
+    .a_axi_rready(),
+    .a_axi_rvalid(1'b0),
+    .a_axi_awaddr(legacy_awaddr),
+    .a_axi_awvalid(legacy_awvalid),
+    .a_axi_awready(1'b1),
+    .a_axi_wdata(legacy_wdata),
+    .a_axi_wstrb(),
+    .a_axi_wvalid(legacy_wvalid),
+    .a_axi_wready(1'b1),
+    .a_b_ready(),
+    .a_b_valid(1'b1),
+    .a_b_response(2'd0)
+    );
+endmodule
+
+
+
+module progloader_legacy_axi(
 clk,rst,urx,reprogram,busy,
 a_axi_araddr,a_axi_arvalid,a_axi_arready,
 a_axi_rdata, a_axi_rready, a_axi_rvalid,
@@ -429,6 +921,293 @@ endgenerate
 endmodule
 
 
+// Computes the CRC-32 (IEEE 802.3, as zlib) of a memory range so a loaded
+// image can be checked without reading it back word by word. Registers on
+// the a port: 0x0 start address, 0x4 length in bytes, 0x8 control (write
+// bit 0 to start) / status ({error, done, busy}), 0xC result. A start with
+// an address or length that is not a multiple of 4 reads nothing and sets
+// error instead of done. Memory is read through the m port one word at a
+// time, least significant byte first.
+module crc32_axi(
+clk,rst,
+a_axi_araddr,a_axi_arvalid,a_axi_arready,
+a_axi_awaddr,a_axi_awvalid,a_axi_awready,
+a_axi_rdata,a_axi_rvalid,a_axi_rready,
+a_axi_wdata,a_axi_wstrb,a_axi_wvalid,a_axi_wready,
+a_b_ready,a_b_valid,a_b_response,
+m_axi_araddr,m_axi_arvalid,m_axi_arready,
+m_axi_rdata,m_axi_rvalid,m_axi_rready,
+m_axi_awaddr,m_axi_awvalid,m_axi_awready,
+m_axi_wdata,m_axi_wstrb,m_axi_wvalid,m_axi_wready,
+m_b_ready,m_b_valid,m_b_response
+);
+
+parameter ADDR_WIDTH = 32;
+parameter DATA_WIDTH = 32;
+parameter MEM_ADDR_SIZE = 32;
+
+input clk;
+input rst;
+
+input [ADDR_WIDTH-1:0]             a_axi_araddr;
+input                  a_axi_arvalid;
+output              a_axi_arready;
+
+input [ADDR_WIDTH-1:0]             a_axi_awaddr;
+input                  a_axi_awvalid;
+output             a_axi_awready;
+
+output reg [DATA_WIDTH-1:0]         a_axi_rdata;
+output reg                 a_axi_rvalid;
+input                  a_axi_rready;
+
+input [DATA_WIDTH-1:0]             a_axi_wdata;
+input [(DATA_WIDTH>>3)-1:0]             a_axi_wstrb;
+input                  a_axi_wvalid;
+output              a_axi_wready;
+
+input                 a_b_ready;
+output     reg            a_b_valid;
+output [1:0]         a_b_response;
+
+output reg [MEM_ADDR_SIZE-1:0]        m_axi_araddr;
+output reg                        m_axi_arvalid;
+input                            m_axi_arready;
+input         [DATA_WIDTH-1:0]            m_axi_rdata;
+input                            m_axi_rvalid;
+output reg                            m_axi_rready;
+
+output [MEM_ADDR_SIZE-1:0]            m_axi_awaddr;
+output                        m_axi_awvalid;
+input                            m_axi_awready;
+output [DATA_WIDTH-1:0]            m_axi_wdata;
+output [(DATA_WIDTH>>3)-1:0]            m_axi_wstrb;
+output                        m_axi_wvalid;
+input                            m_axi_wready;
+output                        m_b_ready;
+input                            m_b_valid;
+input         [1:0]                    m_b_response;
+
+localparam STATE_IDLE = 2'd0;
+localparam STATE_ADDRESS = 2'd1;
+localparam STATE_DATA = 2'd2;
+
+reg [1:0] state;
+reg [31:0] start_address;
+reg [31:0] length;
+reg [31:0] words_left;
+reg [31:0] crc;
+reg done;
+reg error;
+wire write = a_axi_awvalid && a_axi_wvalid;
+
+assign a_axi_arready = 1'b1;
+assign a_axi_awready = write;
+assign a_axi_wready = write;
+assign a_b_response = 0;
+
+assign m_axi_awaddr = 0;
+assign m_axi_awvalid = 0;
+assign m_axi_wdata = 0;
+assign m_axi_wstrb = 0;
+assign m_axi_wvalid = 0;
+assign m_b_ready = 1'b1;
+
+function [31:0] crc32_word;
+    input [31:0] crc_in;
+    input [31:0] data;
+    integer i;
+    reg [31:0] c;
+    begin
+        c = crc_in;
+        for (i = 0; i < 32; i = i + 1)
+            c = (c[0] ^ data[i]) ? ((c >> 1) ^ 32'hEDB88320) : (c >> 1);
+        crc32_word = c;
+    end
+endfunction
+
+always @(posedge clk) begin
+    if (rst) begin
+        a_axi_rvalid <= 0;
+        a_axi_rdata <= 0;
+    end else if (a_axi_arvalid) begin
+        a_axi_rvalid <= 1;
+        case (a_axi_araddr[3:2])
+            2'd0: a_axi_rdata <= start_address;
+            2'd1: a_axi_rdata <= length;
+            2'd2: a_axi_rdata <= {29'd0, error, done, (state != STATE_IDLE)};
+            2'd3: a_axi_rdata <= ~crc;
+        endcase
+    end else if (a_axi_rready) begin
+        a_axi_rvalid <= 0;
+    end
+end
+
+always @(posedge clk) begin
+    if (rst) begin
+        a_b_valid <= 0;
+        start_address <= 0;
+        length <= 0;
+    end else if (write) begin
+        a_b_valid <= 1;
+        if (a_axi_awaddr[3:2] == 2'd0)
+            start_address <= a_axi_wdata;
+        else if (a_axi_awaddr[3:2] == 2'd1)
+            length <= a_axi_wdata;
+    end else if (a_b_ready) begin
+        a_b_valid <= 0;
+    end
+end
+
+always @(posedge clk) begin
+    if (rst) begin
+        state <= STATE_IDLE;
+        done <= 0;
+        error <= 0;
+        crc <= 32'hFFFFFFFF;
+        words_left <= 0;
+        m_axi_araddr <= 0;
+        m_axi_arvalid <= 0;
+        m_axi_rready <= 0;
+    end else if (state == STATE_IDLE) begin
+        if (write && (a_axi_awaddr[3:2] == 2'd2) && a_axi_wdata[0]) begin
+            crc <= 32'hFFFFFFFF;
+            m_axi_araddr <= start_address;
+            words_left <= length >> 2;
+            error <= (start_address[1:0] != 0) || (length[1:0] != 0);
+            done <= (length == 0) && (start_address[1:0] == 0);
+            if ((length != 0) && (start_address[1:0] == 0) && (length[1:0] == 0)) begin
+                m_axi_arvalid <= 1;
+                state <= STATE_ADDRESS;
+            end
+        end
+    end else if (state == STATE_ADDRESS) begin
+        if (m_axi_arready) begin
+            m_axi_arvalid <= 0;
+            m_axi_rready <= 1;
+            state <= STATE_DATA;
+        end
+    end else if (state == STATE_DATA) begin
+        if (m_axi_rvalid) begin
+            m_axi_rready <= 0;
+            crc <= crc32_word(crc, m_axi_rdata);
+            words_left <= words_left - 32'd1;
+            if (words_left == 32'd1) begin
+                done <= 1;
+                state <= STATE_IDLE;
+            end else begin
+                m_axi_araddr <= m_axi_araddr + 4;
+                m_axi_arvalid <= 1;
+                state <= STATE_ADDRESS;
+            end
+        end
+    end
+end
+endmodule
+
+
+
+module tb_crc32_axi;
+
+reg clk;
+reg rst;
+reg [31:0] awaddr;
+reg [31:0] wdata;
+reg wvalid;
+reg [31:0] araddr;
+reg arvalid;
+wire [31:0] rdata;
+wire [31:0] m_araddr;
+wire m_arvalid;
+wire m_rready;
+reg m_rvalid;
+reg [31:0] mem [0:3];
+integer errors;
+
+// The first 8 bytes are "12345678", whose CRC-32 (read back at 0xC) is 0x9AE0DAAF
+initial begin
+    mem[0] = 32'h34333231;
+    mem[1] = 32'h38373635;
+    mem[2] = 32'h00000039;
+    mem[3] = 32'h0;
+    clk = 0;
+    rst = 1;
+    awaddr = 0;
+    wdata = 0;
+    wvalid = 0;
+    araddr = 0;
+    arvalid = 0;
+    errors = 0;
+    #100;
+    rst = 0;
+    #100;
+    awaddr = 0; wdata = 0; wvalid = 1; #10;
+    awaddr = 4; wdata = 8; #10;
+    awaddr = 8; wdata = 1; #10;
+    wvalid = 0;
+    #500;
+    araddr = 8; arvalid = 1; #10;
+    arvalid = 0; #10;
+    if (rdata[1:0] != 2'b10) begin
+        $display("FAIL: status is %08x, expected done and not busy", rdata);
+        errors = errors + 1;
+    end
+    araddr = 12; arvalid = 1; #10;
+    arvalid = 0; #10;
+    if (rdata != 32'h9AE0DAAF) begin
+        $display("FAIL: CRC is %08x, expected 9ae0daaf", rdata);
+        errors = errors + 1;
+    end
+    if (errors == 0)
+        $display("PASS");
+    $finish;
+end
+
+always #5 clk = ~clk;
+
+always @(posedge clk) m_rvalid <= m_rready && !m_rvalid;
+
+crc32_axi
+#(.ADDR_WIDTH(32), .DATA_WIDTH(32), .MEM_ADDR_SIZE(32))
+uut(
+    .clk(clk),
+    .rst(rst),
+    .a_axi_araddr(araddr),
+    .a_axi_arvalid(arvalid),
+    .a_axi_arready(),
+    .a_axi_awaddr(awaddr),
+    .a_axi_awvalid(wvalid),
+    .a_axi_awready(),
+    .a_axi_rdata(rdata),
+    .a_axi_rvalid(),
+    .a_axi_rready(1'b1),
+    .a_axi_wdata(wdata),
+    .a_axi_wstrb(4'hF),
+    .a_axi_wvalid(wvalid),
+    .a_axi_wready(),
+    .a_b_ready(1'b1),
+    .a_b_valid(),
+    .a_b_response(),
+    .m_axi_araddr(m_araddr),
+    .m_axi_arvalid(m_arvalid),
+    .m_axi_arready(1'b1),
+    .m_axi_rdata(mem[m_araddr[3:2]]),
+    .m_axi_rvalid(m_rvalid),
+    .m_axi_rready(m_rready),
+    .m_axi_awaddr(),
+    .m_axi_awvalid(),
+    .m_axi_awready(1'b0),
+    .m_axi_wdata(),
+    .m_axi_wstrb(),
+    .m_axi_wvalid(),
+    .m_axi_wready(1'b0),
+    .m_b_ready(),
+    .m_b_valid(1'b0),
+    .m_b_response(2'd0)
+    );
+endmodule
+
+
 module uart_axi(
 clk,
 rst,